@@ -0,0 +1,190 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_spool.h"
+
+/* An arena is a bump allocator: a job, its identifier, its assets and
+ * their strings are all carved from the job's arena, and released
+ * together when the job is freed, rather than individually.
+ *
+ * Each arena has an ARENA_SIZE block allocated along with it, which is
+ * enough for a typical job; allocations which don't fit are satisfied
+ * from additional blocks, which are freed when the arena is released.
+ * Released arenas are kept on a free-list (of up to ARENA_POOL) for
+ * re-use, so in the steady state creating a job involves no calls to
+ * malloc() at all.
+ *
+ * An arena may only be used by one thread at a time; this is true of a
+ * job's arena, because a job is only modified by whichever stage is
+ * processing it.
+ */
+
+#define ARENA_SIZE                      4096
+#define ARENA_POOL                      64
+#define ARENA_ALIGN                     16
+
+#define ALIGN(n)                        (((n) + (ARENA_ALIGN - 1)) & ~((size_t) ARENA_ALIGN - 1))
+
+struct arena_block
+{
+	struct arena_block *next;
+};
+
+struct arena_struct
+{
+	/* Next arena in the free-list */
+	ARENA *next;
+	/* Additional blocks */
+	struct arena_block *blocks;
+	char *ptr;
+	size_t avail;
+};
+
+/* The size of an arena's header, leaving its first block aligned */
+#define ARENA_HEADER                    ALIGN(sizeof(ARENA))
+#define BLOCK_HEADER                    ALIGN(sizeof(struct arena_block))
+
+static ARENA *pool;
+static size_t npool;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Create an arena, re-using a released one if possible */
+ARENA *
+arena_create(void)
+{
+	ARENA *p;
+
+	pthread_mutex_lock(&pool_lock);
+	p = pool;
+	if(p)
+	{
+		pool = p->next;
+		npool--;
+	}
+	pthread_mutex_unlock(&pool_lock);
+	if(!p)
+	{
+		p = (ARENA *) malloc(ARENA_HEADER + ARENA_SIZE);
+		if(!p)
+		{
+			return NULL;
+		}
+	}
+	p->next = NULL;
+	p->blocks = NULL;
+	p->ptr = (char *) p + ARENA_HEADER;
+	p->avail = ARENA_SIZE;
+	return p;
+}
+
+/* Release an arena and everything allocated from it */
+void
+arena_release(ARENA *arena)
+{
+	struct arena_block *b;
+
+	if(!arena)
+	{
+		return;
+	}
+	while(arena->blocks)
+	{
+		b = arena->blocks;
+		arena->blocks = b->next;
+		free(b);
+	}
+	pthread_mutex_lock(&pool_lock);
+	if(npool < ARENA_POOL)
+	{
+		arena->next = pool;
+		pool = arena;
+		npool++;
+		arena = NULL;
+	}
+	pthread_mutex_unlock(&pool_lock);
+	free(arena);
+}
+
+/* Allocate memory from an arena */
+void *
+arena_alloc(ARENA *arena, size_t size)
+{
+	struct arena_block *b;
+	size_t bsize;
+	void *p;
+
+	size = ALIGN(size ? size : 1);
+	if(size > arena->avail)
+	{
+		bsize = (size > ARENA_SIZE ? size : ARENA_SIZE);
+		b = (struct arena_block *) malloc(BLOCK_HEADER + bsize);
+		if(!b)
+		{
+			return NULL;
+		}
+		b->next = arena->blocks;
+		arena->blocks = b;
+		if(size == bsize)
+		{
+			/* An oversized allocation gets a block to itself, leaving the
+			 * current block available for whatever comes next
+			 */
+			return (char *) b + BLOCK_HEADER;
+		}
+		arena->ptr = (char *) b + BLOCK_HEADER;
+		arena->avail = bsize;
+	}
+	p = arena->ptr;
+	arena->ptr += size;
+	arena->avail -= size;
+	return p;
+}
+
+/* Allocate zero-filled memory from an arena */
+void *
+arena_calloc(ARENA *arena, size_t size)
+{
+	void *p;
+
+	p = arena_alloc(arena, size);
+	if(p)
+	{
+		memset(p, 0, size);
+	}
+	return p;
+}
+
+/* Copy a string into an arena */
+char *
+arena_strdup(ARENA *arena, const char *s)
+{
+	size_t l;
+	char *p;
+
+	l = strlen(s) + 1;
+	p = (char *) arena_alloc(arena, l);
+	if(!p)
+	{
+		return NULL;
+	}
+	memcpy(p, s, l);
+	return p;
+}
+
@@ -20,7 +20,8 @@
 
 #include "p_spool.h"
 
-static void updatepath(ASSET *asset);
+static char *asset_reserve(ASSET *asset, size_t len);
+static void updatepath(ASSET *asset, const char *path);
 
 /* Create a new asset */
 ASSET *
@@ -36,27 +37,75 @@ asset_create()
 	return p;
 }
 
-/* Free an asset */
+/* Create a new asset within an arena (usually that of the job it will
+ * belong to); a path too long to be stored inline will be allocated from
+ * the same arena, and released along with it.
+ */
+ASSET *
+asset_create_arena(ARENA *arena)
+{
+	ASSET *p;
+
+	if(!arena)
+	{
+		return asset_create();
+	}
+	p = (ASSET *) arena_calloc(arena, sizeof(ASSET));
+	if(!p)
+	{
+		return NULL;
+	}
+	p->arena = arena;
+	return p;
+}
+
+/* Create a copy of an asset within an arena */
+ASSET *
+asset_copy(ARENA *arena, const ASSET *src)
+{
+	ASSET *p;
+
+	p = asset_create_arena(arena);
+	if(!p)
+	{
+		return NULL;
+	}
+	memcpy(asset_reserve(p, src->len), ASSET_PATH(src), src->len + 1);
+	p->len = src->len;
+	p->basename = src->basename;
+	p->ext = src->ext;
+	asset_copy_attributes(p, src);
+	return p;
+}
+
+/* Free an asset; an asset allocated from an arena is released along with
+ * the arena instead
+ */
 int
 asset_free(ASSET *asset)
 {
-	if(!asset)
+	if(!asset || asset->arena)
 	{
 		return 0;
 	}
-	free(asset->path);
-	free(asset->type);
+	free(asset->heap);
 	free(asset);
 	return 0;
 }
 
-/* Reset an asset to its initial state */
+/* Reset an asset to its initial state, keeping any storage it has for
+ * re-use
+ */
 int
 asset_reset(ASSET *asset)
 {	
-	free(asset->path);
-	free(asset->type);
-	memset(asset, 0, sizeof(ASSET));
+	asset->len = 0;
+	asset->basename = 0;
+	asset->ext = 0;
+	asset->buf[0] = 0;
+	asset->type = NULL;
+	asset->container = 0;
+	asset->sidecar = 0;
 	return 0;
 }
 
@@ -65,24 +114,14 @@ int
 asset_set_path(ASSET *asset, const char *path)
 {
 	char *p;
+	size_t l;
 
-	if(path)
-	{
-		p = strdup(path);
-		if(!p)
-		{
-			fprintf(stderr, "%s: failed to allocate memory for asset path\n", short_program_name);
-			exit(EXIT_FAILURE);
-		}
-	}
-	else
-	{
-		p = NULL;
-	}
-	free(asset->path);
-	asset->path = p;
-	fprintf(stderr, "%s: asset path is now %s\n", short_program_name, asset->path);
-	updatepath(asset);	
+	l = (path ? strlen(path) : 0);
+	p = asset_reserve(asset, l);
+	memcpy(p, (path ? path : ""), l + 1);
+	asset->len = l;
+	LOG(LOG_DEBUG, "asset path is now %s\n", p);
+	updatepath(asset, p);
 	return 0;
 }
 
@@ -91,24 +130,20 @@ int
 asset_set_path_basedir(ASSET *asset, const char *basedir, size_t baselen, const char *path)
 {
 	char *p;
+	size_t l;
 
 	if(!baselen)
 	{
 		baselen = strlen(basedir);
 	}
-	p = (char *) malloc(baselen + strlen(path) + 2);
-	if(!p)
-	{
-		fprintf(stderr, "%s: failed to allocate memory for asset path\n", short_program_name);
-		exit(EXIT_FAILURE);
-	}
-	strcpy(p, basedir);
+	l = strlen(path);
+	p = asset_reserve(asset, baselen + 1 + l);
+	memcpy(p, basedir, baselen);
 	p[baselen] = '/';
-	strcpy(&(p[baselen + 1]), path);
-	free(asset->path);
-	asset->path = p;
-	fprintf(stderr, "%s: asset path is now %s\n", short_program_name, asset->path);
-	updatepath(asset);
+	memcpy(&(p[baselen + 1]), path, l + 1);
+	asset->len = baselen + 1 + l;
+	LOG(LOG_DEBUG, "asset path is now %s\n", p);
+	updatepath(asset, p);
 	return 0;
 }
 
@@ -116,53 +151,34 @@ int
 asset_set_path_basedir_ext(ASSET *asset, const char *basedir, size_t baselen, const char *name, char *ext)
 {
 	char *p;
-	size_t l;
+	size_t l, el;
 
 	if(!baselen)
 	{
 		baselen = strlen(basedir);
 	}
 	l = strlen(name);
-	p = (char *) malloc(baselen + l + strlen(ext) + 2);
-	if(!p)
-	{
-		fprintf(stderr, "%s: failed to allocate memory for asset path\n", short_program_name);
-		exit(EXIT_FAILURE);
-	}
-	strcpy(p, basedir);
+	el = strlen(ext);
+	p = asset_reserve(asset, baselen + 1 + l + el);
+	memcpy(p, basedir, baselen);
 	p[baselen] = '/';
-	strcpy(&(p[baselen + 1]), name);
-	strcpy(&(p[baselen + 1 + l]), ext);
-	free(asset->path);
-	asset->path = p;
-	fprintf(stderr, "%s: asset path is now %s\n", short_program_name, asset->path);
-	updatepath(asset);
+	memcpy(&(p[baselen + 1]), name, l);
+	memcpy(&(p[baselen + 1 + l]), ext, el + 1);
+	asset->len = baselen + 1 + l + el;
+	LOG(LOG_DEBUG, "asset path is now %s\n", p);
+	updatepath(asset, p);
 	return 0;	
 }
 
 
-/* Set or reset the MIME type of an asset */
+/* Set or reset the MIME type of an asset; types are interned (see
+ * type_intern()), so this never allocates
+ */
 int
-asset_set_type(ASSET *asset, const char *type)
+asset_set_type(ASSET *asset, const MIMETYPE *type)
 {
-	char *p;
-
-	if(type)
-	{
-		p = strdup(type);
-		if(!p)
-		{
-			fprintf(stderr, "%s: failed to allocate memory for MIME type of %s\n", short_program_name, asset->path);
-			exit(EXIT_FAILURE);
-		}
-	}
-	else
-	{
-		p = NULL;
-	}
-	free(asset->type);
-	asset->type = p;
-	fprintf(stderr, "%s: MIME type of %s is %s\n", short_program_name, asset->path, asset->type);
+	asset->type = type;
+	LOG(LOG_DEBUG, "MIME type of %s is %s\n", ASSET_PATH(asset), (type ? type->name : "(none)"));
 	return 0;
 }
 
@@ -175,32 +191,66 @@ asset_copy_attributes(ASSET *dest, const ASSET *src)
 	return 0;
 }
 
-static void
-updatepath(ASSET *asset)
+/* Return a buffer able to hold a path of len characters (plus the
+ * terminator): the inline buffer if it's large enough, and otherwise the
+ * asset's heap storage, which is only (re-)allocated if it's too small.
+ * The new path must not overlap the asset's existing one.
+ */
+static char *
+asset_reserve(ASSET *asset, size_t len)
 {
-	char *t, *p;
-	
-	if(!asset->path)
+	char *p;
+
+	if(len < ASSET_INLINE)
+	{
+		return asset->buf;
+	}
+	if(len < asset->heapsize)
 	{
-		asset->ext = NULL;
-		return;
+		return asset->heap;
 	}
-	p = strrchr(asset->path, '/');
-	t = strrchr(asset->path, '.');
-	if(!t || (p && p > t))
+	if(asset->arena)
 	{
-		asset->ext = strchr(asset->path, 0);
+		p = (char *) arena_alloc(asset->arena, len + 1);
 	}
 	else
 	{
-		asset->ext = t;
+		p = (char *) malloc(len + 1);
 	}
-	if(p)
+	if(!p)
 	{
-		asset->basename = p + 1;
+		LOG(LOG_ERR, "failed to allocate memory for asset\n");
+		exit(EXIT_FAILURE);
 	}
-	else
+	if(!asset->arena)
 	{
-		asset->basename = asset->path;
+		free(asset->heap);
+	}
+	asset->heap = p;
+	asset->heapsize = len + 1;
+	return p;
+}
+
+/* Locate the basename and extension of a newly-set path, in a single
+ * pass backwards from its end to the last '/'
+ */
+static void
+updatepath(ASSET *asset, const char *path)
+{
+	size_t c;
+
+	asset->basename = 0;
+	asset->ext = asset->len;
+	for(c = asset->len; c > 0; c--)
+	{
+		if(path[c - 1] == '/')
+		{
+			asset->basename = c;
+			break;
+		}
+		if(path[c - 1] == '.' && asset->ext == asset->len)
+		{
+			asset->ext = c - 1;
+		}
 	}
 }
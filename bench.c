@@ -0,0 +1,705 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_spool.h"
+
+#include <ftw.h>
+#include <math.h>
+
+/* spool-bench generates a synthetic incoming tree and then runs it
+ * through the same steps as spoold's serial loop -- the 'file' source,
+ * the identification mechanisms, UUID assignment and 'fs' storage -- in
+ * process, reporting throughput and per-job latency.
+ *
+ * Usage: spool-bench [OPTIONS]
+ *
+ *   -n COUNT      number of assets to generate (default 1000)
+ *   -s MIN[-MAX]  asset size, or a range from which sizes are drawn
+ *                 log-uniformly; suffixes k, m and g are accepted
+ *                 (default 1k-1m)
+ *   -c RATIO      proportion of assets with an XML sidecar (default 0.25)
+ *   -t MIX        types of asset to generate, as comma-separated
+ *                 extensions, each optionally weighted with ':N'
+ *                 (default pdf:2,jpg:4,png:2,txt:1,mp4:1)
+ *   -d DIR        work directory (default: a new temporary directory,
+ *                 removed afterwards)
+ *   -f FILE       configuration to benchmark with, in place of an empty
+ *                 one; file:* and fs:store are always overridden
+ *   -o KEY=VALUE  set a configuration option (e.g., '-o id:scheme=v7');
+ *                 may be given more than once
+ *   -C            create COUNT empty containers, rather than ingesting
+ *                 assets, to measure how the shape of the storage
+ *                 hierarchy (id:scheme, fs:shard, fs:width and fs:depth)
+ *                 behaves as the store grows
+ *   -r SEED       random seed (default 1)
+ *   -k            keep the work directory
+ *   -v            log at 'info' level rather than 'warning'
+ *
+ * The assets are written immediately beforehand, so are likely to be in
+ * the page cache when they are ingested.
+ *
+ * With -C, the number of misses in the storage handler's directory cache
+ * and (on Linux) the growth of the kernel's dentry cache are reported, as
+ * is the time taken to walk the resulting hierarchy.
+ */
+
+#define BENCH_BUFLEN                    65536
+#define BENCH_MAXTYPES                  32
+#define BENCH_MAXOPTIONS                32
+
+struct benchtype
+{
+	char *ext;
+	unsigned weight;
+};
+
+/* Internal utilities */
+static void usage(void);
+static int parse_size(const char *s, unsigned long long *size);
+static int parse_mix(char *s);
+static int generate(const char *dir);
+static int write_asset(const char *path, const char *ext, unsigned long long size, unsigned char *buf);
+static int write_sidecar(const char *path, unsigned long n);
+static unsigned long long next_size(void);
+static unsigned long long next_random(void);
+static int copy_config(const char *src);
+static int compare_latency(const void *a, const void *b);
+static int create_containers(unsigned long long *latency, unsigned long *done);
+static long dentries(void);
+static int count_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw);
+
+const char *short_program_name = "spool-bench";
+
+static unsigned long count = 1000;
+static unsigned long long minsize = 1024, maxsize = 1024 * 1024;
+static double sidecar_ratio = 0.25;
+static struct benchtype types[BENCH_MAXTYPES];
+static size_t ntypes;
+static unsigned weights;
+static unsigned long long seed = 1;
+static unsigned long sidecars;
+static unsigned long long total_bytes;
+static int containers;
+static unsigned long ndirs;
+
+int
+main(int argc, char **argv)
+{
+	char defmix[] = "pdf:2,jpg:4,png:2,txt:1,mp4:1";
+	char tmpdir[] = "/tmp/spool-bench.XXXXXX";
+	const char *dir, *conf;
+	char *path, *options[BENCH_MAXOPTIONS], *value;
+	unsigned long long *latency, start, begin, elapsed;
+	unsigned long jobs;
+	size_t noptions;
+	long before;
+	int c, keep, verbose, r;
+	JOB *job;
+
+	dir = NULL;
+	conf = NULL;
+	keep = 0;
+	verbose = 0;
+	noptions = 0;
+	before = -1;
+	while((c = getopt(argc, argv, "n:s:c:t:d:f:o:Cr:kvh")) != -1)
+	{
+		switch(c)
+		{
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			if(parse_size(optarg, &minsize) < 0)
+			{
+				usage();
+			}
+			break;
+		case 'c':
+			sidecar_ratio = atof(optarg);
+			break;
+		case 't':
+			if(parse_mix(optarg) < 0)
+			{
+				usage();
+			}
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 'f':
+			conf = optarg;
+			break;
+		case 'o':
+			if(noptions == BENCH_MAXOPTIONS || !strchr(optarg, '='))
+			{
+				usage();
+			}
+			options[noptions] = optarg;
+			noptions++;
+			break;
+		case 'C':
+			containers = 1;
+			break;
+		case 'r':
+			seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if(!count || sidecar_ratio < 0 || sidecar_ratio > 1)
+	{
+		usage();
+	}
+	if(!ntypes && parse_mix(defmix) < 0)
+	{
+		usage();
+	}
+	if(!seed)
+	{
+		seed = 1;
+	}
+	if(conf)
+	{
+		/* It's copied after changing to the work directory */
+		path = realpath(conf, NULL);
+		if(!path)
+		{
+			fprintf(stderr, "%s: %s: %s\n", short_program_name, conf, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		conf = path;
+	}
+	if(!dir)
+	{
+		dir = mkdtemp(tmpdir);
+		if(!dir)
+		{
+			fprintf(stderr, "%s: failed to create work directory: %s\n", short_program_name, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	else
+	{
+		/* Don't remove a directory we didn't create */
+		keep = 1;
+		if(mkdir(dir, 0777) && errno != EEXIST)
+		{
+			fprintf(stderr, "%s: %s: %s\n", short_program_name, dir, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(chdir(dir))
+	{
+		fprintf(stderr, "%s: %s: %s\n", short_program_name, dir, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	/* The configuration is loaded from the work directory */
+	if(copy_config(conf) < 0)
+	{
+		fprintf(stderr, "%s: %s: %s\n", short_program_name, (conf ? conf : "spoold.conf"), strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if(generate("incoming") < 0)
+	{
+		fprintf(stderr, "%s: failed to generate assets: %s\n", short_program_name, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if(!containers)
+	{
+		fprintf(stderr, "%s: generated %lu assets (%lu with sidecars, %.1f MB) in %s\n", short_program_name,
+				count, sidecars, total_bytes / (1024.0 * 1024.0), dir);
+	}
+	latency = (unsigned long long *) calloc(count, sizeof(unsigned long long));
+	if(!latency || config_init() < 0)
+	{
+		fprintf(stderr, "%s: failed to intialise configuration: %s\n", short_program_name, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	config_set("file:incoming", "incoming");
+	config_set("file:pending", "pending");
+	config_set("file:failed", "failed");
+	config_set("file:complete", "complete");
+	config_set("fs:store", "store");
+	if(!conf)
+	{
+		config_set("recipe:dir", "recipes");
+	}
+	config_set("log:level", (verbose ? "info" : "warning"));
+	for(c = 0; (size_t) c < noptions; c++)
+	{
+		value = strchr(options[c], '=');
+		*value = 0;
+		config_set(options[c], value + 1);
+	}
+	if(config_load() < 0 || log_init() < 0 || plugin_load() < 0 || meta_init() < 0 || recipe_load() < 0 ||
+	   journal_open() < 0 || index_open() < 0 || stats_init() < 0 || trace_init() < 0)
+	{
+		fprintf(stderr, "%s: failed to initialise: %s\n", short_program_name, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	begin = stats_clock();
+	if(containers)
+	{
+		before = dentries();
+		if(create_containers(latency, &jobs) < 0)
+		{
+			LOG(LOG_ERR, "failed to create container: %s\n", strerror(errno));
+		}
+	}
+	else
+	{
+		jobs = 0;
+		while(jobs < count)
+		{
+			start = stats_clock();
+			errno = 0;
+			job = job_collect();
+			if(!job)
+			{
+				if(errno)
+				{
+					LOG(LOG_ERR, "failed to collect job: %s\n", strerror(errno));
+				}
+				break;
+			}
+			r = meta_locate(job);
+			if(r >= 0)
+			{
+				r = id_assign(job);
+			}
+			if(r >= 0)
+			{
+				r = process_job(job);
+			}
+			if(r < 0)
+			{
+				job_abort(job);
+				continue;
+			}
+			job_submitted(job);
+			latency[jobs] = stats_clock() - start;
+			jobs++;
+		}
+	}
+	elapsed = stats_clock() - begin;
+	log_flush();
+	if(!jobs)
+	{
+		fprintf(stderr, "%s: no jobs were processed\n", short_program_name);
+		exit(EXIT_FAILURE);
+	}
+	qsort(latency, jobs, sizeof(unsigned long long), compare_latency);
+	if(containers)
+	{
+		printf("containers:    %lu of %lu in %.3fs\n", jobs, count, elapsed / 1e9);
+		printf("per sec:       %.1f\n", jobs / (elapsed / 1e9));
+	}
+	else
+	{
+		printf("jobs:          %lu of %lu in %.3fs\n", jobs, count, elapsed / 1e9);
+		printf("jobs/sec:      %.1f\n", jobs / (elapsed / 1e9));
+		printf("MB/sec:        %.1f\n", (total_bytes / (1024.0 * 1024.0)) / (elapsed / 1e9));
+	}
+	printf("latency p50:   %.3fms\n", latency[jobs / 2] / 1e6);
+	printf("latency p99:   %.3fms\n", latency[(jobs * 99) / 100] / 1e6);
+	printf("latency max:   %.3fms\n", latency[jobs - 1] / 1e6);
+	if(containers)
+	{
+		printf("dircache miss: %lld (%.2f%%)\n", stats_get(STAT_DIRCACHE_MISSES), (100.0 * stats_get(STAT_DIRCACHE_MISSES)) / jobs);
+		if(before >= 0 && dentries() >= 0)
+		{
+			printf("dentries:      %+ld\n", dentries() - before);
+		}
+		begin = stats_clock();
+		if(!nftw("store", count_entry, 16, FTW_PHYS))
+		{
+			/* Not counting the store itself, or the containers */
+			printf("directories:   %lu (walked in %.3fs)\n", ndirs - 1 - jobs, (stats_clock() - begin) / 1e9);
+		}
+	}
+	free(latency);
+	if(!keep)
+	{
+		if(chdir("/") || util_remove_tree(dir))
+		{
+			fprintf(stderr, "%s: failed to remove %s: %s\n", short_program_name, dir, strerror(errno));
+		}
+	}
+	return (jobs == count ? 0 : 1);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: %s [-n COUNT] [-s MIN[-MAX]] [-c RATIO] [-t EXT[:WEIGHT],...] [-d DIR] [-f FILE] [-o KEY=VALUE] [-C] [-r SEED] [-k] [-v]\n", short_program_name);
+	exit(EXIT_FAILURE);
+}
+
+/* Parse a size, or a range of sizes separated by '-' */
+static int
+parse_size(const char *s, unsigned long long *size)
+{
+	unsigned long long n;
+	char *end;
+
+	n = strtoull(s, &end, 10);
+	switch(tolower(*end))
+	{
+	case 'g':
+		n *= 1024;
+		/* fall through */
+	case 'm':
+		n *= 1024;
+		/* fall through */
+	case 'k':
+		n *= 1024;
+		end++;
+	}
+	*size = n;
+	if(size == &minsize)
+	{
+		maxsize = n;
+		if(*end == '-')
+		{
+			return parse_size(end + 1, &maxsize);
+		}
+	}
+	if(*end || maxsize < minsize)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/* Parse a list of extensions, each with an optional weight */
+static int
+parse_mix(char *s)
+{
+	char *p, *w, *save;
+
+	ntypes = 0;
+	weights = 0;
+	for(p = strtok_r(s, ",", &save); p; p = strtok_r(NULL, ",", &save))
+	{
+		if(ntypes == BENCH_MAXTYPES)
+		{
+			return -1;
+		}
+		w = strchr(p, ':');
+		if(w)
+		{
+			*w = 0;
+			w++;
+		}
+		types[ntypes].ext = p;
+		types[ntypes].weight = (w ? (unsigned) atoi(w) : 1);
+		if(!p[0] || !types[ntypes].weight)
+		{
+			return -1;
+		}
+		weights += types[ntypes].weight;
+		ntypes++;
+	}
+	return (ntypes ? 0 : -1);
+}
+
+/* Create the directories the 'file' source and 'fs' storage expect, and
+ * populate the incoming directory
+ */
+static int
+generate(const char *dir)
+{
+	static const char *dirs[] = { "incoming", "pending", "failed", "complete", "store", "recipes", NULL };
+	unsigned char *buf;
+	char path[64];
+	unsigned long n, w;
+	size_t c;
+
+	for(c = 0; dirs[c]; c++)
+	{
+		if(mkdir(dirs[c], 0777) && errno != EEXIST)
+		{
+			return -1;
+		}
+	}
+	if(containers)
+	{
+		return 0;
+	}
+	buf = (unsigned char *) malloc(BENCH_BUFLEN);
+	if(!buf)
+	{
+		return -1;
+	}
+	for(n = 0; n < count; n++)
+	{
+		w = next_random() % weights;
+		for(c = 0; w >= types[c].weight; c++)
+		{
+			w -= types[c].weight;
+		}
+		snprintf(path, sizeof(path), "%s/asset%06lu.%s", dir, n, types[c].ext);
+		if(write_asset(path, types[c].ext, next_size(), buf) < 0)
+		{
+			free(buf);
+			return -1;
+		}
+		if((next_random() % 1000000) < sidecar_ratio * 1000000)
+		{
+			snprintf(path, sizeof(path), "%s/asset%06lu.xml", dir, n);
+			if(write_sidecar(path, n) < 0)
+			{
+				free(buf);
+				return -1;
+			}
+			sidecars++;
+		}
+	}
+	free(buf);
+	return 0;
+}
+
+/* Create empty containers, as the 'id' and 'store' steps would */
+static int
+create_containers(unsigned long long *latency, unsigned long *done)
+{
+	unsigned long long start;
+	JOB *job;
+	int r;
+
+	for(*done = 0; *done < count; (*done)++)
+	{
+		start = stats_clock();
+		job = job_create("container", NULL);
+		if(!job)
+		{
+			return -1;
+		}
+		r = id_assign(job);
+		if(r >= 0)
+		{
+			r = store_create_container(job);
+		}
+		job_free(job);
+		if(r < 0)
+		{
+			return -1;
+		}
+		latency[*done] = stats_clock() - start;
+	}
+	return 0;
+}
+
+/* Return the number of entries in the kernel's dentry cache, or -1 if it
+ * can't be determined
+ */
+static long
+dentries(void)
+{
+	FILE *f;
+	long n;
+
+	f = fopen("/proc/sys/fs/dentry-state", "r");
+	if(!f)
+	{
+		return -1;
+	}
+	if(fscanf(f, "%ld", &n) != 1)
+	{
+		n = -1;
+	}
+	fclose(f);
+	return n;
+}
+
+static int
+count_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw)
+{
+	(void) path;
+	(void) sb;
+	(void) ftw;
+
+	if(flag == FTW_D)
+	{
+		ndirs++;
+	}
+	return 0;
+}
+
+/* Write a sidecar giving an asset's kind and key */
+static int
+write_sidecar(const char *path, unsigned long n)
+{
+	FILE *f;
+
+	f = fopen(path, "w");
+	if(!f)
+	{
+		return -1;
+	}
+	fprintf(f, "<?xml version=\"1.0\"?>\n"
+			"<metadata xmlns:dc=\"http://purl.org/dc/elements/1.1/\">\n"
+			"\t<kind>bench</kind>\n"
+			"\t<key>asset%06lu</key>\n"
+			"\t<dc:title>Benchmark asset %lu</dc:title>\n"
+			"</metadata>\n", n, n);
+	total_bytes += ftell(f);
+	if(fclose(f))
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/* Write an asset of the given size: a signature appropriate to its type
+ * (so that identification by magic number behaves realistically),
+ * followed by pseudo-random data
+ */
+static int
+write_asset(const char *path, const char *ext, unsigned long long size, unsigned char *buf)
+{
+	static const struct { const char *ext; const char *sig; size_t len; } sigs[] = {
+		{ "pdf", "%PDF-1.4\n", 9 },
+		{ "jpg", "\xff\xd8\xff\xe0", 4 },
+		{ "png", "\x89PNG\r\n\x1a\n", 8 },
+		{ "gif", "GIF89a", 6 },
+		{ "mp4", "\0\0\0\x18" "ftypmp42", 12 },
+		{ "xml", "<?xml version=\"1.0\"?>\n<metadata/>\n", 34 },
+		{ NULL, NULL, 0 }
+	};
+	unsigned long long left, v;
+	size_t c, len, head;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(fd == -1)
+	{
+		return -1;
+	}
+	head = 0;
+	for(c = 0; sigs[c].ext; c++)
+	{
+		if(!strcmp(sigs[c].ext, ext))
+		{
+			head = sigs[c].len;
+			memcpy(buf, sigs[c].sig, head);
+			break;
+		}
+	}
+	if(size < head)
+	{
+		size = head;
+	}
+	total_bytes += size;
+	for(left = size; left; left -= len)
+	{
+		len = (left < BENCH_BUFLEN ? (size_t) left : BENCH_BUFLEN);
+		for(c = head; c < len; c += sizeof(v))
+		{
+			v = next_random();
+			memcpy(&(buf[c]), &v, (len - c < sizeof(v) ? len - c : sizeof(v)));
+		}
+		head = 0;
+		if(util_write(fd, buf, len) < 0)
+		{
+			close(fd);
+			return -1;
+		}
+	}
+	return close(fd);
+}
+
+/* Draw a size log-uniformly from the configured range */
+static unsigned long long
+next_size(void)
+{
+	double f;
+
+	if(minsize == maxsize || !maxsize)
+	{
+		return minsize;
+	}
+	f = (next_random() >> 11) / 9007199254740992.0;
+	if(!minsize)
+	{
+		return (unsigned long long) (f * maxsize);
+	}
+	return (unsigned long long) (minsize * pow((double) maxsize / minsize, f));
+}
+
+/* xorshift64* */
+static unsigned long long
+next_random(void)
+{
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return seed * 2685821657736338717ULL;
+}
+
+/* Write the configuration file config_load() reads: a copy of the one
+ * specified, or an empty one
+ */
+static int
+copy_config(const char *src)
+{
+	FILE *in, *out;
+	char buf[4096];
+	size_t n;
+
+	out = fopen("spoold.conf", "w");
+	if(!out)
+	{
+		return -1;
+	}
+	if(src)
+	{
+		in = fopen(src, "r");
+		if(!in)
+		{
+			fclose(out);
+			return -1;
+		}
+		while((n = fread(buf, 1, sizeof(buf), in)) > 0)
+		{
+			fwrite(buf, 1, n, out);
+		}
+		fclose(in);
+	}
+	return fclose(out);
+}
+
+static int
+compare_latency(const void *a, const void *b)
+{
+	unsigned long long x, y;
+
+	x = *(const unsigned long long *) a;
+	y = *(const unsigned long long *) b;
+	return (x < y ? -1 : (x > y ? 1 : 0));
+}
@@ -0,0 +1,658 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_spool.h"
+
+/* The recipe cache keeps a copy of the output of each recipe which has
+ * been run, keyed by a digest of everything the output depends upon (see
+ * recipe.c), so that re-ingesting an asset doesn't mean running all of its
+ * recipes again. Each entry is stored as cache:dir/KEY, where KEY is the
+ * hex digest; on a hit, the entry is materialised into the job's container
+ * with copy_file(), which reflinks files where it can. Entries never share
+ * an inode with a container, as a hard link would, because outputs in a
+ * re-used container may be written again in place.
+ *
+ * The total size of the cache is limited to cache:size megabytes; when it
+ * grows beyond that, the least-recently-used entries are evicted. Entries'
+ * modification times record when they were last used, so that the order
+ * survives a restart.
+ */
+
+#define CACHE_BUCKETS                   1024
+
+typedef struct cache_entry_struct CACHE_ENTRY;
+
+struct cache_entry_struct
+{
+	unsigned char key[SHA256_LEN];
+	off_t size;
+	/* Last used, for ordering entries found at startup */
+	time_t mtime;
+	/* Number of fetches in progress; busy entries aren't evicted */
+	int busy;
+	/* LRU list, most recently used first */
+	CACHE_ENTRY *prev;
+	CACHE_ENTRY *next;
+	/* Hash chain, or once evicted, the list of evicted entries */
+	CACHE_ENTRY *chain;
+	/* Where an evicted entry was moved to before being removed */
+	char *tmp;
+};
+
+/* Internal utilities */
+static CACHE_ENTRY *cache_lookup(const unsigned char *key);
+static int cache_insert(CACHE_ENTRY *entry);
+static void cache_unlink(CACHE_ENTRY *entry);
+static void cache_touch(CACHE_ENTRY *entry);
+static CACHE_ENTRY *cache_evict(void);
+static void cache_purge(CACHE_ENTRY *evicted);
+static void cache_report(const char *event);
+static char *cache_path(const unsigned char *key, const char *suffix);
+static int cache_scan(void);
+static int compare_mtime(const void *a, const void *b);
+static int tree_clone(const char *src, const char *dest, off_t *size);
+static int tree_size(const char *path, off_t *size);
+
+static char *cachedir;
+static off_t limit;
+static off_t total;
+static CACHE_ENTRY **buckets;
+static size_t nbuckets, nentries;
+static CACHE_ENTRY *head, *tail;
+static unsigned long tmpcounter;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Prepare the cache, if one has been configured */
+int
+cache_init(void)
+{
+	const char *dir;
+	int size;
+
+	dir = config_get("cache:dir", NULL);
+	if(!dir || !dir[0])
+	{
+		return 0;
+	}
+	size = config_get_int("cache:size", 1024);
+	if(size < 1)
+	{
+		LOG(LOG_ERR, "cache:size must be at least 1 (megabyte)\n");
+		errno = EINVAL;
+		return -1;
+	}
+	limit = (off_t) size * 1024 * 1024;
+	if(mkdir(dir, 0777) && errno != EEXIST)
+	{
+		LOG(LOG_ERR, "%s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+	cachedir = strdup(dir);
+	nbuckets = CACHE_BUCKETS;
+	buckets = (CACHE_ENTRY **) calloc(nbuckets, sizeof(CACHE_ENTRY *));
+	if(!cachedir || !buckets)
+	{
+		return -1;
+	}
+	if(cache_scan() < 0)
+	{
+		return -1;
+	}
+	cache_purge(cache_evict());
+	LOG(LOG_INFO, "recipe cache %s holds %lu entries (%.1f of %d MB)\n", cachedir, (unsigned long) nentries, (double) total / (1024 * 1024), size);
+	return 0;
+}
+
+int
+cache_enabled(void)
+{
+	return (cachedir != NULL);
+}
+
+/* Materialise a cached output at dest; returns 0 on a hit, 1 on a miss */
+int
+cache_fetch(const unsigned char *key, const char *dest)
+{
+	CACHE_ENTRY *entry;
+	char *path;
+	int r;
+
+	pthread_mutex_lock(&lock);
+	entry = cache_lookup(key);
+	if(!entry)
+	{
+		stats_add(STAT_CACHE_MISSES, 1);
+		cache_report("miss");
+		pthread_mutex_unlock(&lock);
+		return 1;
+	}
+	entry->busy++;
+	cache_touch(entry);
+	pthread_mutex_unlock(&lock);
+	path = cache_path(key, NULL);
+	r = (path ? tree_clone(path, dest, NULL) : -1);
+	if(r < 0)
+	{
+		LOG(LOG_ERR, "%s: failed to materialise cached output: %s\n", dest, strerror(errno));
+		util_remove_tree(dest);
+	}
+	else
+	{
+		utimensat(AT_FDCWD, path, NULL, AT_SYMLINK_NOFOLLOW);
+	}
+	free(path);
+	pthread_mutex_lock(&lock);
+	entry->busy--;
+	stats_add((r < 0 ? STAT_CACHE_MISSES : STAT_CACHE_HITS), 1);
+	cache_report(r < 0 ? "miss" : "hit");
+	pthread_mutex_unlock(&lock);
+	return (r < 0 ? 1 : 0);
+}
+
+/* Add the output of a recipe at src to the cache */
+int
+cache_store(const unsigned char *key, const char *src)
+{
+	CACHE_ENTRY *entry, *evicted;
+	char *tmp, *path, suffix[64];
+	off_t size;
+	int found, e;
+
+	sprintf(suffix, ".%lu.%lu.tmp", (unsigned long) getpid(), __sync_add_and_fetch(&tmpcounter, 1));
+	tmp = cache_path(key, suffix);
+	path = cache_path(key, NULL);
+	entry = (CACHE_ENTRY *) calloc(1, sizeof(CACHE_ENTRY));
+	if(!tmp || !path || !entry)
+	{
+		free(tmp);
+		free(path);
+		free(entry);
+		return -1;
+	}
+	size = 0;
+	if(tree_clone(src, tmp, &size) < 0)
+	{
+		LOG(LOG_ERR, "%s: failed to add output to the recipe cache: %s\n", src, strerror(errno));
+		stats_add(STAT_ERRORS, 1);
+		util_remove_tree(tmp);
+		free(tmp);
+		free(path);
+		free(entry);
+		return -1;
+	}
+	pthread_mutex_lock(&lock);
+	found = (cache_lookup(key) != NULL);
+	if(found || rename(tmp, path))
+	{
+		e = errno;
+		pthread_mutex_unlock(&lock);
+		util_remove_tree(tmp);
+		free(tmp);
+		free(path);
+		free(entry);
+		if(found || e == EEXIST || e == ENOTEMPTY)
+		{
+			/* Another job produced the same output first */
+			return 0;
+		}
+		LOG(LOG_ERR, "%s: failed to add output to the recipe cache: %s\n", src, strerror(e));
+		stats_add(STAT_ERRORS, 1);
+		errno = e;
+		return -1;
+	}
+	memcpy(entry->key, key, SHA256_LEN);
+	entry->size = size;
+	if(cache_insert(entry) < 0)
+	{
+		pthread_mutex_unlock(&lock);
+		util_remove_tree(path);
+		free(tmp);
+		free(path);
+		free(entry);
+		return -1;
+	}
+	stats_add(STAT_CACHE_STORES, 1);
+	evicted = cache_evict();
+	cache_report("stored");
+	pthread_mutex_unlock(&lock);
+	cache_purge(evicted);
+	free(tmp);
+	free(path);
+	return 0;
+}
+
+/* Find an entry; the caller must hold the lock */
+static CACHE_ENTRY *
+cache_lookup(const unsigned char *key)
+{
+	CACHE_ENTRY *entry;
+	size_t h;
+
+	/* The key is a digest, so any part of it is as good a hash as any */
+	memcpy(&h, key, sizeof(h));
+	for(entry = buckets[h % nbuckets]; entry; entry = entry->chain)
+	{
+		if(!memcmp(entry->key, key, SHA256_LEN))
+		{
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/* Add an entry as the most recently used, growing the table if needed;
+ * the caller must hold the lock
+ */
+static int
+cache_insert(CACHE_ENTRY *entry)
+{
+	CACHE_ENTRY **p, *e, *next;
+	size_t c, h;
+
+	if(nentries >= nbuckets)
+	{
+		p = (CACHE_ENTRY **) calloc(nbuckets * 2, sizeof(CACHE_ENTRY *));
+		if(!p)
+		{
+			return -1;
+		}
+		for(c = 0; c < nbuckets; c++)
+		{
+			for(e = buckets[c]; e; e = next)
+			{
+				next = e->chain;
+				memcpy(&h, e->key, sizeof(h));
+				e->chain = p[h % (nbuckets * 2)];
+				p[h % (nbuckets * 2)] = e;
+			}
+		}
+		free(buckets);
+		buckets = p;
+		nbuckets *= 2;
+	}
+	memcpy(&h, entry->key, sizeof(h));
+	entry->chain = buckets[h % nbuckets];
+	buckets[h % nbuckets] = entry;
+	entry->prev = NULL;
+	entry->next = head;
+	if(head)
+	{
+		head->prev = entry;
+	}
+	head = entry;
+	if(!tail)
+	{
+		tail = entry;
+	}
+	nentries++;
+	total += entry->size;
+	return 0;
+}
+
+/* Remove an entry from the table and the LRU list; the caller must hold
+ * the lock
+ */
+static void
+cache_unlink(CACHE_ENTRY *entry)
+{
+	CACHE_ENTRY **p;
+	size_t h;
+
+	memcpy(&h, entry->key, sizeof(h));
+	for(p = &(buckets[h % nbuckets]); *p != entry; p = &((*p)->chain));
+	*p = entry->chain;
+	if(entry->prev)
+	{
+		entry->prev->next = entry->next;
+	}
+	else
+	{
+		head = entry->next;
+	}
+	if(entry->next)
+	{
+		entry->next->prev = entry->prev;
+	}
+	else
+	{
+		tail = entry->prev;
+	}
+	nentries--;
+	total -= entry->size;
+}
+
+/* Mark an entry as the most recently used; the caller must hold the lock */
+static void
+cache_touch(CACHE_ENTRY *entry)
+{
+	if(entry == head)
+	{
+		return;
+	}
+	entry->prev->next = entry->next;
+	if(entry->next)
+	{
+		entry->next->prev = entry->prev;
+	}
+	else
+	{
+		tail = entry->prev;
+	}
+	entry->prev = NULL;
+	entry->next = head;
+	head->prev = entry;
+	head = entry;
+}
+
+/* Evict least-recently-used entries until the cache is within its limit;
+ * the caller must hold the lock. Each evicted entry is renamed out of the
+ * way, so that it can be replaced straight away, and the evicted entries
+ * are returned, to be removed by cache_purge() once the lock has been
+ * released.
+ */
+static CACHE_ENTRY *
+cache_evict(void)
+{
+	CACHE_ENTRY *entry, *prev, *evicted;
+	char *path, suffix[64];
+
+	evicted = NULL;
+	for(entry = tail; entry && total > limit; entry = prev)
+	{
+		prev = entry->prev;
+		if(entry->busy)
+		{
+			continue;
+		}
+		cache_unlink(entry);
+		stats_add(STAT_CACHE_EVICTIONS, 1);
+		sprintf(suffix, ".%lu.%lu.tmp", (unsigned long) getpid(), __sync_add_and_fetch(&tmpcounter, 1));
+		path = cache_path(entry->key, NULL);
+		entry->tmp = cache_path(entry->key, suffix);
+		if(path && entry->tmp && !rename(path, entry->tmp))
+		{
+			entry->chain = evicted;
+			evicted = entry;
+		}
+		else
+		{
+			free(entry->tmp);
+			free(entry);
+		}
+		free(path);
+	}
+	return evicted;
+}
+
+/* Remove the entries returned by cache_evict(); the caller must not hold
+ * the lock
+ */
+static void
+cache_purge(CACHE_ENTRY *evicted)
+{
+	CACHE_ENTRY *next;
+
+	for(; evicted; evicted = next)
+	{
+		next = evicted->chain;
+		util_remove_tree(evicted->tmp);
+		free(evicted->tmp);
+		free(evicted);
+	}
+}
+
+/* Log a cache event along with the cache's statistics; the caller must
+ * hold the lock
+ */
+static void
+cache_report(const char *event)
+{
+	LOG(LOG_INFO, "recipe cache: %s (%lld hits, %lld misses, %lld stored, %lld evicted; %lu entries, %.1f MB)\n", event,
+		stats_get(STAT_CACHE_HITS), stats_get(STAT_CACHE_MISSES), stats_get(STAT_CACHE_STORES), stats_get(STAT_CACHE_EVICTIONS),
+		(unsigned long) nentries, (double) total / (1024 * 1024));
+}
+
+static char *
+cache_path(const unsigned char *key, const char *suffix)
+{
+	char *p;
+	size_t l;
+
+	l = strlen(cachedir);
+	p = (char *) malloc(l + 1 + SHA256_LEN * 2 + (suffix ? strlen(suffix) : 0) + 1);
+	if(!p)
+	{
+		return NULL;
+	}
+	strcpy(p, cachedir);
+	p[l] = '/';
+	sha256_format(key, &(p[l + 1]));
+	if(suffix)
+	{
+		strcat(p, suffix);
+	}
+	return p;
+}
+
+/* Index the entries already present in the cache directory, and remove
+ * anything left over from an interrupted store or eviction; anything else
+ * is left alone, in case cache:dir has been pointed somewhere it shouldn't
+ */
+static int
+cache_scan(void)
+{
+	DIR *d;
+	struct dirent *de;
+	struct stat sbuf;
+	CACHE_ENTRY **list, **p, *entry;
+	char *path;
+	size_t n, c, l;
+
+	d = opendir(cachedir);
+	if(!d)
+	{
+		return -1;
+	}
+	list = NULL;
+	n = 0;
+	while((de = readdir(d)))
+	{
+		if(de->d_name[0] == '.')
+		{
+			continue;
+		}
+		path = util_path_join(cachedir, de->d_name);
+		if(!path)
+		{
+			break;
+		}
+		l = strlen(de->d_name);
+		for(c = 0; c < l && isxdigit((unsigned char) de->d_name[c]) && !isupper((unsigned char) de->d_name[c]); c++);
+		if(c == SHA256_LEN * 2 && l > c + 4 && de->d_name[c] == '.' && !strcmp(&(de->d_name[l - 4]), ".tmp"))
+		{
+			/* Left over from an interrupted store or eviction */
+			util_remove_tree(path);
+			free(path);
+			continue;
+		}
+		if(l != SHA256_LEN * 2 || c != l || lstat(path, &sbuf))
+		{
+			LOG(LOG_WARNING, "%s: ignoring unexpected entry in the recipe cache directory\n", path);
+			free(path);
+			continue;
+		}
+		p = (CACHE_ENTRY **) realloc(list, (n + 1) * sizeof(CACHE_ENTRY *));
+		if(p)
+		{
+			list = p;
+		}
+		entry = (CACHE_ENTRY *) calloc(1, sizeof(CACHE_ENTRY));
+		if(!entry || !p)
+		{
+			free(entry);
+			free(path);
+			break;
+		}
+		for(c = 0; c < SHA256_LEN; c++)
+		{
+			sscanf(&(de->d_name[c * 2]), "%2hhx", &(entry->key[c]));
+		}
+		entry->mtime = sbuf.st_mtime;
+		tree_size(path, &(entry->size));
+		list[n] = entry;
+		n++;
+		free(path);
+	}
+	closedir(d);
+	/* Insert the least recently used first, so that it ends up last */
+	qsort(list, n, sizeof(CACHE_ENTRY *), compare_mtime);
+	for(c = 0; c < n; c++)
+	{
+		if(cache_insert(list[c]) < 0)
+		{
+			free(list[c]);
+		}
+	}
+	free(list);
+	return (de ? -1 : 0);
+}
+
+static int
+compare_mtime(const void *a, const void *b)
+{
+	const CACHE_ENTRY *ea, *eb;
+
+	ea = *(const CACHE_ENTRY **) a;
+	eb = *(const CACHE_ENTRY **) b;
+	return (ea->mtime < eb->mtime ? -1 : (ea->mtime > eb->mtime));
+}
+
+/* Recursively clone a file or directory, adding the size of the files
+ * cloned to *size (if non-NULL)
+ */
+static int
+tree_clone(const char *src, const char *dest, off_t *size)
+{
+	struct stat sbuf;
+	DIR *d;
+	struct dirent *de;
+	char *s, *t, link[4096];
+	ssize_t l;
+	int r;
+
+	if(lstat(src, &sbuf))
+	{
+		return -1;
+	}
+	if(S_ISREG(sbuf.st_mode))
+	{
+		if(copy_file(src, dest, O_EXCL, NULL) < 0)
+		{
+			return -1;
+		}
+		if(size)
+		{
+			*size += sbuf.st_size;
+		}
+		return 0;
+	}
+	if(S_ISLNK(sbuf.st_mode))
+	{
+		l = readlink(src, link, sizeof(link) - 1);
+		if(l < 0)
+		{
+			return -1;
+		}
+		link[l] = 0;
+		return symlink(link, dest);
+	}
+	if(!S_ISDIR(sbuf.st_mode))
+	{
+		/* Other kinds of file aren't cached */
+		return 0;
+	}
+	if(mkdir(dest, 0777) && errno != EEXIST)
+	{
+		return -1;
+	}
+	d = opendir(src);
+	if(!d)
+	{
+		return -1;
+	}
+	r = 0;
+	while(!r && (de = readdir(d)))
+	{
+		if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+		{
+			continue;
+		}
+		s = util_path_join(src, de->d_name);
+		t = util_path_join(dest, de->d_name);
+		r = ((s && t) ? tree_clone(s, t, size) : -1);
+		free(s);
+		free(t);
+	}
+	closedir(d);
+	return r;
+}
+
+/* Total the sizes of the files within a directory tree */
+static int
+tree_size(const char *path, off_t *size)
+{
+	struct stat sbuf;
+	DIR *d;
+	struct dirent *de;
+	char *p;
+
+	if(lstat(path, &sbuf))
+	{
+		return -1;
+	}
+	if(!S_ISDIR(sbuf.st_mode))
+	{
+		if(S_ISREG(sbuf.st_mode))
+		{
+			*size += sbuf.st_size;
+		}
+		return 0;
+	}
+	d = opendir(path);
+	if(!d)
+	{
+		return -1;
+	}
+	while((de = readdir(d)))
+	{
+		if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+		{
+			continue;
+		}
+		p = util_path_join(path, de->d_name);
+		if(p)
+		{
+			tree_size(p, size);
+			free(p);
+		}
+	}
+	closedir(d);
+	return 0;
+}
@@ -0,0 +1,251 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_spool.h"
+#include "identify/mimedb.h"
+
+/* spool-check runs regression checks against libspool, in process; it's
+ * run by 'make check', and exits with a non-zero status if any check
+ * fails.
+ */
+
+struct check
+{
+	const char *name;
+	int (*run)(const char *dir);
+};
+
+/* Internal utilities */
+static int check_meta_utf8(const char *dir);
+static int check_meta_truncate(const char *dir);
+static int check_type_builtin(const char *dir);
+static int meta_extract(const char *dir, const char *name, const char *doc, JOB **job);
+static int expect(const char *check, const char *what, const char *value, const char *expected);
+
+const char *short_program_name = "spool-check";
+
+static struct check checks[] = {
+	{ "meta/utf8", check_meta_utf8 },
+	{ "meta/truncate", check_meta_truncate },
+	{ "type/builtin", check_type_builtin },
+	{ NULL, NULL }
+};
+
+int
+main(int argc, char **argv)
+{
+	char tmpdir[] = "/tmp/spool-check.XXXXXX";
+	int c, failed;
+
+	(void) argc;
+	(void) argv;
+
+	if(!mkdtemp(tmpdir))
+	{
+		fprintf(stderr, "%s: failed to create work directory: %s\n", short_program_name, strerror(errno));
+		return 1;
+	}
+	if(config_init() < 0)
+	{
+		fprintf(stderr, "%s: failed to initialise: %s\n", short_program_name, strerror(errno));
+		util_remove_tree(tmpdir);
+		return 1;
+	}
+	config_set("log:level", "warning");
+	config_set("meta:fields", "title=//title note=//note");
+	if(log_init() < 0 || meta_init() < 0)
+	{
+		fprintf(stderr, "%s: failed to initialise: %s\n", short_program_name, strerror(errno));
+		util_remove_tree(tmpdir);
+		return 1;
+	}
+	failed = 0;
+	for(c = 0; checks[c].name; c++)
+	{
+		if(checks[c].run(tmpdir) < 0)
+		{
+			printf("FAIL: %s\n", checks[c].name);
+			failed++;
+		}
+		else
+		{
+			printf("PASS: %s\n", checks[c].name);
+		}
+	}
+	util_remove_tree(tmpdir);
+	log_flush();
+	return (failed ? 1 : 0);
+}
+
+/* Text and CDATA in a sidecar are UTF-8 already, and must be extracted
+ * unchanged; only character references are encoded
+ */
+static int
+check_meta_utf8(const char *dir)
+{
+	static const char doc[] =
+		"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<metadata>\n"
+		"\t<kind>caf\xc3\xa9</kind>\n"
+		"\t<key><![CDATA[\xe6\x9d\xb1\xe4\xba\xac & <Z\xc3\xbcrich>]]></key>\n"
+		"\t<title>na&#xEF;ve &#8364;5 &amp; \xf0\x9f\x93\x84</title>\n"
+		"\t<note>x<![CDATA[\xc3\xa9]]>y</note>\n"
+		"</metadata>\n";
+	JOB *job;
+	int r;
+
+	if(meta_extract(dir, "utf8", doc, &job) < 0)
+	{
+		return -1;
+	}
+	r = 0;
+	r |= expect("meta/utf8", "kind", job->kind, "caf\xc3\xa9");
+	r |= expect("meta/utf8", "key", job->key, "\xe6\x9d\xb1\xe4\xba\xac & <Z\xc3\xbcrich>");
+	r |= expect("meta/utf8", "title", job->meta[2].value, "na\xc3\xafve \xe2\x82\xac" "5 & \xf0\x9f\x93\x84");
+	r |= expect("meta/utf8", "note", job->meta[3].value, "x\xc3\xa9y");
+	job_free(job);
+	return r;
+}
+
+/* A value which is too long is truncated, but never part of the way
+ * through a character
+ */
+static int
+check_meta_truncate(const char *dir)
+{
+	/* Values are kept to 4095 bytes, which falls within the 'é' */
+	static const char head[] = "<metadata><kind>k</kind><key>k</key><note>";
+	static const char tail[] = "\xc3\xa9</note></metadata>\n";
+	char doc[sizeof(head) + 4094 + sizeof(tail)], *expected;
+	JOB *job;
+	int r;
+
+	strcpy(doc, head);
+	memset(&(doc[sizeof(head) - 1]), 'a', 4094);
+	strcpy(&(doc[sizeof(head) - 1 + 4094]), tail);
+	if(meta_extract(dir, "truncate", doc, &job) < 0)
+	{
+		return -1;
+	}
+	expected = &(doc[sizeof(head) - 1]);
+	expected[4094] = 0;
+	r = expect("meta/truncate", "note", job->meta[3].value, expected);
+	job_free(job);
+	return r;
+}
+
+/* The registry is seeded with the static built-in types, so interning one
+ * of those returns the static entry, flags and all, and only other types
+ * are allocated
+ */
+static int
+check_type_builtin(const char *dir)
+{
+	const MIMETYPE *t, *u;
+	size_t c;
+
+	(void) dir;
+
+	for(c = 0; mimedb_types[c]; c++)
+	{
+		if(!strcmp(mimedb_types[c]->name, "application/xml"))
+		{
+			break;
+		}
+	}
+	if(!mimedb_types[c])
+	{
+		fprintf(stderr, "%s: type/builtin: application/xml isn't built in\n", short_program_name);
+		return -1;
+	}
+	t = type_intern("Application/XML");
+	if(t != mimedb_types[c] || !(t->flags & MIME_SIDECAR) || type_find("application/xml") != t)
+	{
+		fprintf(stderr, "%s: type/builtin: application/xml isn't the built-in sidecar type\n", short_program_name);
+		return -1;
+	}
+	t = type_intern("application/x-spool-check");
+	u = type_find("application/x-spool-check");
+	if(!t || t != u || t->flags || strcmp(t->name, "application/x-spool-check"))
+	{
+		fprintf(stderr, "%s: type/builtin: failed to register a new type\n", short_program_name);
+		return -1;
+	}
+	return 0;
+}
+
+/* Write a sidecar and extract the configured fields from it */
+static int
+meta_extract(const char *dir, const char *name, const char *doc, JOB **job)
+{
+	ASSET *asset;
+	FILE *f;
+	char *path;
+
+	*job = NULL;
+	path = util_path_join(dir, name);
+	if(!path)
+	{
+		return -1;
+	}
+	f = fopen(path, "w");
+	if(!f || fputs(doc, f) == EOF || fclose(f))
+	{
+		fprintf(stderr, "%s: %s: %s\n", short_program_name, path, strerror(errno));
+		free(path);
+		return -1;
+	}
+	*job = job_create(name, NULL);
+	asset = asset_create();
+	if(!*job || !asset || asset_set_path(asset, path) < 0)
+	{
+		if(asset)
+		{
+			asset_free(asset);
+		}
+		if(*job)
+		{
+			job_free(*job);
+			*job = NULL;
+		}
+		free(path);
+		return -1;
+	}
+	free(path);
+	asset->sidecar = 1;
+	if(job_set_sidecar(*job, asset) < 0 || meta_locate(*job) < 0)
+	{
+		job_free(*job);
+		*job = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static int
+expect(const char *check, const char *what, const char *value, const char *expected)
+{
+	if(value && !strcmp(value, expected))
+	{
+		return 0;
+	}
+	fprintf(stderr, "%s: %s: %s is '%s', expected '%s'\n", short_program_name, check, what, (value ? value : "(null)"), expected);
+	return -1;
+}
@@ -66,3 +66,8 @@ config_get(const char *key, const char *defval)
 	return iniparser_getstring((config ? config : overrides), key, (char *) defval);
 }
 
+int
+config_get_int(const char *key, int defval)
+{
+	return iniparser_getint((config ? config : overrides), key, defval);
+}
@@ -0,0 +1,305 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_spool.h"
+
+#include <time.h>
+
+#ifdef HAVE_SYS_IOCTL_H
+# include <sys/ioctl.h>
+#endif
+#ifdef HAVE_LINUX_FS_H
+# include <linux/fs.h>
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+# include <sys/sendfile.h>
+#endif
+
+/* File copying, shared by the 'fs' storage handler and the recipe cache.
+ * The cheapest mechanism the system supports for the pair of files
+ * concerned is used: sharing the source's extents (reflink), an in-kernel
+ * copy with copy_file_range() or sendfile(), or failing all of those,
+ * reading and writing through a buffer. None of them leaves the two files
+ * sharing an inode, so writing to one never affects the other.
+ */
+
+/* Size of the per-thread buffer used by copy_buffered() */
+#define COPY_BUFLEN                     (4 * 1024 * 1024)
+
+/* Errors which indicate that an in-kernel copy mechanism can't be used for
+ * a particular pair of files, rather than that copying has failed
+ */
+#define COPY_UNSUPPORTED(e)             ((e) == ENOSYS || (e) == EXDEV || (e) == EINVAL || (e) == EOPNOTSUPP || (e) == ENOTSUP)
+
+/* Internal utilities */
+static int copy_reflink(int sfd, int dfd);
+static int copy_range(int sfd, int dfd, off_t size);
+static int copy_sendfile(int sfd, int dfd, off_t size);
+static int copy_buffered(int sfd, int dfd, off_t *bytes);
+static void copybuf_key_create(void);
+
+/* Names of the COPY_xxx methods, as logged and used to label statistics */
+static const char *const methods[COPY_NMETHODS] = {
+	"rename", "link", "reflink", "copy_file_range", "sendfile", "read/write"
+};
+
+/* Per-thread copy buffers */
+static pthread_key_t copybuf_key;
+static pthread_once_t copybuf_once = PTHREAD_ONCE_INIT;
+
+/* Copy a file, creating the destination with O_WRONLY|O_CREAT and oflag
+ * (e.g., O_TRUNC or O_EXCL); if stats is non-NULL, the mechanism used,
+ * the number of bytes copied and the time taken are recorded there.
+ */
+int
+copy_file(const char *srcpath, const char *destpath, int oflag, COPYSTATS *stats)
+{
+	COPYSTATS local;
+	struct stat sbuf;
+	struct timespec start, end;
+	int sfd, dfd, e, r;
+
+	if(!stats)
+	{
+		stats = &local;
+	}
+	do
+	{
+		sfd = open(srcpath, O_RDONLY);
+	}
+	while(sfd == -1 && errno == EINTR);
+	if(sfd == -1)
+	{
+		return -1;
+	}
+	if(fstat(sfd, &sbuf))
+	{
+		e = errno;
+		close(sfd);
+		errno = e;
+		return -1;
+	}
+	do
+	{
+		dfd = open(destpath, O_WRONLY|O_CREAT|oflag, 0666);
+	}
+	while(dfd == -1 && errno == EINTR);
+	if(dfd == -1)
+	{
+		e = errno;
+		close(sfd);
+		errno = e;
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	stats->bytes = sbuf.st_size;
+	stats->method = COPY_REFLINK;
+	r = copy_reflink(sfd, dfd);
+	if(r > 0)
+	{
+		stats->method = COPY_RANGE;
+		r = copy_range(sfd, dfd, sbuf.st_size);
+	}
+	if(r > 0)
+	{
+		stats->method = COPY_SENDFILE;
+		r = copy_sendfile(sfd, dfd, sbuf.st_size);
+	}
+	if(r > 0)
+	{
+		stats->method = COPY_BUFFERED;
+		r = copy_buffered(sfd, dfd, &(stats->bytes));
+	}
+	e = errno;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	stats->seconds = (end.tv_sec - start.tv_sec) + ((end.tv_nsec - start.tv_nsec) / 1000000000.0);
+	close(sfd);
+	if(close(dfd) && !r)
+	{
+		e = errno;
+		r = -1;
+	}
+	errno = e;
+	return (r < 0 ? -1 : 0);
+}
+
+/* Return the name of a COPY_xxx method */
+const char *
+copy_method_name(int method)
+{
+	if(method < 0 || method >= COPY_NMETHODS)
+	{
+		return "unknown";
+	}
+	return methods[method];
+}
+
+/* Each of the copy strategies below returns 0 on success, -1 on failure,
+ * or 1 if the strategy isn't supported for this pair of files (in which
+ * case nothing has been written to the destination).
+ */
+
+/* Clone the source file's extents into the destination */
+static int
+copy_reflink(int sfd, int dfd)
+{
+#if defined(HAVE_SYS_IOCTL_H) && defined(HAVE_LINUX_FS_H) && defined(FICLONE)
+	if(!ioctl(dfd, FICLONE, sfd))
+	{
+		return 0;
+	}
+	return 1;
+#else
+	(void) sfd;
+	(void) dfd;
+
+	return 1;
+#endif
+}
+
+/* Copy within the kernel using copy_file_range() */
+static int
+copy_range(int sfd, int dfd, off_t size)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+	off_t done;
+	ssize_t r;
+
+	for(done = 0; done < size; done += r)
+	{
+		r = copy_file_range(sfd, NULL, dfd, NULL, size - done, 0);
+		if(r == -1 && errno == EINTR)
+		{
+			r = 0;
+			continue;
+		}
+		if(r == -1 && !done && COPY_UNSUPPORTED(errno))
+		{
+			return 1;
+		}
+		if(r == -1)
+		{
+			return -1;
+		}
+		if(!r)
+		{
+			/* The source has been truncated */
+			break;
+		}
+	}
+	return 0;
+#else
+	(void) sfd;
+	(void) dfd;
+	(void) size;
+
+	return 1;
+#endif
+}
+
+/* Copy within the kernel using sendfile() */
+static int
+copy_sendfile(int sfd, int dfd, off_t size)
+{
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+	off_t done;
+	ssize_t r;
+
+	for(done = 0; done < size; done += r)
+	{
+		r = sendfile(dfd, sfd, NULL, size - done);
+		if(r == -1 && errno == EINTR)
+		{
+			r = 0;
+			continue;
+		}
+		if(r == -1 && !done && COPY_UNSUPPORTED(errno))
+		{
+			return 1;
+		}
+		if(r == -1)
+		{
+			return -1;
+		}
+		if(!r)
+		{
+			break;
+		}
+	}
+	return 0;
+#else
+	(void) sfd;
+	(void) dfd;
+	(void) size;
+
+	return 1;
+#endif
+}
+
+/* Copy by reading into and writing from a per-thread buffer, allocated
+ * once per thread and then re-used
+ */
+static int
+copy_buffered(int sfd, int dfd, off_t *bytes)
+{
+	char *buf;
+	ssize_t r;
+
+	pthread_once(&copybuf_once, copybuf_key_create);
+	buf = (char *) pthread_getspecific(copybuf_key);
+	if(!buf)
+	{
+		buf = (char *) malloc(COPY_BUFLEN);
+		if(!buf)
+		{
+			return -1;
+		}
+		pthread_setspecific(copybuf_key, buf);
+	}
+	*bytes = 0;
+	for(;;)
+	{
+		r = read(sfd, buf, COPY_BUFLEN);
+		if(r == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if(r == -1)
+		{
+			return -1;
+		}
+		if(!r)
+		{
+			break;
+		}
+		if(util_write(dfd, buf, r) < 0)
+		{
+			return -1;
+		}
+		*bytes += r;
+	}
+	return 0;
+}
+
+static void
+copybuf_key_create(void)
+{
+	pthread_key_create(&copybuf_key, free);
+}
@@ -0,0 +1,283 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_spool.h"
+
+/* The executor runs tasks on a fixed pool of worker threads. Each worker
+ * has its own deque of tasks: a worker takes the task it queued most
+ * recently from the bottom of its own deque, and when that is empty,
+ * steals the oldest task from the top of another worker's. Tasks submitted
+ * by a worker (for example, recipes which have become runnable because the
+ * one the worker has just finished was the last of their dependencies) are
+ * queued on that worker's own deque; tasks submitted from elsewhere are
+ * distributed amongst the workers in turn.
+ */
+
+#define EXECUTOR_MAXWORKERS             64
+#define DEQUE_INITIAL                   64
+
+typedef struct deque_struct DEQUE;
+typedef struct worker_struct WORKER;
+
+struct deque_struct
+{
+	pthread_mutex_t lock;
+	TASK **tasks;
+	size_t size;
+	size_t head;
+	size_t count;
+};
+
+struct worker_struct
+{
+	pthread_t thread;
+	size_t index;
+	DEQUE deque;
+};
+
+/* Internal utilities */
+static void *worker_run(void *arg);
+static TASK *worker_steal(WORKER *self);
+static int deque_init(DEQUE *d);
+static int deque_push(DEQUE *d, TASK *task);
+static TASK *deque_pop(DEQUE *d);
+static TASK *deque_steal(DEQUE *d);
+
+static WORKER *workers;
+static size_t nworkers;
+/* Next worker to receive a task submitted from outside the pool */
+static size_t nextworker;
+/* The WORKER structure of the calling thread, if it is part of the pool */
+static pthread_key_t worker_key;
+/* Idle workers sleep until the number of queued tasks is non-zero; the
+ * count is updated atomically, and incremented with idle_lock held so
+ * that wake-ups can't be lost.
+ */
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static size_t queued;
+
+/* Start the executor's worker threads */
+int
+executor_start(int count)
+{
+	int c, r;
+
+	if(workers)
+	{
+		return 0;
+	}
+	if(count < 1 || count > EXECUTOR_MAXWORKERS)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	r = pthread_key_create(&worker_key, NULL);
+	if(r)
+	{
+		errno = r;
+		return -1;
+	}
+	workers = (WORKER *) calloc(count, sizeof(WORKER));
+	if(!workers)
+	{
+		return -1;
+	}
+	for(c = 0; c < count; c++)
+	{
+		workers[c].index = c;
+		if(deque_init(&(workers[c].deque)) < 0)
+		{
+			return -1;
+		}
+	}
+	nworkers = count;
+	for(c = 0; c < count; c++)
+	{
+		r = pthread_create(&(workers[c].thread), NULL, worker_run, &(workers[c]));
+		if(r)
+		{
+			errno = r;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Queue a task for execution */
+int
+executor_submit(TASK *task)
+{
+	WORKER *target;
+
+	if(!workers)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	target = (WORKER *) pthread_getspecific(worker_key);
+	if(!target)
+	{
+		target = &(workers[__sync_fetch_and_add(&nextworker, 1) % nworkers]);
+	}
+	if(deque_push(&(target->deque), task) < 0)
+	{
+		return -1;
+	}
+	pthread_mutex_lock(&idle_lock);
+	__sync_add_and_fetch(&queued, 1);
+	stats_add(STAT_QUEUE_RECIPE, 1);
+	pthread_cond_signal(&idle_cond);
+	pthread_mutex_unlock(&idle_lock);
+	return 0;
+}
+
+static void *
+worker_run(void *arg)
+{
+	WORKER *self;
+	TASK *task;
+
+	self = (WORKER *) arg;
+	pthread_setspecific(worker_key, self);
+	for(;;)
+	{
+		task = deque_pop(&(self->deque));
+		if(!task)
+		{
+			task = worker_steal(self);
+		}
+		if(!task)
+		{
+			pthread_mutex_lock(&idle_lock);
+			while(!queued)
+			{
+				pthread_cond_wait(&idle_cond, &idle_lock);
+			}
+			pthread_mutex_unlock(&idle_lock);
+			continue;
+		}
+		__sync_sub_and_fetch(&queued, 1);
+		stats_add(STAT_QUEUE_RECIPE, -1);
+		task->run(task);
+	}
+	return NULL;
+}
+
+/* Take a task from another worker, trying each in turn */
+static TASK *
+worker_steal(WORKER *self)
+{
+	TASK *task;
+	size_t c;
+
+	for(c = 1; c < nworkers; c++)
+	{
+		task = deque_steal(&(workers[(self->index + c) % nworkers].deque));
+		if(task)
+		{
+			return task;
+		}
+	}
+	return NULL;
+}
+
+static int
+deque_init(DEQUE *d)
+{
+	d->tasks = (TASK **) calloc(DEQUE_INITIAL, sizeof(TASK *));
+	if(!d->tasks)
+	{
+		return -1;
+	}
+	d->size = DEQUE_INITIAL;
+	d->head = 0;
+	d->count = 0;
+	pthread_mutex_init(&(d->lock), NULL);
+	return 0;
+}
+
+/* Add a task to the bottom of a deque, growing it if needed */
+static int
+deque_push(DEQUE *d, TASK *task)
+{
+	TASK **p;
+	size_t c;
+
+	pthread_mutex_lock(&(d->lock));
+	if(d->count == d->size)
+	{
+		p = (TASK **) calloc(d->size * 2, sizeof(TASK *));
+		if(!p)
+		{
+			pthread_mutex_unlock(&(d->lock));
+			return -1;
+		}
+		for(c = 0; c < d->count; c++)
+		{
+			p[c] = d->tasks[(d->head + c) % d->size];
+		}
+		free(d->tasks);
+		d->tasks = p;
+		d->size *= 2;
+		d->head = 0;
+	}
+	d->tasks[(d->head + d->count) % d->size] = task;
+	d->count++;
+	pthread_mutex_unlock(&(d->lock));
+	return 0;
+}
+
+/* Remove the task at the bottom of a deque (the most recently queued) */
+static TASK *
+deque_pop(DEQUE *d)
+{
+	TASK *task;
+
+	pthread_mutex_lock(&(d->lock));
+	if(!d->count)
+	{
+		pthread_mutex_unlock(&(d->lock));
+		return NULL;
+	}
+	d->count--;
+	task = d->tasks[(d->head + d->count) % d->size];
+	pthread_mutex_unlock(&(d->lock));
+	return task;
+}
+
+/* Remove the task at the top of a deque (the least recently queued) */
+static TASK *
+deque_steal(DEQUE *d)
+{
+	TASK *task;
+
+	pthread_mutex_lock(&(d->lock));
+	if(!d->count)
+	{
+		pthread_mutex_unlock(&(d->lock));
+		return NULL;
+	}
+	task = d->tasks[d->head];
+	d->head = (d->head + 1) % d->size;
+	d->count--;
+	pthread_mutex_unlock(&(d->lock));
+	return task;
+}
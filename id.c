@@ -20,18 +20,64 @@
 
 #include "p_spool.h"
 
+#include <time.h>
+#if defined(HAVE_SYS_RANDOM_H) && defined(HAVE_GETRANDOM)
+# include <sys/random.h>
+#endif
+
+/* Identifiers are UUIDs, generated according to id:scheme:--
+ *
+ *   v4   random (the default)
+ *   v7   time-ordered: the first 48 bits are the Unix time in
+ *        milliseconds, followed by a 12-bit counter which keeps
+ *        identifiers generated within the same millisecond in order, and
+ *        then 62 random bits (RFC 9562)
+ *
+ * Time-ordered identifiers allow storage to place containers created at
+ * around the same time close together (see fs:shard).
+ *
+ * Identifiers are assigned to batches of jobs at once (see
+ * id_assign_batch()): the random bits for the whole batch are obtained in
+ * one go, and any new index entries and journal records are each written
+ * with a single sync.
+ */
+
+#define ID_V4                           4
+#define ID_V7                           7
+
+/* Internal utilities */
+static void id_init(void);
+static void id_generate(uuid_t *uu, size_t count);
+static int id_random(void *buf, size_t len);
+static void id_stamp_v7(uuid_t *uu, size_t count);
+
+static pthread_once_t id_once = PTHREAD_ONCE_INIT;
+static int scheme = ID_V4;
+static pthread_mutex_t v7_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long v7_last;
+static unsigned int v7_seq;
+
+/* Create an identifier from a UUID, within an arena if one is given */
 JOBID *
-id_create_uuid(uuid_t uuid)
+id_create_uuid(ARENA *arena, uuid_t uuid)
 {
 	JOBID *p;
 	char *s;
 	size_t c;
 	
-	p = (JOBID *) calloc(1, sizeof(JOBID));
+	if(arena)
+	{
+		p = (JOBID *) arena_calloc(arena, sizeof(JOBID));
+	}
+	else
+	{
+		p = (JOBID *) calloc(1, sizeof(JOBID));
+	}
 	if(!p)
 	{
 		return NULL;
 	}
+	p->arena = arena;
 	memcpy(p->uuid, uuid, sizeof(uuid_t));
 	uuid_unparse_lower(p->uuid, p->formatted);
 	s = p->canonical;
@@ -51,24 +97,260 @@ id_create_uuid(uuid_t uuid)
 int
 id_free(JOBID *id)
 {
-	free(id);
+	if(id && !id->arena)
+	{
+		free(id);
+	}
 	return 0;
 }
 
+/* Assign an identifier to a job */
 int
 id_assign(JOB *job)
 {
-	uuid_t uu;
+	int status;
+
+	status = 0;
+	id_assign_batch(&job, 1, &status);
+	return status;
+}
+
+/* Assign identifiers to a batch of jobs. Jobs whose status[n] is
+ * already non-zero are skipped, and status[n] is set to -1 for any job
+ * which couldn't be assigned one. Returns -1 if any of the jobs failed,
+ * or 0 otherwise.
+ */
+int
+id_assign_batch(JOB **jobs, size_t njobs, int *status)
+{
+	uuid_t *uu;
+	const char **kinds, **keys, **formatted;
+	JOB **assigned;
 	JOBID *p;
+	int *found;
+	unsigned long long start;
+	size_t c;
+	int r, e;
 
-	uuid_generate(uu);
-	p = id_create_uuid(uu);
-	if(!p)
+	start = stats_clock();
+	pthread_once(&id_once, id_init);
+	uu = (uuid_t *) malloc(njobs * sizeof(uuid_t));
+	kinds = (const char **) calloc(njobs, sizeof(char *));
+	keys = (const char **) calloc(njobs, sizeof(char *));
+	formatted = (const char **) calloc(njobs, sizeof(char *));
+	assigned = (JOB **) calloc(njobs, sizeof(JOB *));
+	found = (int *) calloc(njobs, sizeof(int));
+	if(!uu || !kinds || !keys || !formatted || !assigned || !found)
 	{
+		LOG(LOG_ERR, "failed to allocate memory for identifiers: %s\n", strerror(errno));
+		for(c = 0; c < njobs; c++)
+		{
+			if(!jobs[c]->id)
+			{
+				status[c] = -1;
+			}
+		}
+		free(uu);
+		free(kinds);
+		free(keys);
+		free(formatted);
+		free(assigned);
+		free(found);
 		return -1;
 	}
-	job_set_id(job, p);
-	fprintf(stderr, "%s: %s: assigned UUID is %s\n", short_program_name, job->name, job->id->formatted);
+	id_generate(uu, njobs);
+	for(c = 0; c < njobs; c++)
+	{
+		/* Jobs resumed from the journal already have identifiers */
+		if(!status[c] && !jobs[c]->id)
+		{
+			kinds[c] = jobs[c]->kind;
+			keys[c] = jobs[c]->key;
+		}
+	}
+	/* Re-use the identifiers assigned when the assets were last seen */
+	r = index_assign_batch(kinds, keys, uu, found, njobs);
+	e = errno;
+	for(c = 0; c < njobs; c++)
+	{
+		if(status[c] || jobs[c]->id)
+		{
+			continue;
+		}
+		if(r < 0)
+		{
+			LOG(LOG_ERR, "%s: failed to update index: %s\n", jobs[c]->name, strerror(e));
+			status[c] = -1;
+			continue;
+		}
+		p = id_create_uuid(jobs[c]->arena, uu[c]);
+		if(!p)
+		{
+			status[c] = -1;
+			continue;
+		}
+		job_set_id(jobs[c], p);
+		/* Even a new identifier may have a container already, if another
+		 * job with the same kind and key was stored first
+		 */
+		jobs[c]->reused = (found[c] || (jobs[c]->kind && jobs[c]->key));
+		assigned[c] = jobs[c];
+		formatted[c] = p->formatted;
+		if(found[c])
+		{
+			LOG(LOG_INFO, "%s: re-using UUID %s of %s '%s'\n", jobs[c]->name, p->formatted, jobs[c]->kind, jobs[c]->key);
+		}
+		else
+		{
+			LOG(LOG_DEBUG, "%s: assigned UUID is %s\n", jobs[c]->name, p->formatted);
+		}
+	}
+	stats_time(STAT_ID_ASSIGN, start);
+	TRACE("id_assign", NULL, njobs, start, 0);
+	if(journal_record_batch(assigned, njobs, JOURNAL_ID, formatted) < 0)
+	{
+		for(c = 0; c < njobs; c++)
+		{
+			if(assigned[c])
+			{
+				status[c] = -1;
+			}
+		}
+	}
+	r = 0;
+	for(c = 0; c < njobs; c++)
+	{
+		if(status[c])
+		{
+			r = -1;
+		}
+	}
+	free(uu);
+	free(kinds);
+	free(keys);
+	free(formatted);
+	free(assigned);
+	free(found);
+	return r;
+}
+
+static void
+id_init(void)
+{
+	const char *s;
+
+	s = config_get("id:scheme", "v4");
+	if(!strcmp(s, "v7"))
+	{
+		scheme = ID_V7;
+	}
+	else if(strcmp(s, "v4"))
+	{
+		LOG(LOG_WARNING, "id:scheme: unsupported scheme '%s'; using v4\n", s);
+	}
+}
+
+/* Generate count UUIDs according to the configured scheme, obtaining the
+ * random bits for all of them at once if possible
+ */
+static void
+id_generate(uuid_t *uu, size_t count)
+{
+	size_t c;
+
+	if(id_random(uu, count * sizeof(uuid_t)) < 0)
+	{
+		for(c = 0; c < count; c++)
+		{
+			uuid_generate_random(uu[c]);
+		}
+	}
+	if(scheme == ID_V7)
+	{
+		id_stamp_v7(uu, count);
+		return;
+	}
+	for(c = 0; c < count; c++)
+	{
+		uu[c][6] = 0x40 | (uu[c][6] & 0x0f);
+		uu[c][8] = 0x80 | (uu[c][8] & 0x3f);
+	}
+}
+
+/* Fill a buffer with random bytes from the kernel */
+static int
+id_random(void *buf, size_t len)
+{
+#if defined(HAVE_SYS_RANDOM_H) && defined(HAVE_GETRANDOM)
+	ssize_t r;
+	size_t c;
+
+	for(c = 0; c < len; c += r)
+	{
+		r = getrandom((char *) buf + c, len - c, 0);
+		if(r == -1 && errno == EINTR)
+		{
+			r = 0;
+			continue;
+		}
+		if(r < 0)
+		{
+			return -1;
+		}
+	}
 	return 0;
+#else
+	(void) buf;
+	(void) len;
+
+	errno = ENOSYS;
+	return -1;
+#endif
 }
 
+/* Turn random UUIDs into consecutive time-ordered (version 7) ones */
+static void
+id_stamp_v7(uuid_t *uu, size_t count)
+{
+	struct timespec ts;
+	unsigned long long ms, t;
+	size_t c;
+	int d;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ms = (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	pthread_mutex_lock(&v7_lock);
+	for(c = 0; c < count; c++)
+	{
+		if(ms <= v7_last)
+		{
+			/* Within the same millisecond (or the clock has gone
+			 * backwards): increment the counter, borrowing from the next
+			 * millisecond if it overflows, so that identifiers remain in
+			 * order
+			 */
+			ms = v7_last;
+			v7_seq++;
+			if(v7_seq > 0xfff)
+			{
+				ms++;
+				v7_seq = 0;
+			}
+		}
+		else
+		{
+			v7_seq = 0;
+		}
+		v7_last = ms;
+		t = ms;
+		for(d = 5; d >= 0; d--)
+		{
+			uu[c][d] = t & 0xff;
+			t >>= 8;
+		}
+		uu[c][6] = 0x70 | ((v7_seq >> 8) & 0x0f);
+		uu[c][7] = v7_seq & 0xff;
+		uu[c][8] = 0x80 | (uu[c][8] & 0x3f);
+	}
+	pthread_mutex_unlock(&v7_lock);
+}
@@ -21,28 +21,46 @@
 #define IDENTIFY_STRUCT_DEFINED         1
 
 #include "p_spool.h"
+#include "mimedb.h"
 
 /* Identify assets by mapping extensions to MIME types using a
  * mime.types file, as distributed by ASF at:-
  *
  * http://svn.apache.org/repos/asf/httpd/httpd/trunk/docs/conf/mime.types
+ *
+ * The copy of mime.types in the source tree is compiled into a read-only
+ * table at build time (see mimedb.h and mkmimedb.c). If ext:types names
+ * another file in the same format, it is parsed at startup and its
+ * entries take precedence over the built-in ones.
+ *
+ * The built-in table refers to the static MIMETYPEs which the type
+ * registry is seeded with, so it can be used as-is.
  */
 
 struct identify_struct
 {
 	IDENTIFY_API *api;
-	size_t ntypes;
-	size_t nalloc;
-	struct mimetype *types;
+	/* Open-addressed table mapping extensions to types, built from the
+	 * override file, if any
+	 */
+	struct extslot *slots;
+	size_t nslots;
+	size_t nused;
 };
 
-struct mimetype
+struct extslot
 {
-	char *type;
-	char *exts[16];
-	size_t nexts;
+	/* Lower-cased extension, without the leading '.' */
+	const char *ext;
+	const MIMETYPE *type;
+	unsigned long hash;
 };
 
+/* The longest extension (including any inner '.'s) which will be looked up;
+ * must be no less than MAXEXTLEN in mkmimedb.c
+ */
+#define EXT_MAXLEN                      64
+
 /* Identification API methods */
 static int ext_identify(IDENTIFY *me, ASSET *asset);
 
@@ -53,13 +71,18 @@ static IDENTIFY_API ext_api = {
 
 /* Internal utilities */
 static int parseline(IDENTIFY *me, const char *line);
-static int addtype(IDENTIFY *me, const struct mimetype *type);
+static int addext(IDENTIFY *me, char *ext, const MIMETYPE *type);
+static const MIMETYPE *lookup(IDENTIFY *me, const char *ext);
+static const MIMETYPE *lookup_builtin(const char *ext, size_t len);
+static void ext_free(IDENTIFY *me);
+static int grow(IDENTIFY *me);
 
 /* Construct a new handler instance */
 IDENTIFY *
 ext_create(void)
 {
 	IDENTIFY *p;
+	const char *path;
 	FILE *f;
 	char *buf;
 	size_t buflen;
@@ -69,19 +92,24 @@ ext_create(void)
 	{
 		return NULL;
 	}
+	p->api = &ext_api;
+	path = config_get("ext:types", NULL);
+	if(!path || !path[0])
+	{
+		return p;
+	}
 	buflen = 4096;
 	buf = (char *) malloc(buflen);
 	if(!buf)
 	{
-		free(p);
+		ext_free(p);
 		return NULL;
 	}
-	p->api = &ext_api;
-	f = fopen("mime.types", "r");
+	f = fopen(path, "r");
 	if(!f)
 	{
-		fprintf(stderr, "%s: unable to open 'mime.types' for reading: %s\n", short_program_name, strerror(errno));
-		free(p);
+		LOG(LOG_ERR, "unable to open '%s' for reading: %s\n", path, strerror(errno));
+		ext_free(p);
 		free(buf);
 		return NULL;
 	}
@@ -95,10 +123,14 @@ ext_create(void)
 	return p;
 }
 
+/* Identify an asset by its extension. Multi-part extensions are tried
+ * before single ones, so that (if mime.types lists it) 'foo.tar.gz' is
+ * identified by 'tar.gz' rather than by 'gz'.
+ */
 static int
 ext_identify(IDENTIFY *me, ASSET *asset)
 {
-	size_t c, d;
+	const MIMETYPE *type;
 	const char *t;
 
 	if(asset->type)
@@ -106,31 +138,77 @@ ext_identify(IDENTIFY *me, ASSET *asset)
 		/* Already identified */
 		return 0;
 	}
-	if(!asset->ext || !asset->ext[0])
+	if(!ASSET_EXT(asset)[0] || !ASSET_BASENAME(asset)[0])
 	{
 		/* No file extension */
 		return 0;
 	}
-	t = asset->ext;
-	t++;
-	for(c = 0; c < me->ntypes; c++)
+	for(t = strchr(ASSET_BASENAME(asset) + 1, '.'); t; t = strchr(t + 1, '.'))
+	{
+		type = lookup(me, t + 1);
+		if(type)
+		{
+			asset_set_type(asset, type);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Look up an extension, case-insensitively */
+static const MIMETYPE *
+lookup(IDENTIFY *me, const char *ext)
+{
+	char buf[EXT_MAXLEN + 1];
+	unsigned long h;
+	size_t c, len;
+
+	for(len = 0; ext[len]; len++)
 	{
-		for(d = 0; d < me->types[c].nexts; d++)
+		if(len == EXT_MAXLEN)
 		{
-			if(!strcmp(t, me->types[c].exts[d]))
+			return NULL;
+		}
+		buf[len] = tolower((unsigned char) ext[len]);
+	}
+	buf[len] = 0;
+	if(me->nused)
+	{
+		h = util_hash(buf, len);
+		for(c = h & (me->nslots - 1); me->slots[c].ext; c = (c + 1) & (me->nslots - 1))
+		{
+			if(me->slots[c].hash == h && !strcmp(me->slots[c].ext, buf))
 			{
-				asset_set_type(asset, me->types[c].type);
-				return 1;
+				return me->slots[c].type;
 			}
 		}
 	}
-	return 0;
+	return lookup_builtin(buf, len);
+}
+
+/* Look up a lower-cased extension in the built-in table */
+static const MIMETYPE *
+lookup_builtin(const char *ext, size_t len)
+{
+	unsigned long seed, slot;
+
+	if(!mimedb_nentries)
+	{
+		return NULL;
+	}
+	seed = mimedb_disp[mimedb_hash(ext, len, 0) % mimedb_nbuckets];
+	slot = mimedb_hash(ext, len, seed) % mimedb_nentries;
+	if(strcmp(mimedb_entries[slot].ext, ext))
+	{
+		return NULL;
+	}
+	return mimedb_types[mimedb_entries[slot].type];
 }
 
 static int
 parseline(IDENTIFY *me, const char *line)
 {
-	struct mimetype t;
+	const MIMETYPE *type;
 	char *buf, *p;
 
 	while(isspace(*line))
@@ -146,8 +224,6 @@ parseline(IDENTIFY *me, const char *line)
 	{
 		return -1;
 	}
-	t.type = buf;
-	t.nexts = 0;
 	for(p = buf; *p; p++)
 	{
 		if(isspace(*p))
@@ -171,11 +247,20 @@ parseline(IDENTIFY *me, const char *line)
 		free(buf);
 		return 0;
 	}
+	type = type_intern(buf);
+	if(!type)
+	{
+		free(buf);
+		return -1;
+	}
+	/* buf is retained for the lifetime of the table, which points into it */
 	while(*p)
 	{
-		t.exts[t.nexts] = p;
-		t.nexts++;
-		while(!isspace(*p))
+		if(addext(me, p, type) < 0)
+		{
+			return -1;
+		}
+		while(*p && !isspace(*p))
 		{
 			p++;
 		}
@@ -189,25 +274,86 @@ parseline(IDENTIFY *me, const char *line)
 			p++;
 		}
 	}
-	return addtype(me, &t);
+	return 0;
 }
 
+/* Add an extension to the table; the first type listed for an extension
+ * takes precedence over any later ones.
+ */
 static int
-addtype(IDENTIFY *me, const struct mimetype *type)
+addext(IDENTIFY *me, char *ext, const MIMETYPE *type)
 {
-	struct mimetype *n;
+	unsigned long h;
+	size_t c, len;
 
-	if(me->nalloc < me->ntypes + 1)
+	for(len = 0; ext[len] && !isspace(ext[len]); len++)
+	{
+		ext[len] = tolower((unsigned char) ext[len]);
+	}
+	if(!len || len > EXT_MAXLEN)
 	{
-		n = realloc(me->types, (me->nalloc + 32) * sizeof(struct mimetype));
-		if(!n)
+		return 0;
+	}
+	/* Keep the load factor at or below one half */
+	if((me->nused + 1) * 2 > me->nslots)
+	{
+		if(grow(me) < 0)
 		{
 			return -1;
 		}
-		me->nalloc += 32;
-		me->types = n;
 	}
-	memcpy(&(me->types[me->ntypes]), type, sizeof(struct mimetype));
-	me->ntypes++;
+	h = util_hash(ext, len);
+	for(c = h & (me->nslots - 1); me->slots[c].ext; c = (c + 1) & (me->nslots - 1))
+	{
+		if(me->slots[c].hash == h && !strncmp(me->slots[c].ext, ext, len) && !me->slots[c].ext[len])
+		{
+			return 0;
+		}
+	}
+	me->slots[c].ext = ext;
+	me->slots[c].type = type;
+	me->slots[c].hash = h;
+	me->nused++;
 	return 0;
 }
+
+/* Double the size of the table (which is always a power of two) */
+static int
+grow(IDENTIFY *me)
+{
+	struct extslot *slots;
+	size_t nslots, c, d;
+
+	nslots = (me->nslots ? me->nslots * 2 : 1024);
+	slots = (struct extslot *) calloc(nslots, sizeof(struct extslot));
+	if(!slots)
+	{
+		return -1;
+	}
+	for(c = 0; c < me->nslots; c++)
+	{
+		if(!me->slots[c].ext)
+		{
+			continue;
+		}
+		d = me->slots[c].hash & (nslots - 1);
+		while(slots[d].ext)
+		{
+			d = (d + 1) & (nslots - 1);
+		}
+		slots[d] = me->slots[c];
+	}
+	free(me->slots);
+	me->slots = slots;
+	me->nslots = nslots;
+	return 0;
+}
+
+/* Free a partially-constructed handler instance */
+static void
+ext_free(IDENTIFY *me)
+{
+	free(me->slots);
+	free(me);
+}
+
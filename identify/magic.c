@@ -0,0 +1,299 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#define IDENTIFY_STRUCT_DEFINED         1
+
+#include "p_spool.h"
+
+/* Identify assets which couldn't be identified by extension by examining
+ * their first few bytes. Only a single read of at most MAGIC_READLEN bytes
+ * is ever performed for an asset.
+ *
+ * Signatures are compiled, when the handler is created, into a table
+ * indexed by the first byte of the file, so that identifying an asset only
+ * involves comparing it against the handful of signatures which could
+ * possibly match, longest first. The type each signature identifies is
+ * interned at the same time.
+ */
+
+#define MAGIC_READLEN                   4096
+
+struct identify_struct
+{
+	IDENTIFY_API *api;
+	/* Signatures, by the first byte they require */
+	const struct signature **first[256];
+	/* Signatures which don't begin at offset zero */
+	const struct signature **other;
+	/* Interned types, indexed as signatures */
+	const MIMETYPE **types;
+};
+
+/* A signature matches if data matches the file at offset, and (if data2
+ * is set) data2 matches at offset2.
+ */
+struct signature
+{
+	const char *type;
+	size_t offset;
+	const char *data;
+	size_t len;
+	size_t offset2;
+	const char *data2;
+	size_t len2;
+};
+
+#define SIG(type, data)                 { type, 0, data, sizeof(data) - 1, 0, NULL, 0 }
+#define SIG_AT(type, off, data)         { type, off, data, sizeof(data) - 1, 0, NULL, 0 }
+#define SIG2(type, data, off2, data2)   { type, 0, data, sizeof(data) - 1, off2, data2, sizeof(data2) - 1 }
+
+static const struct signature signatures[] = {
+	SIG("application/pdf", "%PDF-"),
+	SIG("application/postscript", "%!PS"),
+	SIG("image/tiff", "II*\0"),
+	SIG("image/tiff", "MM\0*"),
+	SIG("image/jpeg", "\xff\xd8\xff"),
+	SIG("image/png", "\x89PNG\r\n\x1a\n"),
+	SIG("image/gif", "GIF87a"),
+	SIG("image/gif", "GIF89a"),
+	SIG("image/bmp", "BM"),
+	SIG2("image/webp", "RIFF", 8, "WEBP"),
+	SIG2("audio/x-wav", "RIFF", 8, "WAVE"),
+	SIG2("video/x-msvideo", "RIFF", 8, "AVI "),
+	SIG("application/zip", "PK\3\4"),
+	SIG("application/zip", "PK\5\6"),
+	SIG("application/x-gzip", "\x1f\x8b"),
+	SIG("application/x-bzip2", "BZh"),
+	SIG("application/x-7z-compressed", "7z\xbc\xaf\x27\x1c"),
+	SIG("application/x-rar-compressed", "Rar!\x1a\x07"),
+	SIG("application/xml", "<?xml"),
+	SIG("application/xml", "\xef\xbb\xbf<?xml"),
+	SIG("audio/mpeg", "ID3"),
+	SIG("audio/ogg", "OggS"),
+	SIG("audio/x-flac", "fLaC"),
+	SIG("video/x-matroska", "\x1a\x45\xdf\xa3"),
+	SIG_AT("video/quicktime", 4, "ftypqt  "),
+	SIG_AT("video/mp4", 4, "ftyp"),
+	SIG_AT("video/quicktime", 4, "moov"),
+	{ NULL, 0, NULL, 0, 0, NULL, 0 }
+};
+
+/* Identification API methods */
+static int magic_identify(IDENTIFY *me, ASSET *asset);
+
+/* Identification API */
+static IDENTIFY_API magic_api = {
+	magic_identify
+};
+
+/* Internal utilities */
+static const struct signature **compile(const struct signature *sigs, int first, int byte);
+static int match(const struct signature *sig, const unsigned char *buf, size_t len);
+static int compare_signatures(const void *a, const void *b);
+static void magic_free(IDENTIFY *me);
+
+/* Construct a new handler instance */
+IDENTIFY *
+magic_create(void)
+{
+	IDENTIFY *p;
+	int c;
+
+	p = (IDENTIFY *) calloc(1, sizeof(IDENTIFY));
+	if(!p)
+	{
+		return NULL;
+	}
+	p->api = &magic_api;
+	p->types = (const MIMETYPE **) calloc(sizeof(signatures) / sizeof(signatures[0]), sizeof(MIMETYPE *));
+	if(!p->types)
+	{
+		free(p);
+		return NULL;
+	}
+	for(c = 0; signatures[c].type; c++)
+	{
+		p->types[c] = type_intern(signatures[c].type);
+		if(!p->types[c])
+		{
+			magic_free(p);
+			return NULL;
+		}
+	}
+	for(c = 0; c < 256; c++)
+	{
+		p->first[c] = compile(signatures, 1, c);
+	}
+	p->other = compile(signatures, 0, 0);
+	for(c = 0; c < 256; c++)
+	{
+		if(!p->first[c])
+		{
+			break;
+		}
+	}
+	if(c < 256 || !p->other)
+	{
+		magic_free(p);
+		return NULL;
+	}
+	return p;
+}
+
+static int
+magic_identify(IDENTIFY *me, ASSET *asset)
+{
+	unsigned char buf[MAGIC_READLEN];
+	const struct signature **list;
+	ssize_t r;
+	int fd;
+
+	if(asset->type)
+	{
+		/* Already identified */
+		return 0;
+	}
+	do
+	{
+		fd = open(ASSET_PATH(asset), O_RDONLY);
+	}
+	while(fd == -1 && errno == EINTR);
+	if(fd == -1)
+	{
+		/* Not an error as far as identification is concerned */
+		return 0;
+	}
+	do
+	{
+		r = pread(fd, buf, sizeof(buf), 0);
+	}
+	while(r == -1 && errno == EINTR);
+	close(fd);
+	if(r <= 0)
+	{
+		return 0;
+	}
+	for(list = me->first[buf[0]]; *list; list++)
+	{
+		if(match(*list, buf, r))
+		{
+			asset_set_type(asset, me->types[*list - signatures]);
+			return 1;
+		}
+	}
+	for(list = me->other; *list; list++)
+	{
+		if(match(*list, buf, r))
+		{
+			asset_set_type(asset, me->types[*list - signatures]);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Build a NULL-terminated list of the signatures which either begin with
+ * a particular byte (if first is set), or which don't begin at offset
+ * zero; each list is ordered longest first, so that the most specific
+ * signature wins.
+ */
+static const struct signature **
+compile(const struct signature *sigs, int first, int byte)
+{
+	const struct signature **list, **p;
+	size_t c, n;
+
+	list = (const struct signature **) calloc(1, sizeof(struct signature *));
+	if(!list)
+	{
+		return NULL;
+	}
+	n = 0;
+	for(c = 0; sigs[c].type; c++)
+	{
+		if(first && (sigs[c].offset || (unsigned char) sigs[c].data[0] != byte))
+		{
+			continue;
+		}
+		if(!first && !sigs[c].offset)
+		{
+			continue;
+		}
+		p = (const struct signature **) realloc(list, (n + 2) * sizeof(struct signature *));
+		if(!p)
+		{
+			free(list);
+			return NULL;
+		}
+		list = p;
+		list[n] = &(sigs[c]);
+		n++;
+		list[n] = NULL;
+	}
+	qsort(list, n, sizeof(struct signature *), compare_signatures);
+	return list;
+}
+
+static int
+match(const struct signature *sig, const unsigned char *buf, size_t len)
+{
+	if(sig->offset + sig->len > len ||
+	   memcmp(&(buf[sig->offset]), sig->data, sig->len))
+	{
+		return 0;
+	}
+	if(sig->data2 &&
+	   (sig->offset2 + sig->len2 > len ||
+		memcmp(&(buf[sig->offset2]), sig->data2, sig->len2)))
+	{
+		return 0;
+	}
+	return 1;
+}
+
+/* Order signatures longest first, and otherwise as listed */
+static int
+compare_signatures(const void *a, const void *b)
+{
+	const struct signature *sa, *sb;
+
+	sa = *(const struct signature **) a;
+	sb = *(const struct signature **) b;
+	if(sa->len + sa->len2 != sb->len + sb->len2)
+	{
+		return (sa->len + sa->len2 > sb->len + sb->len2 ? -1 : 1);
+	}
+	return (sa < sb ? -1 : (sa > sb));
+}
+
+/* Free a partially-constructed handler instance */
+static void
+magic_free(IDENTIFY *me)
+{
+	int c;
+
+	for(c = 0; c < 256; c++)
+	{
+		free(me->first[c]);
+	}
+	free(me->other);
+	free(me->types);
+	free(me);
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MIMEDB_H_
+# define MIMEDB_H_
+
+/* The built-in extension-to-type table, generated from mime.types at build
+ * time by mkmimedb.
+ *
+ * The table is a minimal perfect hash: an extension is first hashed with
+ * a seed of zero to select one of mimedb_nbuckets buckets, and then hashed
+ * again with that bucket's seed (mimedb_disp) to give its index in
+ * mimedb_entries. If the entry at that index isn't the extension being
+ * looked up, then the extension isn't in the table.
+ *
+ * Extensions are stored (and must be looked up) in lower case, without
+ * the leading '.'.
+ *
+ * mimedb_types holds a static MIMETYPE for every type named by the table
+ * (and for every type which is treated specially); the type registry is
+ * seeded with these, so that the built-in types are canonical and never
+ * allocated.
+ */
+
+struct mimetype_struct;
+
+struct mimedb_entry
+{
+	const char *ext;
+	/* Index into mimedb_types */
+	unsigned int type;
+};
+
+extern const struct mimetype_struct *const mimedb_types[];
+extern const struct mimedb_entry mimedb_entries[];
+extern const unsigned long mimedb_disp[];
+extern const unsigned long mimedb_nentries;
+extern const unsigned long mimedb_nbuckets;
+
+/* Hash a key with a given seed; the result is always 32 bits wide, so that
+ * the table can be generated on a different host from the one it's used on
+ */
+unsigned long mimedb_hash(const char *key, size_t len, unsigned long seed);
+
+#endif /*!MIMEDB_H_*/
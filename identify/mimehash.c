@@ -0,0 +1,48 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stddef.h>
+
+#include "mimedb.h"
+
+/* This is shared between mkmimedb and the ext identifier, which must agree
+ * exactly on its results.
+ */
+
+/* Seeded FNV-1a, followed by a final avalanche step */
+unsigned long
+mimedb_hash(const char *key, size_t len, unsigned long seed)
+{
+	unsigned long h;
+	size_t c;
+
+	h = (2166136261UL ^ (seed * 2654435761UL)) & 0xffffffffUL;
+	for(c = 0; c < len; c++)
+	{
+		h ^= (unsigned char) key[c];
+		h = (h * 16777619UL) & 0xffffffffUL;
+	}
+	h ^= h >> 16;
+	h = (h * 0x85ebca6bUL) & 0xffffffffUL;
+	h ^= h >> 13;
+	h = (h * 0xc2b2ae35UL) & 0xffffffffUL;
+	h ^= h >> 16;
+	return h;
+}
@@ -0,0 +1,424 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "mimedb.h"
+
+/* mkmimedb reads a mime.types file and writes out C source for the
+ * ext identifier's built-in table and the MIME types it refers to (see
+ * mimedb.h), so that the daemon doesn't have to parse or allocate
+ * anything at startup.
+ *
+ * Usage: mkmimedb mime.types > mimetypes.c
+ */
+
+/* Must be no greater than EXT_MAXLEN in ext.c */
+#define MAXEXTLEN                       64
+/* Average number of keys per first-level bucket */
+#define BUCKETSIZE                      4
+#define MAXSEED                         1000000
+
+struct key
+{
+	char *ext;
+	size_t len;
+	unsigned int type;
+	size_t bucket;
+};
+
+struct special
+{
+	const char *type;
+	/* Written out as-is, so must name flags defined in p_spool.h */
+	const char *flags;
+};
+
+struct bucket
+{
+	size_t index;
+	size_t nkeys;
+	size_t *keys;
+	unsigned long seed;
+};
+
+static const char *progname = "mkmimedb";
+
+/* Types which are treated specially; these are always included in the
+ * table, even if mime.types doesn't list them
+ */
+static const struct special specials[] = {
+	{ "application/xml", "MIME_SIDECAR" },
+	{ NULL, NULL }
+};
+
+static char **types;
+static size_t ntypes, typesalloc;
+static struct key *keys;
+static size_t nkeys, keysalloc;
+
+static void parseline(char *line);
+static unsigned int addtype(const char *type);
+static const char *typeflags(const char *type);
+static void addext(const char *ext, size_t len, unsigned int type);
+static int compare_buckets(const void *a, const void *b);
+static void writestring(FILE *f, const char *str);
+static void *xrealloc(void *ptr, size_t size);
+
+int
+main(int argc, char **argv)
+{
+	FILE *f;
+	char buf[4096];
+	struct bucket *buckets;
+	size_t nbuckets, c, d;
+	long *slots;
+	unsigned long seed, *seeds;
+	size_t *trial;
+
+	if(argc != 2)
+	{
+		fprintf(stderr, "Usage: %s MIME-TYPES\n", progname);
+		exit(EXIT_FAILURE);
+	}
+	f = fopen(argv[1], "r");
+	if(!f)
+	{
+		perror(argv[1]);
+		exit(EXIT_FAILURE);
+	}
+	buf[sizeof(buf) - 1] = 0;
+	while(fgets(buf, sizeof(buf) - 1, f))
+	{
+		parseline(buf);
+	}
+	fclose(f);
+	for(c = 0; specials[c].type; c++)
+	{
+		addtype(specials[c].type);
+	}
+	/* Distribute the keys amongst the first-level buckets */
+	nbuckets = (nkeys + BUCKETSIZE - 1) / BUCKETSIZE;
+	if(!nbuckets)
+	{
+		nbuckets = 1;
+	}
+	buckets = (struct bucket *) xrealloc(NULL, nbuckets * sizeof(struct bucket));
+	memset(buckets, 0, nbuckets * sizeof(struct bucket));
+	for(c = 0; c < nbuckets; c++)
+	{
+		buckets[c].index = c;
+	}
+	for(c = 0; c < nkeys; c++)
+	{
+		keys[c].bucket = mimedb_hash(keys[c].ext, keys[c].len, 0) % nbuckets;
+		buckets[keys[c].bucket].nkeys++;
+	}
+	for(c = 0; c < nbuckets; c++)
+	{
+		buckets[c].keys = (size_t *) xrealloc(NULL, (buckets[c].nkeys + 1) * sizeof(size_t));
+		buckets[c].nkeys = 0;
+	}
+	for(c = 0; c < nkeys; c++)
+	{
+		buckets[keys[c].bucket].keys[buckets[keys[c].bucket].nkeys] = c;
+		buckets[keys[c].bucket].nkeys++;
+	}
+	/* Place the largest buckets first, while there is most room, finding
+	 * for each a seed which maps all of its keys to free slots
+	 */
+	qsort(buckets, nbuckets, sizeof(struct bucket), compare_buckets);
+	slots = (long *) xrealloc(NULL, (nkeys + 1) * sizeof(long));
+	trial = (size_t *) xrealloc(NULL, (nkeys + 1) * sizeof(size_t));
+	for(c = 0; c < nkeys; c++)
+	{
+		slots[c] = -1;
+	}
+	for(c = 0; c < nbuckets && buckets[c].nkeys; c++)
+	{
+		for(seed = 1; seed < MAXSEED; seed++)
+		{
+			for(d = 0; d < buckets[c].nkeys; d++)
+			{
+				trial[d] = mimedb_hash(keys[buckets[c].keys[d]].ext, keys[buckets[c].keys[d]].len, seed) % nkeys;
+				if(slots[trial[d]] != -1)
+				{
+					break;
+				}
+				/* Claim it provisionally, so that keys within this bucket
+				 * can't collide with each other
+				 */
+				slots[trial[d]] = (long) buckets[c].keys[d];
+			}
+			if(d == buckets[c].nkeys)
+			{
+				break;
+			}
+			while(d > 0)
+			{
+				d--;
+				slots[trial[d]] = -1;
+			}
+		}
+		if(seed == MAXSEED)
+		{
+			fprintf(stderr, "%s: failed to construct a perfect hash for %s\n", progname, argv[1]);
+			exit(EXIT_FAILURE);
+		}
+		buckets[c].seed = seed;
+	}
+	printf("/* Generated by mkmimedb from %s -- do not edit */\n\n", argv[1]);
+	printf("#ifdef HAVE_CONFIG_H\n# include \"config.h\"\n#endif\n\n");
+	printf("#include \"p_spool.h\"\n#include \"mimedb.h\"\n\n");
+	printf("const unsigned long mimedb_nentries = %lu;\n", (unsigned long) nkeys);
+	printf("const unsigned long mimedb_nbuckets = %lu;\n\n", (unsigned long) nbuckets);
+	printf("static const MIMETYPE builtin[] = {\n");
+	for(c = 0; c < ntypes; c++)
+	{
+		printf("\t{ ");
+		writestring(stdout, types[c]);
+		printf(", %s },\n", typeflags(types[c]));
+	}
+	printf("};\n\n");
+	printf("const MIMETYPE *const mimedb_types[] = {\n");
+	for(c = 0; c < ntypes; c++)
+	{
+		printf("\t&(builtin[%lu]),\n", (unsigned long) c);
+	}
+	printf("\tNULL\n};\n\n");
+	printf("const struct mimedb_entry mimedb_entries[] = {\n");
+	for(c = 0; c < nkeys; c++)
+	{
+		printf("\t{ ");
+		writestring(stdout, keys[slots[c]].ext);
+		printf(", %u },\n", keys[slots[c]].type);
+	}
+	printf("\t{ NULL, 0 }\n};\n\n");
+	/* Seeds are written in the buckets' original order, not the order in
+	 * which they were placed
+	 */
+	seeds = (unsigned long *) xrealloc(NULL, nbuckets * sizeof(unsigned long));
+	for(c = 0; c < nbuckets; c++)
+	{
+		seeds[buckets[c].index] = buckets[c].seed;
+	}
+	printf("const unsigned long mimedb_disp[] = {");
+	for(c = 0; c < nbuckets; c++)
+	{
+		printf("%s%lu,", (c % 12 ? " " : "\n\t"), seeds[c]);
+	}
+	printf("\n\t0\n};\n");
+	if(fflush(stdout) || ferror(stdout))
+	{
+		perror("(standard output)");
+		exit(EXIT_FAILURE);
+	}
+	return 0;
+}
+
+static void
+parseline(char *line)
+{
+	char *p, *type;
+	unsigned int t;
+
+	while(isspace((unsigned char) *line))
+	{
+		line++;
+	}
+	if(!*line || *line == '#')
+	{
+		return;
+	}
+	type = line;
+	p = line;
+	while(*p && !isspace((unsigned char) *p))
+	{
+		p++;
+	}
+	if(!*p)
+	{
+		return;
+	}
+	*p = 0;
+	p++;
+	/* Type names are case-insensitive, and the registry keeps them in
+	 * lower case
+	 */
+	for(t = 0; type[t]; t++)
+	{
+		type[t] = tolower((unsigned char) type[t]);
+	}
+	/* Types without any extensions aren't stored */
+	t = ntypes;
+	for(;;)
+	{
+		while(isspace((unsigned char) *p))
+		{
+			p++;
+		}
+		if(!*p)
+		{
+			break;
+		}
+		line = p;
+		while(*p && !isspace((unsigned char) *p))
+		{
+			*p = tolower((unsigned char) *p);
+			p++;
+		}
+		if(t == ntypes)
+		{
+			t = addtype(type);
+		}
+		addext(line, p - line, t);
+	}
+}
+
+/* Add a type, if it hasn't been seen already, returning its index */
+static unsigned int
+addtype(const char *type)
+{
+	size_t c;
+
+	for(c = 0; c < ntypes; c++)
+	{
+		if(!strcmp(types[c], type))
+		{
+			return c;
+		}
+	}
+	if(ntypes == typesalloc)
+	{
+		typesalloc += 256;
+		types = (char **) xrealloc(types, typesalloc * sizeof(char *));
+	}
+	types[ntypes] = strdup(type);
+	if(!types[ntypes])
+	{
+		perror(progname);
+		exit(EXIT_FAILURE);
+	}
+	ntypes++;
+	return ntypes - 1;
+}
+
+/* Return the flags for a type, as C source */
+static const char *
+typeflags(const char *type)
+{
+	size_t c;
+
+	for(c = 0; specials[c].type; c++)
+	{
+		if(!strcmp(specials[c].type, type))
+		{
+			return specials[c].flags;
+		}
+	}
+	return "0";
+}
+
+/* Add an extension; as with a linear search of mime.types, the first type
+ * listed for an extension takes precedence over any later ones.
+ */
+static void
+addext(const char *ext, size_t len, unsigned int type)
+{
+	size_t c;
+
+	if(len > MAXEXTLEN)
+	{
+		return;
+	}
+	for(c = 0; c < nkeys; c++)
+	{
+		if(keys[c].len == len && !memcmp(keys[c].ext, ext, len))
+		{
+			return;
+		}
+	}
+	if(nkeys == keysalloc)
+	{
+		keysalloc += 256;
+		keys = (struct key *) xrealloc(keys, keysalloc * sizeof(struct key));
+	}
+	keys[nkeys].ext = (char *) xrealloc(NULL, len + 1);
+	memcpy(keys[nkeys].ext, ext, len);
+	keys[nkeys].ext[len] = 0;
+	keys[nkeys].len = len;
+	keys[nkeys].type = type;
+	nkeys++;
+}
+
+/* Order buckets by descending size */
+static int
+compare_buckets(const void *a, const void *b)
+{
+	const struct bucket *ba, *bb;
+
+	ba = (const struct bucket *) a;
+	bb = (const struct bucket *) b;
+	if(ba->nkeys != bb->nkeys)
+	{
+		return (ba->nkeys > bb->nkeys ? -1 : 1);
+	}
+	return (ba->index < bb->index ? -1 : (ba->index > bb->index));
+}
+
+/* Write a string as a C literal */
+static void
+writestring(FILE *f, const char *str)
+{
+	fputc('"', f);
+	for(; *str; str++)
+	{
+		if(*str == '"' || *str == '\\')
+		{
+			fputc('\\', f);
+		}
+		if(isprint((unsigned char) *str))
+		{
+			fputc(*str, f);
+		}
+		else
+		{
+			fprintf(f, "\\%03o", (unsigned char) *str);
+		}
+	}
+	fputc('"', f);
+}
+
+static void *
+xrealloc(void *ptr, size_t size)
+{
+	void *p;
+
+	p = realloc(ptr, size);
+	if(!p)
+	{
+		perror(progname);
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
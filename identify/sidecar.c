@@ -62,7 +62,7 @@ sidecar_identify(IDENTIFY *me, ASSET *asset)
 		/* Not identified */
 		return 0;
 	}
-	if(!strcmp(asset->type, "application/xml"))
+	if(asset->type->flags & MIME_SIDECAR)
 	{
 		asset->sidecar = 1;
 		return 1;
@@ -0,0 +1,668 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_spool.h"
+
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+
+/* The index maps the (kind, key) of an asset to the UUID it was assigned,
+ * so that an asset which is delivered again is given the same identifier
+ * (and so the same container) as it was the first time.
+ *
+ * The index is kept in two files. The log, at index:path, is an
+ * append-only list of assignments, one per line:--
+ *
+ *   KIND  KEY  UUID
+ *
+ * with fields separated by tabs and escaped as in the journal. A record is
+ * written and synced before the identifier is used, so the log is always
+ * the authoritative copy. If spoold stopped part-way through writing a
+ * record, the incomplete record is discarded when the log is next opened.
+ *
+ * The table, at index:path with '.tab' appended, is an open-addressed hash
+ * table mapped into memory, whose slots hold the hash of a record's kind
+ * and key, the record's offset in the log, and its UUID; a lookup involves
+ * probing the table and then reading the (short) record it points to in
+ * order to confirm the match. The table is synced to disk periodically,
+ * along with the length of the log it reflects; whenever the index is
+ * opened, any records beyond that point are added to the table again, so
+ * it doesn't matter if the most recent changes to the table were lost. If
+ * the table is missing or damaged, it is rebuilt from the log.
+ */
+
+#define INDEX_MAGIC                     "SPOOLIX1"
+#define INDEX_MINSLOTS                  65536
+/* Number of assignments between syncs of the table */
+#define INDEX_CHECKPOINT                1024
+#define INDEX_READLEN                   65536
+
+struct index_header
+{
+	char magic[8];
+	uint64_t nslots;
+	uint64_t count;
+	/* Length of the log reflected in the table as of the last sync */
+	uint64_t logsize;
+	char reserved[32];
+};
+
+struct index_slot
+{
+	uint64_t hash;
+	/* Offset of the record in the log, plus one; zero if the slot is empty */
+	uint64_t offset;
+	unsigned char uuid[16];
+};
+
+/* A new assignment waiting to be written */
+struct index_pending
+{
+	uint64_t hash;
+	/* Offset and length of the record's kind and key within the batch */
+	size_t start;
+	size_t keylen;
+	/* Index of the assignment within the batch */
+	size_t entry;
+};
+
+struct index_table
+{
+	struct index_header *header;
+	struct index_slot *slots;
+	size_t size;
+};
+
+/* Internal utilities */
+static int index_map(struct index_table *table, const char *path, size_t nslots);
+static void index_unmap(struct index_table *table);
+static int index_replay(uint64_t from);
+static int index_record(const char *line, size_t len, uint64_t offset);
+static struct index_slot *index_find(uint64_t hash, const char *key, size_t keylen);
+static void index_insert(struct index_table *table, uint64_t hash, uint64_t offset, const void *uuid);
+static int index_grow(void);
+static int index_sync(void);
+static uint64_t index_hash(const char *key, size_t len);
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int logfd = -1;
+static uint64_t logsize;
+static char *tabpath;
+static struct index_table table;
+/* Assignments since the table was last synced */
+static unsigned long unsynced;
+
+/* Open the index (if one is configured), bringing the table up to date
+ * with the log
+ */
+int
+index_open(void)
+{
+	const char *path;
+	struct stat sbuf;
+
+	path = config_get("index:path", NULL);
+	if(!path || !path[0])
+	{
+		return 0;
+	}
+	logfd = open(path, O_RDWR|O_APPEND|O_CREAT, 0666);
+	if(logfd == -1 || fstat(logfd, &sbuf))
+	{
+		LOG(LOG_ERR, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	tabpath = (char *) malloc(strlen(path) + 5);
+	if(!tabpath)
+	{
+		return -1;
+	}
+	strcpy(tabpath, path);
+	strcat(tabpath, ".tab");
+	if(index_map(&table, tabpath, 0) < 0 || table.header->logsize > (uint64_t) sbuf.st_size)
+	{
+		if(sbuf.st_size)
+		{
+			LOG(LOG_NOTICE, "%s: rebuilding index table\n", tabpath);
+		}
+		index_unmap(&table);
+		if(index_map(&table, tabpath, INDEX_MINSLOTS) < 0)
+		{
+			LOG(LOG_ERR, "%s: %s\n", tabpath, strerror(errno));
+			return -1;
+		}
+	}
+	logsize = table.header->logsize;
+	if(index_replay(logsize) < 0 || index_sync() < 0)
+	{
+		LOG(LOG_ERR, "%s: failed to replay index: %s\n", path, strerror(errno));
+		return -1;
+	}
+	LOG(LOG_INFO, "%s: index contains %lu entries\n", path, (unsigned long) table.header->count);
+	return 0;
+}
+
+/* Obtain the UUID assigned to a (kind, key), or assign it the one given.
+ * Returns 1 if the (kind, key) was found, in which case uuid is updated,
+ * 0 if uuid has been assigned to it (or there is no index), or -1 on
+ * error.
+ */
+int
+index_assign(const char *kind, const char *key, uuid_t uuid)
+{
+	int found;
+
+	if(index_assign_batch(&kind, &key, (uuid_t *) uuid, &found, 1) < 0)
+	{
+		return -1;
+	}
+	return found;
+}
+
+/* Obtain or assign the UUIDs of a batch of (kind, key)s, as
+ * index_assign() does for one, skipping any whose kind or key is NULL:
+ * found[n] is set to 1 if kinds[n] and keys[n] were found (including
+ * earlier in the same batch), in which case uuids[n] is updated, and to 0
+ * otherwise. The new records are written together and synced once.
+ * Returns 0 on success or -1 on error, in which case no new assignments
+ * have been made.
+ */
+int
+index_assign_batch(const char **kinds, const char **keys, uuid_t *uuids, int *found, size_t count)
+{
+	struct index_slot *slot;
+	struct index_pending *pend;
+	uuid_string_t formatted;
+	char *buf;
+	size_t len, alloc, start, keylen, npend, c, d;
+	uint64_t hash;
+	int e;
+
+	for(c = 0; c < count; c++)
+	{
+		found[c] = 0;
+	}
+	if(logfd == -1 || !count)
+	{
+		return 0;
+	}
+	pend = (struct index_pending *) malloc(count * sizeof(struct index_pending));
+	if(!pend)
+	{
+		return -1;
+	}
+	buf = NULL;
+	len = 0;
+	alloc = 0;
+	npend = 0;
+	e = 0;
+	pthread_mutex_lock(&lock);
+	for(c = 0; c < count; c++)
+	{
+		if(!kinds[c] || !keys[c])
+		{
+			continue;
+		}
+		start = len;
+		if(util_escape(&buf, &len, &alloc, 0, kinds[c]) < 0 || util_escape(&buf, &len, &alloc, '\t', keys[c]) < 0)
+		{
+			e = errno;
+			break;
+		}
+		keylen = len - start;
+		hash = index_hash(&(buf[start]), keylen);
+		slot = index_find(hash, &(buf[start]), keylen);
+		if(slot)
+		{
+			memcpy(uuids[c], slot->uuid, sizeof(uuid_t));
+			found[c] = 1;
+			len = start;
+			continue;
+		}
+		/* The same asset may be delivered more than once in a batch */
+		for(d = 0; d < npend; d++)
+		{
+			if(pend[d].hash == hash && pend[d].keylen == keylen &&
+			   !memcmp(&(buf[pend[d].start]), &(buf[start]), keylen))
+			{
+				break;
+			}
+		}
+		if(d < npend)
+		{
+			memcpy(uuids[c], uuids[pend[d].entry], sizeof(uuid_t));
+			found[c] = 1;
+			len = start;
+			continue;
+		}
+		uuid_unparse_lower(uuids[c], formatted);
+		if(util_escape(&buf, &len, &alloc, '\t', formatted) < 0 || util_escape(&buf, &len, &alloc, '\n', "") < 0)
+		{
+			e = errno;
+			break;
+		}
+		pend[npend].hash = hash;
+		pend[npend].start = start;
+		pend[npend].keylen = keylen;
+		pend[npend].entry = c;
+		npend++;
+	}
+	if(!e && table.header->count + npend >= table.header->nslots)
+	{
+		/* The table couldn't be enlarged */
+		e = ENOSPC;
+	}
+	if(!e && npend && (util_write(logfd, buf, len) < 0 || fdatasync(logfd)))
+	{
+		e = errno;
+		/* Don't leave partial records behind */
+		if(ftruncate(logfd, logsize))
+		{
+			LOG(LOG_WARNING, "failed to truncate index log: %s\n", strerror(errno));
+		}
+	}
+	if(e)
+	{
+		pthread_mutex_unlock(&lock);
+		free(buf);
+		free(pend);
+		errno = e;
+		return -1;
+	}
+	for(d = 0; d < npend; d++)
+	{
+		index_insert(&table, pend[d].hash, logsize + pend[d].start + 1, uuids[pend[d].entry]);
+	}
+	free(buf);
+	free(pend);
+	logsize += len;
+	unsynced += npend;
+	if((table.header->count + 1) * 2 > table.header->nslots)
+	{
+		while((table.header->count + 1) * 2 > table.header->nslots)
+		{
+			if(index_grow() < 0)
+			{
+				LOG(LOG_WARNING, "%s: failed to enlarge index table: %s\n", tabpath, strerror(errno));
+				break;
+			}
+		}
+	}
+	else if(unsynced >= INDEX_CHECKPOINT)
+	{
+		index_sync();
+	}
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+/* Map a table into memory; if nslots is non-zero, a new, empty, table is
+ * created (replacing any existing one), otherwise the existing table is
+ * mapped, provided it appears to be intact
+ */
+static int
+index_map(struct index_table *t, const char *path, size_t nslots)
+{
+	struct stat sbuf;
+	struct index_header *h;
+	char *tmp;
+	size_t size;
+	int fd, e;
+
+	t->header = NULL;
+	tmp = NULL;
+	if(nslots)
+	{
+		/* Build the table alongside the existing one, and then replace it */
+		tmp = (char *) malloc(strlen(path) + 5);
+		if(!tmp)
+		{
+			return -1;
+		}
+		strcpy(tmp, path);
+		strcat(tmp, ".new");
+		fd = open(tmp, O_RDWR|O_CREAT|O_TRUNC, 0666);
+		size = sizeof(struct index_header) + nslots * sizeof(struct index_slot);
+		if(fd != -1 && ftruncate(fd, size))
+		{
+			e = errno;
+			close(fd);
+			unlink(tmp);
+			errno = e;
+			fd = -1;
+		}
+	}
+	else
+	{
+		fd = open(path, O_RDWR);
+		if(fd != -1 && fstat(fd, &sbuf))
+		{
+			e = errno;
+			close(fd);
+			errno = e;
+			fd = -1;
+		}
+		size = (fd == -1 ? 0 : (size_t) sbuf.st_size);
+	}
+	if(fd == -1)
+	{
+		free(tmp);
+		return -1;
+	}
+	if(size < sizeof(struct index_header))
+	{
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	h = (struct index_header *) mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	e = errno;
+	close(fd);
+	if(h == (struct index_header *) MAP_FAILED)
+	{
+		if(tmp)
+		{
+			unlink(tmp);
+			free(tmp);
+		}
+		errno = e;
+		return -1;
+	}
+	t->header = h;
+	t->slots = (struct index_slot *) (h + 1);
+	t->size = size;
+	if(tmp)
+	{
+		memcpy(h->magic, INDEX_MAGIC, sizeof(h->magic));
+		h->nslots = nslots;
+		if(msync(h, size, MS_SYNC) || rename(tmp, path))
+		{
+			e = errno;
+			unlink(tmp);
+			free(tmp);
+			index_unmap(t);
+			errno = e;
+			return -1;
+		}
+		free(tmp);
+		return 0;
+	}
+	if(memcmp(h->magic, INDEX_MAGIC, sizeof(h->magic)) || h->nslots < INDEX_MINSLOTS ||
+	   (h->nslots & (h->nslots - 1)) || size != sizeof(struct index_header) + h->nslots * sizeof(struct index_slot) ||
+	   h->count * 2 > h->nslots)
+	{
+		index_unmap(t);
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+static void
+index_unmap(struct index_table *t)
+{
+	if(t->header)
+	{
+		munmap(t->header, t->size);
+		t->header = NULL;
+	}
+}
+
+/* Add the records in the log from a given offset onwards to the table,
+ * discarding any incomplete record at the end
+ */
+static int
+index_replay(uint64_t from)
+{
+	char *buf, *p, *nl;
+	size_t alloc, len, start;
+	ssize_t r;
+
+	alloc = INDEX_READLEN;
+	buf = (char *) malloc(alloc);
+	if(!buf)
+	{
+		return -1;
+	}
+	len = 0;
+	for(;;)
+	{
+		if(len == alloc)
+		{
+			/* A single record longer than the buffer */
+			p = (char *) realloc(buf, alloc * 2);
+			if(!p)
+			{
+				free(buf);
+				return -1;
+			}
+			buf = p;
+			alloc *= 2;
+		}
+		r = pread(logfd, &(buf[len]), alloc - len, from + len);
+		if(r == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if(r < 0)
+		{
+			free(buf);
+			return -1;
+		}
+		if(!r)
+		{
+			break;
+		}
+		len += r;
+		start = 0;
+		while((nl = (char *) memchr(&(buf[start]), '\n', len - start)))
+		{
+			if(index_record(&(buf[start]), nl - &(buf[start]), from + start) < 0)
+			{
+				free(buf);
+				return -1;
+			}
+			start = nl - buf + 1;
+		}
+		memmove(buf, &(buf[start]), len - start);
+		len -= start;
+		from += start;
+	}
+	free(buf);
+	if(len)
+	{
+		LOG(LOG_WARNING, "discarding incomplete record at the end of the index log\n");
+		if(ftruncate(logfd, from))
+		{
+			return -1;
+		}
+	}
+	logsize = from;
+	return 0;
+}
+
+/* Add a record read from the log to the table, unless it's already
+ * present
+ */
+static int
+index_record(const char *line, size_t len, uint64_t offset)
+{
+	const char *t;
+	char formatted[40];
+	uuid_t uuid;
+	uint64_t hash;
+	size_t keylen;
+
+	t = (const char *) memchr(line, '\t', len);
+	if(t)
+	{
+		t = (const char *) memchr(t + 1, '\t', len - (t + 1 - line));
+	}
+	if(!t || len - (t + 1 - line) >= sizeof(formatted))
+	{
+		LOG(LOG_WARNING, "ignoring malformed record in index log at offset %llu\n", (unsigned long long) offset);
+		return 0;
+	}
+	keylen = t - line;
+	memcpy(formatted, t + 1, len - keylen - 1);
+	formatted[len - keylen - 1] = 0;
+	if(uuid_parse(formatted, uuid))
+	{
+		LOG(LOG_WARNING, "ignoring malformed record in index log at offset %llu\n", (unsigned long long) offset);
+		return 0;
+	}
+	hash = index_hash(line, keylen);
+	if(index_find(hash, line, keylen))
+	{
+		return 0;
+	}
+	index_insert(&table, hash, offset + 1, uuid);
+	unsynced++;
+	if((table.header->count + 1) * 2 > table.header->nslots)
+	{
+		return index_grow();
+	}
+	return 0;
+}
+
+/* Find the slot for an escaped kind and key, confirming the match against
+ * the log
+ */
+static struct index_slot *
+index_find(uint64_t hash, const char *key, size_t keylen)
+{
+	struct index_slot *slot;
+	char sbuf[256], *buf;
+	size_t c, mask;
+	ssize_t r;
+	int match;
+
+	mask = table.header->nslots - 1;
+	for(c = hash & mask; table.slots[c].offset; c = (c + 1) & mask)
+	{
+		slot = &(table.slots[c]);
+		if(slot->hash != hash)
+		{
+			continue;
+		}
+		buf = (keylen < sizeof(sbuf) ? sbuf : (char *) malloc(keylen + 1));
+		if(!buf)
+		{
+			return NULL;
+		}
+		do
+		{
+			r = pread(logfd, buf, keylen + 1, slot->offset - 1);
+		}
+		while(r == -1 && errno == EINTR);
+		match = (r == (ssize_t) keylen + 1 && !memcmp(buf, key, keylen) && buf[keylen] == '\t');
+		if(buf != sbuf)
+		{
+			free(buf);
+		}
+		if(match)
+		{
+			return slot;
+		}
+	}
+	return NULL;
+}
+
+/* Add an entry to a table, which must not already be present */
+static void
+index_insert(struct index_table *t, uint64_t hash, uint64_t offset, const void *uuid)
+{
+	size_t c, mask;
+
+	mask = t->header->nslots - 1;
+	c = hash & mask;
+	while(t->slots[c].offset)
+	{
+		c = (c + 1) & mask;
+	}
+	t->slots[c].hash = hash;
+	memcpy(t->slots[c].uuid, uuid, sizeof(t->slots[c].uuid));
+	t->slots[c].offset = offset;
+	t->header->count++;
+}
+
+/* Replace the table with one twice the size */
+static int
+index_grow(void)
+{
+	struct index_table t;
+	size_t c;
+
+	if(index_map(&t, tabpath, table.header->nslots * 2) < 0)
+	{
+		return -1;
+	}
+	for(c = 0; c < table.header->nslots; c++)
+	{
+		if(table.slots[c].offset)
+		{
+			index_insert(&t, table.slots[c].hash, table.slots[c].offset, table.slots[c].uuid);
+		}
+	}
+	index_unmap(&table);
+	table = t;
+	unsynced = 1;
+	return index_sync();
+}
+
+/* Sync the table to disk, and then record the length of the log it
+ * reflects
+ */
+static int
+index_sync(void)
+{
+	if(!unsynced && table.header->logsize == logsize)
+	{
+		return 0;
+	}
+	if(msync(table.header, table.size, MS_SYNC))
+	{
+		return -1;
+	}
+	table.header->logsize = logsize;
+	if(msync(table.header, sizeof(struct index_header), MS_SYNC))
+	{
+		return -1;
+	}
+	unsynced = 0;
+	return 0;
+}
+
+/* FNV-1a (64-bit) */
+static uint64_t
+index_hash(const char *key, size_t len)
+{
+	uint64_t h;
+	size_t c;
+
+	h = 14695981039346656037ULL;
+	for(c = 0; c < len; c++)
+	{
+		h ^= (unsigned char) key[c];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
@@ -20,54 +20,78 @@
 
 #include "p_spool.h"
 
-/* Create a new job */
+static ASSET *job_adopt(JOB *job, ASSET *asset);
+
+/* Create a new job, along with the arena its identifier and assets will
+ * be allocated from
+ */
 JOB *
 job_create(const char *name, SOURCE *source)
 {
+	ARENA *arena;
 	JOB *job;
 	
-	job = (JOB *) calloc(1, sizeof(JOB));
+	arena = arena_create();
+	if(!arena)
+	{
+		return NULL;
+	}
+	job = (JOB *) arena_calloc(arena, sizeof(JOB));
 	if(!job)
 	{
+		arena_release(arena);
 		return NULL;
 	}
+	job->arena = arena;
 	job->source = source;
-	job->name = strdup(name);
+	job->name = arena_strdup(arena, name);
 	if(!job->name)
 	{
-		free(job);
+		arena_release(arena);
 		return NULL;
 	}
-	fprintf(stderr, "%s: created new job '%s'\n", short_program_name, job->name);
+	LOG(LOG_DEBUG, "created new job '%s'\n", job->name);
 	job->refcount = 1;
 	return job;
 }
 
+/* Increase the reference count of a job; jobs may be shared between
+ * pipeline threads, so the count is maintained atomically.
+ */
 int	
 job_addref(JOB *job)
 {
-	job->refcount++;
-	return job->refcount;
+	return __sync_add_and_fetch(&(job->refcount), 1);
 }
 
 int
 job_free(JOB *job)
 {
+	size_t c;
+	int r;
+
 	if(!job)
 	{
 		return 0;
 	}
-	job->refcount--;
-	if(job->refcount)
+	r = __sync_sub_and_fetch(&(job->refcount), 1);
+	if(r)
 	{
-		return job->refcount;
+		return r;
 	}
-	free(job->name);
+	/* Anything not allocated from the job's arena is freed individually */
 	asset_free(job->asset);
 	asset_free(job->sidecar);
+	asset_free(job->container);
 	asset_free(job->stored);
 	asset_free(job->stored_sidecar);
-	free(job);
+	id_free(job->id);
+	for(c = 0; c < job->ndone; c++)
+	{
+		free(job->done[c]);
+	}
+	free(job->done);
+	arena_release(job->arena);
 	return 0;
 }
 
@@ -75,15 +99,13 @@ job_free(JOB *job)
 JOB *
 job_collect(void)
 {
-	SOURCE *src;
+	JOB *job;
 
-	src = plugin_source("file");
-	if(!src)
+	if(job_collect_batch(&job, 1) <= 0)
 	{
-		fprintf(stderr, "%s: failed to locate a source: %s\n", short_program_name, strerror(errno));
 		return NULL;
 	}
-	return src->api->collect(src);
+	return job;
 }
 
 /* Wait until a job is available for collection and then do so */
@@ -91,49 +113,243 @@ JOB *
 job_collect_wait(void)
 {
 	JOB *job;
-	int serr;
+
+	if(job_collect_batch_wait(&job, 1) < 0)
+	{
+		return NULL;
+	}
+	return job;
+}
+
+/* Collect up to max of the jobs which are available for collection,
+ * returning the number collected (which may be zero), or -1 on error
+ */
+int
+job_collect_batch(JOB **jobs, size_t max)
+{
+	SOURCE *src;
+	unsigned long long start;
+	int n, c;
+
+	/* Jobs interrupted by a restart are resumed first */
+	start = stats_clock();
+	for(n = 0; (size_t) n < max; n++)
+	{
+		jobs[n] = journal_resume();
+		if(!jobs[n])
+		{
+			break;
+		}
+		jobs[n]->collected = start;
+	}
+	if(n)
+	{
+		return n;
+	}
+	src = plugin_source("file");
+	if(!src)
+	{
+		LOG(LOG_ERR, "failed to locate a source: %s\n", strerror(errno));
+		return -1;
+	}
+	start = stats_clock();
+	errno = 0;
+	if(src->api->collect_batch)
+	{
+		n = src->api->collect_batch(src, jobs, max);
+	}
+	else
+	{
+		for(n = 0; (size_t) n < max; n++)
+		{
+			jobs[n] = src->api->collect(src);
+			if(!jobs[n])
+			{
+				break;
+			}
+		}
+		if(!n && errno)
+		{
+			n = -1;
+		}
+	}
+	if(n > 0)
+	{
+		stats_time(STAT_COLLECT, start);
+		stats_add(STAT_JOBS_COLLECTED, n);
+		TRACE("collect", NULL, n, start, 0);
+		for(c = 0; c < n; c++)
+		{
+			jobs[c]->collected = start;
+		}
+	}
+	return n;
+}
+
+/* Wait until at least one job is available for collection, and then
+ * collect up to max of them
+ */
+int
+job_collect_batch_wait(JOB **jobs, size_t max)
+{
+	SOURCE *src;
+	int n, serr;
 
 	serr = errno;
 	for(;;)
 	{
-		errno = 0;
-		job = job_collect();
-		if(job)
+		n = job_collect_batch(jobs, max);
+		if(n)
 		{
 			break;
 		}
-		if(errno)
+		src = plugin_source("file");
+		if(src && src->api->wait)
+		{
+			if(src->api->wait(src) < 0)
+			{
+				return -1;
+			}
+		}
+		else
 		{
-			return NULL;
+			sleep(1);
 		}
-		sleep(1);
+	}
+	if(n < 0)
+	{
+		return -1;
 	}
 	errno = serr;
-	return job;
+	return n;
+}
+
+/* Abort each of the jobs in a batch whose status[n] is non-zero, logging
+ * that they failed to do what, and close up the gaps they leave. Returns
+ * the number of jobs remaining, whose statuses are reset to zero.
+ */
+size_t
+job_abort_failed(JOB **jobs, int *status, size_t njobs, const char *what)
+{
+	size_t c, n;
+
+	n = 0;
+	for(c = 0; c < njobs; c++)
+	{
+		if(status[c])
+		{
+			LOG(LOG_ERR, "%s: failed to %s\n", jobs[c]->name, what);
+			job_abort(jobs[c]);
+			continue;
+		}
+		jobs[n] = jobs[c];
+		status[n] = 0;
+		n++;
+	}
+	return n;
 }
 
 /* Abort a job */
 int
 job_abort(JOB *job)
 {
-	fprintf(stderr, "%s: %s: aborting\n", short_program_name, job->name);
+	LOG(LOG_NOTICE, "%s: aborting\n", job->name);
 	job->aborted = 1;
+	stats_add(STAT_JOBS_ABORTED, 1);
+	if(trace_enabled)
+	{
+		trace_job(job);
+	}
+	journal_record(job, JOURNAL_ABORT, NULL, NULL);
 	job->source->api->abort(job->source, job);
 	return job_free(job);
 }
 
-/* Begin processing a job (prepare for submission) */
+/* Begin processing a job (prepare for submission). In pipeline mode this
+ * happens as soon as the job is collected, so that the source doesn't
+ * offer it again; subsequent calls are no-ops.
+ */
 int
 job_begin(JOB *job)
 {
-	int r;
-	
-	r = job->source->api->begin(job->source, job);
-	if(r < 0)
+	int status;
+
+	status = 0;
+	job_begin_batch(&job, 1, &status);
+	return status;
+}
+
+/* Begin processing a batch of jobs, recording them in the journal
+ * together. Jobs whose status[n] is already non-zero are skipped, and
+ * status[n] is set to -1 for any job which couldn't be begun. Returns -1
+ * if any of the jobs failed, or 0 otherwise.
+ */
+int
+job_begin_batch(JOB **jobs, size_t njobs, int *status)
+{
+	JOB **begin;
+	const char **sidecars;
+	unsigned long long start;
+	size_t c, n;
+	int r, e;
+
+	start = stats_clock();
+	n = 0;
+	begin = (JOB **) calloc(njobs, sizeof(JOB *));
+	sidecars = (const char **) calloc(njobs, sizeof(char *));
+	r = (begin && sidecars ? 0 : -1);
+	for(c = 0; !r && c < njobs; c++)
 	{
-		return -1;
+		if(!status[c] && !jobs[c]->begun)
+		{
+			begin[c] = jobs[c];
+			sidecars[c] = (jobs[c]->sidecar ? ASSET_PATH(jobs[c]->sidecar) : "");
+		}
 	}
-	return 0;
+	/* The journal must know about the jobs before they move */
+	if(!r)
+	{
+		r = journal_record_batch(begin, njobs, JOURNAL_BEGIN, sidecars);
+	}
+	e = errno;
+	for(c = 0; c < njobs; c++)
+	{
+		if(status[c] || jobs[c]->begun)
+		{
+			continue;
+		}
+		if(r < 0)
+		{
+			status[c] = -1;
+		}
+		else if(jobs[c]->source->api->begin(jobs[c]->source, jobs[c]) < 0)
+		{
+			e = errno;
+			status[c] = -1;
+		}
+		if(status[c])
+		{
+			LOG(LOG_ERR, "%s: failed to prepare job for processing: %s\n", jobs[c]->name, strerror(e));
+			continue;
+		}
+		jobs[c]->begun = 1;
+		n++;
+	}
+	free(begin);
+	free(sidecars);
+	if(n)
+	{
+		TRACE("job_begin", NULL, n, start, 0);
+	}
+	r = 0;
+	for(c = 0; c < njobs; c++)
+	{
+		if(status[c])
+		{
+			r = -1;
+		}
+	}
+	return r;
 }
 
 /* Mark a job as having been submitted for processing */
@@ -142,18 +358,44 @@ job_submitted(JOB *job)
 {
 	if(!job->aborted)
 	{
-		fprintf(stderr, "%s: %s: job has been submitted for processing\n", short_program_name, job->name);
+		LOG(LOG_DEBUG, "%s: job has been submitted for processing\n", job->name);
 		job->submitted = 1;
 	}
 	return job_free(job);
 }
 
+/* Mark a job as having completed processing, releasing the reference
+ * held by whatever was processing it
+ */
+int
+job_complete(JOB *job)
+{
+	if(!job->aborted)
+	{
+		LOG(LOG_INFO, "%s: job has been completed\n", job->name);
+		job->completed = 1;
+		stats_add(STAT_JOBS_COMPLETED, 1);
+		job->source->api->complete(job->source, job);
+		journal_record(job, JOURNAL_COMPLETE, NULL, NULL);
+		if(trace_enabled)
+		{
+			trace_job(job);
+		}
+	}
+	return job_free(job);
+}
+
 /* Set the source asset of a job. The memory-owner of the asset will be the
  * job from this point on.
  */
 int
 job_set_source_asset(JOB *job, ASSET *asset)
 {
+	asset = job_adopt(job, asset);
+	if(!asset)
+	{
+		return -1;
+	}
 	if(job->asset)
 	{
 		asset_free(job->asset);
@@ -174,6 +416,11 @@ job_set_sidecar(JOB *job, ASSET *asset)
 		errno = EINVAL;
 		return -1;
 	}
+	asset = job_adopt(job, asset);
+	if(!asset)
+	{
+		return -1;
+	}
 	if(job->sidecar)
 	{
 		asset_free(job->sidecar);
@@ -193,6 +440,11 @@ job_set_container(JOB *job, ASSET *asset)
 		errno = EINVAL;
 		return -1;
 	}
+	asset = job_adopt(job, asset);
+	if(!asset)
+	{
+		return -1;
+	}
 	if(job->container)
 	{
 		asset_free(job->container);
@@ -210,8 +462,27 @@ job_set_id(JOB *job, JOBID *id)
 {
 	if(job->id)
 	{
-		id_free(id);
+		id_free(job->id);
 	}
 	job->id = id;
 	return 0;
 }
+
+/* Move an asset which isn't already part of a job's arena into it */
+static ASSET *
+job_adopt(JOB *job, ASSET *asset)
+{
+	ASSET *p;
+
+	if(asset->arena == job->arena)
+	{
+		return asset;
+	}
+	p = asset_copy(job->arena, asset);
+	if(!p)
+	{
+		return NULL;
+	}
+	asset_free(asset);
+	return p;
+}
@@ -0,0 +1,852 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_spool.h"
+
+/* The journal is an append-only log of the state transitions of jobs,
+ * kept in journal:path, so that jobs which were in progress when spoold
+ * stopped can be resumed where they left off. Each record is a line of
+ * tab-separated fields:--
+ *
+ *   begin      NAME  SIDECAR      (written before the job is moved to
+ *                                  'pending')
+ *   id         NAME  UUID
+ *   container  NAME  PATH
+ *   stored     NAME  PATH  SIDECAR-PATH
+ *   recipe     NAME  RECIPE
+ *   complete   NAME
+ *   abort      NAME
+ *
+ * with '%', tab and newline within fields escaped as %25, %09 and %0A.
+ *
+ * A thread recording a transition waits until the record has reached the
+ * disk. Records are written in batches: whichever thread finds no write
+ * in progress writes everything which has been queued so far and calls
+ * fdatasync() once, while any threads which queue records in the meantime
+ * wait for the next batch; under load, many transitions share one sync.
+ *
+ * At startup, the journal is replayed: jobs which began but neither
+ * completed nor were aborted are handed back to job_collect() (see
+ * journal_resume()) with whatever progress they had made already applied,
+ * so that they pick up from the last recorded transition. The journal is
+ * then rewritten to contain only those jobs.
+ *
+ * So that the journal doesn't grow without limit while spoold runs, once
+ * journal:compact jobs have completed or been aborted, the thread writing
+ * the next batch replays the journal and rewrites it in the same way
+ * before returning.
+ */
+
+#define JOURNAL_READLEN                 65536
+
+typedef struct journal_job_struct JOURNAL_JOB;
+
+/* The replayed state of a job */
+struct journal_job_struct
+{
+	char *name;
+	char *sidecar;
+	char *id;
+	char *container;
+	char *stored;
+	char *stored_sidecar;
+	char **recipes;
+	size_t nrecipes;
+	int finished;
+};
+
+static const char *const events[] = {
+	"begin", "id", "container", "stored", "recipe", "complete", "abort", NULL
+};
+
+/* Internal utilities */
+static int journal_replay(const char *path);
+static int journal_apply(char **fields, size_t nfields);
+static JOURNAL_JOB *journal_find(const char *name);
+static void journal_forget(JOURNAL_JOB *j);
+static JOB *journal_restore(JOURNAL_JOB *j);
+static char *journal_sidecar(JOB *job, const char *path);
+static int journal_rewrite(const char *path);
+static int journal_compact(void);
+static int journal_append(char **buf, size_t *len, size_t *alloc, int event, const char *name, const char *arg, const char *arg2);
+static int journal_commit(unsigned long long seq);
+static int journal_flush(int fd, const char *buf, size_t len);
+
+static int journalfd = -1;
+static char *journalpath;
+/* Number of jobs to finish between compactions, and the number finished
+ * since the last
+ */
+static int compactafter;
+static unsigned long finished;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t written = PTHREAD_COND_INITIALIZER;
+/* Records queued for the next batch */
+static char *queue;
+static size_t queuelen, queuealloc;
+/* Sequence numbers of the last record queued and the last written */
+static unsigned long long appended, committed;
+static int flushing;
+
+/* Jobs replayed from the journal; used only by journal_open() and
+ * whichever thread is compacting the journal
+ */
+static JOURNAL_JOB *jjobs;
+static size_t njjobs;
+/* Jobs waiting to be resumed */
+static JOB **resumable;
+static size_t nresumable, nextresumable;
+
+/* Replay the journal (if one is configured) and open it for writing */
+int
+journal_open(void)
+{
+	const char *path;
+	size_t c;
+	JOB *job, **p;
+
+	path = config_get("journal:path", NULL);
+	if(!path || !path[0])
+	{
+		return 0;
+	}
+	journalpath = strdup(path);
+	if(!journalpath)
+	{
+		return -1;
+	}
+	compactafter = config_get_int("journal:compact", 1000);
+	if(journal_replay(path) < 0)
+	{
+		LOG(LOG_ERR, "%s: failed to replay journal: %s\n", path, strerror(errno));
+		return -1;
+	}
+	for(c = 0; c < njjobs; c++)
+	{
+		if(jjobs[c].finished)
+		{
+			continue;
+		}
+		job = journal_restore(&(jjobs[c]));
+		if(!job)
+		{
+			if(errno)
+			{
+				LOG(LOG_ERR, "%s: failed to resume job: %s\n", jjobs[c].name, strerror(errno));
+			}
+			jjobs[c].finished = 1;
+			continue;
+		}
+		p = (JOB **) realloc(resumable, (nresumable + 1) * sizeof(JOB *));
+		if(!p)
+		{
+			job_free(job);
+			return -1;
+		}
+		resumable = p;
+		resumable[nresumable] = job;
+		nresumable++;
+	}
+	journalfd = journal_rewrite(path);
+	if(journalfd == -1)
+	{
+		LOG(LOG_ERR, "%s: failed to rewrite journal: %s\n", path, strerror(errno));
+		return -1;
+	}
+	for(c = 0; c < njjobs; c++)
+	{
+		journal_forget(&(jjobs[c]));
+	}
+	free(jjobs);
+	jjobs = NULL;
+	njjobs = 0;
+	LOG(LOG_INFO, "%s: %lu job(s) to resume\n", path, (unsigned long) nresumable);
+	return 0;
+}
+
+/* Return the next job recovered from the journal, if any; it has already
+ * begun, and will skip any stages which it had already completed.
+ */
+JOB *
+journal_resume(void)
+{
+	JOB *job;
+
+	pthread_mutex_lock(&lock);
+	if(nextresumable >= nresumable)
+	{
+		pthread_mutex_unlock(&lock);
+		return NULL;
+	}
+	job = resumable[nextresumable];
+	resumable[nextresumable] = NULL;
+	nextresumable++;
+	pthread_mutex_unlock(&lock);
+	LOG(LOG_INFO, "%s: resuming job\n", job->name);
+	return job;
+}
+
+/* Record a job's state transition, returning once it has been written */
+int
+journal_record(JOB *job, int event, const char *arg, const char *arg2)
+{
+	int r;
+
+	if(journalfd == -1)
+	{
+		return 0;
+	}
+	pthread_mutex_lock(&lock);
+	if(journal_append(&queue, &queuelen, &queuealloc, event, job->name, arg, arg2) < 0)
+	{
+		pthread_mutex_unlock(&lock);
+		return -1;
+	}
+	if(event == JOURNAL_COMPLETE || event == JOURNAL_ABORT)
+	{
+		finished++;
+	}
+	appended++;
+	r = journal_commit(appended);
+	pthread_mutex_unlock(&lock);
+	return r;
+}
+
+/* Record the same state transition for each of a batch of jobs (skipping
+ * any NULL entries), with args[n] as the argument for jobs[n], returning
+ * once all of the records have been written
+ */
+int
+journal_record_batch(JOB **jobs, size_t njobs, int event, const char **args)
+{
+	size_t c;
+	int r;
+
+	if(journalfd == -1)
+	{
+		return 0;
+	}
+	pthread_mutex_lock(&lock);
+	for(c = 0; c < njobs; c++)
+	{
+		if(!jobs[c])
+		{
+			continue;
+		}
+		if(journal_append(&queue, &queuelen, &queuealloc, event, jobs[c]->name, args[c], NULL) < 0)
+		{
+			pthread_mutex_unlock(&lock);
+			return -1;
+		}
+		if(event == JOURNAL_COMPLETE || event == JOURNAL_ABORT)
+		{
+			finished++;
+		}
+		appended++;
+	}
+	r = journal_commit(appended);
+	pthread_mutex_unlock(&lock);
+	return r;
+}
+
+/* Wait until the records queued up to seq have been written, writing
+ * them (and anything else queued) if no other thread is doing so; the
+ * caller must hold lock
+ */
+static int
+journal_commit(unsigned long long seq)
+{
+	unsigned long long upto;
+	char *buf;
+	size_t len;
+	int r, fd, compact, newfd;
+
+	r = 0;
+	while(committed < seq)
+	{
+		if(flushing)
+		{
+			pthread_cond_wait(&written, &lock);
+			continue;
+		}
+		/* Write the whole batch on behalf of everybody waiting for it */
+		flushing = 1;
+		buf = queue;
+		len = queuelen;
+		upto = appended;
+		fd = journalfd;
+		queue = NULL;
+		queuelen = 0;
+		queuealloc = 0;
+		/* Everything counted in finished is in this batch */
+		compact = (compactafter > 0 && finished >= (unsigned long) compactafter);
+		if(compact)
+		{
+			finished = 0;
+		}
+		pthread_mutex_unlock(&lock);
+		r = (fd == -1 ? 0 : journal_flush(fd, buf, len));
+		free(buf);
+		/* Nobody else can write to the journal until flushing is
+		 * cleared, so it's complete up to this batch
+		 */
+		newfd = (!r && fd != -1 && compact ? journal_compact() : -1);
+		pthread_mutex_lock(&lock);
+		if(newfd != -1)
+		{
+			close(journalfd);
+			journalfd = newfd;
+		}
+		if(r < 0 && journalfd != -1)
+		{
+			LOG(LOG_ERR, "failed to write to journal; jobs will not be recoverable after a crash: %s\n", strerror(errno));
+			close(journalfd);
+			journalfd = -1;
+		}
+		committed = upto;
+		flushing = 0;
+		pthread_cond_broadcast(&written);
+	}
+	return r;
+}
+
+/* Read the journal, building up the state of each job it mentions */
+static int
+journal_replay(const char *path)
+{
+	char *buf, *p, *line, *end, *fields[5];
+	size_t len, alloc, nfields;
+	ssize_t r;
+	int fd;
+
+	do
+	{
+		fd = open(path, O_RDONLY);
+	}
+	while(fd == -1 && errno == EINTR);
+	if(fd == -1)
+	{
+		return (errno == ENOENT ? 0 : -1);
+	}
+	buf = NULL;
+	len = 0;
+	alloc = 0;
+	for(;;)
+	{
+		if(alloc - len < JOURNAL_READLEN)
+		{
+			p = (char *) realloc(buf, alloc + JOURNAL_READLEN + 1);
+			if(!p)
+			{
+				free(buf);
+				close(fd);
+				return -1;
+			}
+			buf = p;
+			alloc += JOURNAL_READLEN;
+		}
+		r = read(fd, &(buf[len]), alloc - len);
+		if(r == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if(r <= 0)
+		{
+			break;
+		}
+		len += r;
+	}
+	close(fd);
+	if(r < 0)
+	{
+		free(buf);
+		return -1;
+	}
+	for(line = buf; line < buf + len; line = end + 1)
+	{
+		end = memchr(line, '\n', buf + len - line);
+		if(!end)
+		{
+			/* A partially-written final record is ignored */
+			break;
+		}
+		*end = 0;
+		nfields = 0;
+		for(p = line; nfields < 5; )
+		{
+			fields[nfields] = p;
+			nfields++;
+			p = strchr(p, '\t');
+			if(!p)
+			{
+				break;
+			}
+			*p = 0;
+			p++;
+		}
+		if(journal_apply(fields, nfields) < 0)
+		{
+			free(buf);
+			return -1;
+		}
+	}
+	free(buf);
+	return 0;
+}
+
+/* Apply a single record to the replayed state */
+static int
+journal_apply(char **fields, size_t nfields)
+{
+	JOURNAL_JOB *j;
+	char **p;
+	size_t c;
+	int event;
+
+	for(event = 0; events[event]; event++)
+	{
+		if(!strcmp(fields[0], events[event]))
+		{
+			break;
+		}
+	}
+	if(!events[event] || nfields < 2)
+	{
+		/* Unrecognised records are skipped */
+		return 0;
+	}
+	for(c = 1; c < nfields; c++)
+	{
+		util_unescape(fields[c]);
+	}
+	j = journal_find(fields[1]);
+	if(!j)
+	{
+		return -1;
+	}
+	if(j->finished || !j->name)
+	{
+		/* A new job, or one with the same name as a finished one (a job's
+		 * identifier may be assigned before it begins)
+		 */
+		journal_forget(j);
+		j->name = strdup(fields[1]);
+		if(!j->name)
+		{
+			return -1;
+		}
+	}
+	switch(event)
+	{
+	case JOURNAL_BEGIN:
+		free(j->sidecar);
+		j->sidecar = (nfields > 2 && fields[2][0] ? strdup(fields[2]) : NULL);
+		break;
+	case JOURNAL_ID:
+		free(j->id);
+		j->id = (nfields > 2 ? strdup(fields[2]) : NULL);
+		break;
+	case JOURNAL_CONTAINER:
+		free(j->container);
+		j->container = (nfields > 2 ? strdup(fields[2]) : NULL);
+		break;
+	case JOURNAL_STORED:
+		free(j->stored);
+		free(j->stored_sidecar);
+		j->stored = (nfields > 2 ? strdup(fields[2]) : NULL);
+		j->stored_sidecar = (nfields > 3 && fields[3][0] ? strdup(fields[3]) : NULL);
+		break;
+	case JOURNAL_RECIPE:
+		if(nfields < 3)
+		{
+			break;
+		}
+		p = (char **) realloc(j->recipes, (j->nrecipes + 1) * sizeof(char *));
+		if(!p)
+		{
+			return -1;
+		}
+		j->recipes = p;
+		j->recipes[j->nrecipes] = strdup(fields[2]);
+		if(!j->recipes[j->nrecipes])
+		{
+			return -1;
+		}
+		j->nrecipes++;
+		break;
+	case JOURNAL_COMPLETE:
+	case JOURNAL_ABORT:
+		j->finished = 1;
+		break;
+	}
+	return 0;
+}
+
+/* Find the replayed state of a job by name, creating it if needed */
+static JOURNAL_JOB *
+journal_find(const char *name)
+{
+	JOURNAL_JOB *p;
+	size_t c;
+
+	for(c = njjobs; c > 0; c--)
+	{
+		if(jjobs[c - 1].name && !strcmp(jjobs[c - 1].name, name))
+		{
+			return &(jjobs[c - 1]);
+		}
+	}
+	p = (JOURNAL_JOB *) realloc(jjobs, (njjobs + 1) * sizeof(JOURNAL_JOB));
+	if(!p)
+	{
+		return NULL;
+	}
+	jjobs = p;
+	memset(&(jjobs[njjobs]), 0, sizeof(JOURNAL_JOB));
+	njjobs++;
+	return &(jjobs[njjobs - 1]);
+}
+
+static void
+journal_forget(JOURNAL_JOB *j)
+{
+	size_t c;
+
+	free(j->name);
+	free(j->sidecar);
+	free(j->id);
+	free(j->container);
+	free(j->stored);
+	free(j->stored_sidecar);
+	for(c = 0; c < j->nrecipes; c++)
+	{
+		free(j->recipes[c]);
+	}
+	free(j->recipes);
+	memset(j, 0, sizeof(JOURNAL_JOB));
+}
+
+/* Construct a job from its replayed state, via its source; returns NULL
+ * with errno set to zero if there's nothing to resume
+ */
+static JOB *
+journal_restore(JOURNAL_JOB *j)
+{
+	SOURCE *src;
+	JOB *job;
+	ASSET *asset;
+	uuid_t uu;
+	JOBID *id;
+	size_t c;
+	char *path;
+
+	src = plugin_source("file");
+	if(!src || !src->api->resume)
+	{
+		LOG(LOG_ERR, "%s: source cannot resume jobs\n", j->name);
+		errno = 0;
+		return NULL;
+	}
+	job = src->api->resume(src, j->name);
+	if(!job)
+	{
+		return NULL;
+	}
+	job->begun = 1;
+	if(j->stored && access(j->stored, F_OK))
+	{
+		/* Store it again */
+		free(j->stored);
+		j->stored = NULL;
+	}
+	if(access(ASSET_PATH(job->asset), F_OK) && !j->stored)
+	{
+		/* Either the job didn't get as far as being moved to 'pending', or
+		 * it's gone away since
+		 */
+		job_free(job);
+		errno = 0;
+		return NULL;
+	}
+	path = (j->sidecar ? journal_sidecar(job, j->sidecar) : NULL);
+	if(path)
+	{
+		asset = asset_create_arena(job->arena);
+		if(!asset || asset_set_path(asset, path) < 0 || type_identify_asset(asset) < 0 || !asset->sidecar || job_set_sidecar(job, asset) < 0)
+		{
+			asset_free(asset);
+		}
+		free(path);
+	}
+	if(j->id && !uuid_parse(j->id, uu))
+	{
+		id = id_create_uuid(job->arena, uu);
+		if(!id)
+		{
+			job_free(job);
+			return NULL;
+		}
+		job_set_id(job, id);
+		/* It may have got as far as creating the container */
+		job->reused = 1;
+	}
+	if(job->id && j->container)
+	{
+		asset = asset_create_arena(job->arena);
+		if(!asset)
+		{
+			job_free(job);
+			return NULL;
+		}
+		asset->container = 1;
+		asset_set_path(asset, j->container);
+		job_set_container(job, asset);
+	}
+	if(job->container && j->stored)
+	{
+		job->stored = asset_create_arena(job->arena);
+		if(!job->stored)
+		{
+			job_free(job);
+			return NULL;
+		}
+		asset_set_path(job->stored, j->stored);
+		type_identify_asset(job->stored);
+		if(j->stored_sidecar)
+		{
+			job->stored_sidecar = asset_create_arena(job->arena);
+			if(!job->stored_sidecar)
+			{
+				job_free(job);
+				return NULL;
+			}
+			asset_set_path(job->stored_sidecar, j->stored_sidecar);
+			type_identify_asset(job->stored_sidecar);
+		}
+		/* Recipes are only run once the job has been stored; they're
+		 * copied, as the journal is rewritten from j afterwards
+		 */
+		if(j->nrecipes)
+		{
+			job->done = (char **) calloc(j->nrecipes, sizeof(char *));
+			if(!job->done)
+			{
+				job_free(job);
+				return NULL;
+			}
+		}
+		for(c = 0; c < j->nrecipes; c++)
+		{
+			job->done[c] = strdup(j->recipes[c]);
+			if(!job->done[c])
+			{
+				job_free(job);
+				return NULL;
+			}
+			job->ndone++;
+		}
+	}
+	/* If the asset was linked or renamed into storage, the file in
+	 * 'pending' may have gone, so go by the stored copy if there is one
+	 */
+	if(job->stored && job->stored->type)
+	{
+		asset_set_type(job->asset, job->stored->type);
+	}
+	else if(type_identify_asset(job->asset) < 0)
+	{
+		job_free(job);
+		return NULL;
+	}
+	return job;
+}
+
+/* Locate a resumed job's sidecar, returning a new string, or NULL if it
+ * has gone away. The journal records where the sidecar was when the job
+ * began; the source moves it alongside the asset, so if it isn't there
+ * any more, it's looked for next to the asset.
+ */
+static char *
+journal_sidecar(JOB *job, const char *path)
+{
+	const char *name;
+	char *p;
+	size_t dl, nl;
+
+	if(!access(path, F_OK))
+	{
+		return strdup(path);
+	}
+	name = strrchr(path, '/');
+	name = (name ? name + 1 : path);
+	dl = ASSET_BASENAME(job->asset) - ASSET_PATH(job->asset);
+	nl = strlen(name);
+	p = (char *) malloc(dl + nl + 1);
+	if(!p)
+	{
+		return NULL;
+	}
+	memcpy(p, ASSET_PATH(job->asset), dl);
+	memcpy(&(p[dl]), name, nl + 1);
+	if(access(p, F_OK))
+	{
+		free(p);
+		return NULL;
+	}
+	return p;
+}
+
+/* Replace the journal with one describing only the replayed jobs which
+ * haven't finished, returning a descriptor open for appending to it
+ */
+static int
+journal_rewrite(const char *path)
+{
+	JOURNAL_JOB *j;
+	char *tmp, *buf;
+	size_t c, d, len, alloc;
+	int fd, r;
+
+	tmp = (char *) malloc(strlen(path) + 5);
+	if(!tmp)
+	{
+		return -1;
+	}
+	sprintf(tmp, "%s.new", path);
+	buf = NULL;
+	len = 0;
+	alloc = 0;
+	r = 0;
+	for(c = 0; !r && c < njjobs; c++)
+	{
+		j = &(jjobs[c]);
+		if(j->finished || !j->name)
+		{
+			continue;
+		}
+		r |= journal_append(&buf, &len, &alloc, JOURNAL_BEGIN, j->name, (j->sidecar ? j->sidecar : ""), NULL);
+		if(j->id)
+		{
+			r |= journal_append(&buf, &len, &alloc, JOURNAL_ID, j->name, j->id, NULL);
+		}
+		if(j->container)
+		{
+			r |= journal_append(&buf, &len, &alloc, JOURNAL_CONTAINER, j->name, j->container, NULL);
+		}
+		if(j->stored)
+		{
+			r |= journal_append(&buf, &len, &alloc, JOURNAL_STORED, j->name, j->stored, (j->stored_sidecar ? j->stored_sidecar : ""));
+		}
+		for(d = 0; d < j->nrecipes; d++)
+		{
+			r |= journal_append(&buf, &len, &alloc, JOURNAL_RECIPE, j->name, j->recipes[d], NULL);
+		}
+	}
+	if(r)
+	{
+		free(buf);
+		free(tmp);
+		return -1;
+	}
+	do
+	{
+		fd = open(tmp, O_WRONLY|O_APPEND|O_CREAT|O_TRUNC, 0666);
+	}
+	while(fd == -1 && errno == EINTR);
+	if(fd == -1)
+	{
+		free(buf);
+		free(tmp);
+		return -1;
+	}
+	r = journal_flush(fd, buf, len);
+	free(buf);
+	if(r < 0 || rename(tmp, path))
+	{
+		close(fd);
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	return fd;
+}
+
+/* Replay the journal and rewrite it without the jobs which have finished,
+ * returning a descriptor open on the new journal; on failure, the caller
+ * carries on with the old one
+ */
+static int
+journal_compact(void)
+{
+	unsigned long long start;
+	size_t c, n;
+	int fd;
+
+	start = stats_clock();
+	fd = -1;
+	if(journal_replay(journalpath) < 0 || (fd = journal_rewrite(journalpath)) == -1)
+	{
+		LOG(LOG_WARNING, "%s: failed to compact journal: %s\n", journalpath, strerror(errno));
+	}
+	n = 0;
+	for(c = 0; c < njjobs; c++)
+	{
+		if(jjobs[c].name && !jjobs[c].finished)
+		{
+			n++;
+		}
+		journal_forget(&(jjobs[c]));
+	}
+	free(jjobs);
+	jjobs = NULL;
+	njjobs = 0;
+	if(fd != -1)
+	{
+		LOG(LOG_DEBUG, "%s: compacted journal to %lu job(s) in progress\n", journalpath, (unsigned long) n);
+		TRACE("journal_compact", journalpath, n, start, 0);
+	}
+	return fd;
+}
+
+/* Append a formatted record to a buffer */
+static int
+journal_append(char **buf, size_t *len, size_t *alloc, int event, const char *name, const char *arg, const char *arg2)
+{
+	if(util_escape(buf, len, alloc, 0, events[event]) < 0 ||
+	   util_escape(buf, len, alloc, '\t', name) < 0 ||
+	   (arg && util_escape(buf, len, alloc, '\t', arg) < 0) ||
+	   (arg2 && util_escape(buf, len, alloc, '\t', arg2) < 0))
+	{
+		return -1;
+	}
+	return util_escape(buf, len, alloc, '\n', "");
+}
+
+/* Write a batch of records and wait for them to reach the disk */
+static int
+journal_flush(int fd, const char *buf, size_t len)
+{
+	if(util_write(fd, buf, len) < 0)
+	{
+		return -1;
+	}
+	return fdatasync(fd);
+}
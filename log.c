@@ -0,0 +1,286 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_spool.h"
+
+#include <stdarg.h>
+#include <time.h>
+
+/* Log messages are formatted by the thread logging them into a ring
+ * buffer belonging to that thread (see ring.c), so adding a message needs
+ * no locks, and written to stderr in batches by a background thread.
+ * Messages carry a global sequence number so that the drain can
+ * interleave the rings in the order the messages were logged.
+ *
+ * Until log_init() has been called, and whenever a thread's ring is full
+ * (or couldn't be created) and the message is a warning or an error,
+ * messages are written directly instead; other messages are dropped (and
+ * counted) if the ring is full.
+ *
+ * The LOG() macro checks the level before evaluating its arguments, and
+ * if configured with --disable-debug-log, debug messages are compiled
+ * out altogether.
+ */
+
+#define LOG_MSGLEN                      512
+#define LOG_SLOTS                       256
+#define LOG_BUFLEN                      65536
+/* Interval between drains, in milliseconds */
+#define LOG_INTERVAL                    20
+
+typedef struct logmsg_struct LOGMSG;
+
+struct logmsg_struct
+{
+	unsigned long seq;
+	size_t len;
+	char text[LOG_MSGLEN];
+};
+
+/* Internal utilities */
+static void *log_run(void *arg);
+static void log_drain(void);
+static void log_direct(const char *fmt, va_list ap);
+static size_t log_format(char *buf, const char *fmt, va_list ap);
+
+int log_level = LOG_INFO;
+
+static const char *levels[] = { "emerg", "alert", "crit", "error", "warning", "notice", "info", "debug", NULL };
+
+static int started;
+static unsigned long seq;
+static unsigned long dropped;
+static RINGSET rings;
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+static char *outbuf;
+
+/* Apply the logging configuration and start the thread which writes
+ * buffered messages
+ */
+int
+log_init(void)
+{
+	const char *level;
+	pthread_t thread;
+	int c, r;
+
+	level = config_get("log:level", NULL);
+	if(level)
+	{
+		for(c = 0; levels[c]; c++)
+		{
+			if(!strcasecmp(level, levels[c]))
+			{
+				break;
+			}
+		}
+		if(!levels[c])
+		{
+			fprintf(stderr, "%s: log:level must be one of 'error', 'warning', 'notice', 'info' or 'debug'\n", short_program_name);
+			errno = EINVAL;
+			return -1;
+		}
+		log_level = c;
+	}
+	c = config_get_int("log:buffer", LOG_SLOTS);
+	if(c < 16)
+	{
+		c = 16;
+	}
+	outbuf = (char *) malloc(LOG_BUFLEN);
+	if(!outbuf || ring_init(&rings, sizeof(LOGMSG), c) < 0)
+	{
+		return -1;
+	}
+	r = pthread_create(&thread, NULL, log_run, NULL);
+	if(r)
+	{
+		errno = r;
+		return -1;
+	}
+	pthread_detach(thread);
+	started = 1;
+	/* Don't lose whatever is buffered when the process exits */
+	atexit(log_flush);
+	return 0;
+}
+
+/* Log a message; use LOG() rather than calling this directly, so that
+ * the level is checked first
+ */
+void
+log_write(int level, const char *fmt, ...)
+{
+	RING *ring;
+	LOGMSG *msg;
+	va_list ap;
+
+	va_start(ap, fmt);
+	if(!started)
+	{
+		log_direct(fmt, ap);
+		va_end(ap);
+		return;
+	}
+	msg = (LOGMSG *) ring_reserve(&rings, &ring);
+	if(!msg)
+	{
+		if(level <= LOG_WARNING)
+		{
+			log_direct(fmt, ap);
+		}
+		else
+		{
+			__sync_add_and_fetch(&dropped, 1);
+		}
+		va_end(ap);
+		return;
+	}
+	msg->len = log_format(msg->text, fmt, ap);
+	va_end(ap);
+	msg->seq = __sync_fetch_and_add(&seq, 1);
+	if(ring_commit(ring) > rings.nslots / 2)
+	{
+		pthread_cond_signal(&wake_cond);
+	}
+}
+
+/* Write any buffered messages out immediately */
+void
+log_flush(void)
+{
+	if(started)
+	{
+		log_drain();
+	}
+}
+
+static void *
+log_run(void *arg)
+{
+	struct timespec ts;
+
+	(void) arg;
+
+	for(;;)
+	{
+		log_drain();
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += LOG_INTERVAL * 1000000L;
+		if(ts.tv_nsec >= 1000000000L)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_mutex_lock(&wake_lock);
+		pthread_cond_timedwait(&wake_cond, &wake_lock, &ts);
+		pthread_mutex_unlock(&wake_lock);
+	}
+	return NULL;
+}
+
+/* Write out the messages in all of the rings, in sequence order */
+static void
+log_drain(void)
+{
+	RING *ring, *next, *first;
+	LOGMSG *msg, *earliest;
+	unsigned long n;
+	size_t len;
+
+	first = ring_drain_begin(&rings);
+	len = 0;
+	for(;;)
+	{
+		earliest = NULL;
+		next = NULL;
+		for(ring = first; ring; ring = ring->next)
+		{
+			msg = (LOGMSG *) ring_peek(&rings, ring);
+			if(msg && (!earliest || (long) (msg->seq - earliest->seq) < 0))
+			{
+				earliest = msg;
+				next = ring;
+			}
+		}
+		if(earliest && len + earliest->len <= LOG_BUFLEN)
+		{
+			memcpy(&(outbuf[len]), earliest->text, earliest->len);
+			len += earliest->len;
+			ring_consume(next);
+			continue;
+		}
+		util_write(2, outbuf, len);
+		len = 0;
+		if(!earliest)
+		{
+			break;
+		}
+	}
+	n = dropped;
+	if(n)
+	{
+		__sync_sub_and_fetch(&dropped, n);
+		fprintf(stderr, "%s: %lu log message(s) dropped because the buffer was full\n", short_program_name, n);
+	}
+	ring_drain_end(&rings);
+}
+
+static void
+log_direct(const char *fmt, va_list ap)
+{
+	char buf[LOG_MSGLEN];
+	size_t len;
+
+	len = log_format(buf, fmt, ap);
+	util_write(2, buf, len);
+}
+
+/* Format a message into a LOG_MSGLEN buffer, prefixed with the program
+ * name and truncated if necessary, returning its length
+ */
+static size_t
+log_format(char *buf, const char *fmt, va_list ap)
+{
+	size_t len;
+	int r;
+
+	len = strlen(short_program_name);
+	if(len > LOG_MSGLEN / 2)
+	{
+		len = LOG_MSGLEN / 2;
+	}
+	memcpy(buf, short_program_name, len);
+	buf[len++] = ':';
+	buf[len++] = ' ';
+	r = vsnprintf(&(buf[len]), LOG_MSGLEN - len, fmt, ap);
+	if(r < 0)
+	{
+		r = 0;
+	}
+	len += r;
+	if(len >= LOG_MSGLEN)
+	{
+		len = LOG_MSGLEN - 1;
+		buf[len - 1] = '\n';
+	}
+	return len;
+}
@@ -35,12 +35,22 @@ const char *short_program_name = "spoold";
  *
  * 3. Submit the job for processing by recipes which operate on the asset's
  *    type.
+ *
+ * By default, jobs are collected in batches of up to spoold:batch, and
+ * each batch is taken through these steps in turn before the next is
+ * collected; identifiers and containers are assigned to the whole batch
+ * at once. If spoold:pipeline is set, each step is instead performed by
+ * its own pool of worker threads (see pipeline.c).
  */
 
+#define SPOOLD_BATCH                    32
+
 int
 main(int argc, char **argv)
 {
-	JOB *job;
+	JOB **jobs;
+	int *status;
+	size_t batch, n, c;
 	int r;
 
 	(void) argc;
@@ -59,42 +69,97 @@ main(int argc, char **argv)
 		fprintf(stderr, "%s: failed to load configuration: %s\n", short_program_name, strerror(errno));
 		exit(EXIT_FAILURE);
 	}
+	r = log_init();
+	if(r < 0)
+	{
+		fprintf(stderr, "%s: failed to initialise logging: %s\n", short_program_name, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
 	r = plugin_load();
 	if(r < 0)
 	{
-		fprintf(stderr, "%s: failed to initialise handlers: %s\n", short_program_name, strerror(errno));
+		LOG(LOG_ERR, "failed to initialise handlers: %s\n", strerror(errno));
 		exit(EXIT_FAILURE);
 	}
-	while(!should_terminate)
+	r = meta_init();
+	if(r < 0)
 	{
-		job = job_collect_wait();
-		if(!job)
+		LOG(LOG_ERR, "failed to initialise metadata handling: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	r = recipe_load();
+	if(r < 0)
+	{
+		LOG(LOG_ERR, "failed to load recipes: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	r = journal_open();
+	if(r < 0)
+	{
+		LOG(LOG_ERR, "failed to open journal: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	r = index_open();
+	if(r < 0)
+	{
+		LOG(LOG_ERR, "failed to open index: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	r = stats_init();
+	if(r < 0)
+	{
+		LOG(LOG_ERR, "failed to initialise statistics: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	r = trace_init();
+	if(r < 0)
+	{
+		LOG(LOG_ERR, "failed to initialise tracing: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if(config_get_int("spoold:pipeline", 0))
+	{
+		r = pipeline_run();
+		if(r < 0)
 		{
-			fprintf(stderr, "%s: unexpected error while waiting for a job: %s\n", short_program_name, strerror(errno));
+			LOG(LOG_ERR, "failed to start processing pipeline: %s\n", strerror(errno));
 			exit(EXIT_FAILURE);
 		}
-		r = meta_locate(job);
+		return 0;
+	}
+	r = config_get_int("spoold:batch", SPOOLD_BATCH);
+	batch = (r < 1 ? 1 : r);
+	jobs = (JOB **) calloc(batch, sizeof(JOB *));
+	status = (int *) calloc(batch, sizeof(int));
+	if(!jobs || !status)
+	{
+		LOG(LOG_ERR, "failed to allocate memory: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	while(!should_terminate)
+	{
+		r = job_collect_batch_wait(jobs, batch);
 		if(r < 0)
 		{
-			fprintf(stderr, "%s: %s: failed to locate metadata for job\n", short_program_name, job->name);
-			job_abort(job);
-			continue;
+			LOG(LOG_ERR, "unexpected error while waiting for a job: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
 		}
-		r = id_assign(job);
-		if(r < 0)
+		n = r;
+		for(c = 0; c < n; c++)
 		{
-			fprintf(stderr, "%s: %s: failed to assign identifier for job\n", short_program_name, job->name);
-			job_abort(job);
-			continue;
+			status[c] = (meta_locate(jobs[c]) < 0 ? -1 : 0);
 		}
-		r = process_job(job);
-		if(r < 0)
+		n = job_abort_failed(jobs, status, n, "locate metadata for job");
+		id_assign_batch(jobs, n, status);
+		n = job_abort_failed(jobs, status, n, "assign identifier for job");
+		process_batch(jobs, n, status);
+		n = job_abort_failed(jobs, status, n, "submit job for processing");
+		for(c = 0; c < n; c++)
 		{
-			fprintf(stderr, "%s: %s: failed to submit job for processing\n", short_program_name, job->name);
-			job_abort(job);
-			continue;
+			job_submitted(jobs[c]);
 		}
-		job_submitted(job);
 	}
+	free(jobs);
+	free(status);
 	return 0;
 }
@@ -20,16 +20,912 @@
 
 #include "p_spool.h"
 
+/* Locate and load the metadata associated with an asset. At present, the
+ * only source of metadata is an XML sidecar, from which a configured set
+ * of fields is extracted:--
+ *
+ *   meta:kind    path to the asset's kind (default '//kind')
+ *   meta:key     path to the asset's key (default '//key')
+ *   meta:fields  any additional fields, as whitespace-separated
+ *                'name=path' pairs
+ *
+ * Paths are a small subset of XPath: a sequence of element names
+ * separated by '/', optionally ending with '@attribute'. A path beginning
+ * with '/' must match from the document element; one beginning with '//'
+ * may match at any depth. An element name of '*' matches any element, and
+ * names without a namespace prefix match elements in any namespace. The
+ * value of an element is its text content, including that of any
+ * descendants; the first match of each path wins.
+ *
+ * Sidecars can be large, so they are never loaded into memory: the parser
+ * makes a single forward pass over the file, META_BUFLEN bytes at a time,
+ * keeping only the names of the currently-open elements and the field
+ * being captured, and stops reading as soon as every field has been found.
+ * It is deliberately lenient: anything it doesn't understand is skipped
+ * rather than treated as an error.
+ *
+ * If meta:required is set, a job whose kind or key can't be found fails.
+ */
+
+#define META_BUFLEN                     65536
+/* Limits on the parser's state; anything beyond them can't be matched */
+#define META_MAXDEPTH                   64
+#define META_MAXNAME                    128
+#define META_MAXVALUE                   4096
+#define META_MAXSTEPS                   16
+#define META_MAXFIELDS                  32
+
+/* Parser states */
+#define S_TEXT                          0
+#define S_LT                            1
+#define S_ENDTAG                        2
+#define S_NAME                          3
+#define S_TAG                           4
+#define S_ATTRNAME                      5
+#define S_ATTREQ                        6
+#define S_ATTRVAL                       7
+#define S_EMPTY                         8
+#define S_BANG                          9
+#define S_COMMENT                       10
+#define S_CDATA                         11
+#define S_DECL                          12
+#define S_PI                            13
+
+struct meta_path
+{
+	/* Field name */
+	const char *name;
+	int absolute;
+	const char *steps[META_MAXSTEPS];
+	size_t nsteps;
+	/* Attribute name, if the path ends with '@attribute' */
+	const char *attr;
+};
+
+/* A value being accumulated */
+struct meta_value
+{
+	/* Index of the field, or -1 */
+	int field;
+	char buf[META_MAXVALUE];
+	size_t len;
+	/* Pending character entity, if any */
+	char ent[12];
+	size_t entlen;
+	int inent;
+};
+
+struct meta_parser
+{
+	JOB *job;
+	int state;
+	/* Open elements; only the first META_MAXDEPTH are recorded */
+	char stack[META_MAXDEPTH][META_MAXNAME];
+	size_t depth;
+	/* Element or attribute name being read */
+	char name[META_MAXNAME];
+	size_t namelen;
+	/* Progress through a terminating sequence ('-->', ']]>', etc.) */
+	size_t match;
+	int quote;
+	/* Text content being captured, and the depth of its element */
+	struct meta_value text;
+	size_t textdepth;
+	/* Attribute value being captured */
+	struct meta_value attr;
+	/* Values found so far, allocated from the job's arena */
+	char *values[META_MAXFIELDS];
+	size_t nfound;
+	char buf[META_BUFLEN];
+};
+
+static struct meta_path paths[META_MAXFIELDS];
+static size_t npaths;
+static int required;
+
+/* Internal utilities */
+static int meta_addpath(const char *key, const char *name, const char *path);
+static int meta_load(JOB *job);
+static int meta_parse(JOB *job, const char *path, struct meta_parser *p);
+static int meta_feed(struct meta_parser *p, const char *buf, size_t len);
+static void meta_push(struct meta_parser *p);
+static void meta_pop(struct meta_parser *p);
+static int meta_attr(struct meta_parser *p);
+static int meta_match(struct meta_parser *p, const struct meta_path *path);
+static int meta_step(const char *step, const char *name);
+static void meta_append(struct meta_value *v, int c);
+static void meta_appendbyte(struct meta_value *v, int c);
+static void meta_appendchar(struct meta_value *v, unsigned long c);
+static void meta_finish(struct meta_parser *p, struct meta_value *v);
+
+/* Compile the configured paths */
+int
+meta_init(void)
+{
+	const char *s, *t;
+	char *buf, *name, *path;
+
+	if(meta_addpath("meta:kind", "kind", config_get("meta:kind", "//kind")) < 0 ||
+	   meta_addpath("meta:key", "key", config_get("meta:key", "//key")) < 0)
+	{
+		return -1;
+	}
+	required = config_get_int("meta:required", 0);
+	s = config_get("meta:fields", "");
+	for(;;)
+	{
+		while(isspace((unsigned char) *s))
+		{
+			s++;
+		}
+		if(!*s)
+		{
+			break;
+		}
+		t = s;
+		while(*t && !isspace((unsigned char) *t))
+		{
+			t++;
+		}
+		buf = (char *) malloc(t - s + 1);
+		if(!buf)
+		{
+			return -1;
+		}
+		memcpy(buf, s, t - s);
+		buf[t - s] = 0;
+		name = buf;
+		path = strchr(buf, '=');
+		if(!path || path == buf)
+		{
+			LOG(LOG_ERR, "meta:fields: expected 'name=path', found '%s'\n", buf);
+			free(buf);
+			errno = EINVAL;
+			return -1;
+		}
+		*path = 0;
+		path++;
+		if(meta_addpath("meta:fields", name, path) < 0)
+		{
+			free(buf);
+			return -1;
+		}
+		/* buf is retained, as the path points into it */
+		s = t;
+	}
+	return 0;
+}
+
 /* Attempt to locate and load the metadata associated with an asset */
 int
 meta_locate(JOB *job)
 {
-	/* For the moment, this always succeeds. In future, it will be
-	 * plugin-driven so that metadata can be somewhat intelligently
-	 * located and handled.
-	 */
+	unsigned long long start;
+	int r;
+
+	start = stats_clock();
+	r = meta_load(job);
+	TRACE("meta_locate", job->name, 0, start, 0);
+	return r;
+}
+
+static int
+meta_load(JOB *job)
+{
+	struct meta_parser *p;
+	size_t c;
+	int r;
+
+	if(job->sidecar)
+	{
+		p = (struct meta_parser *) malloc(sizeof(struct meta_parser));
+		if(!p)
+		{
+			return -1;
+		}
+		r = meta_parse(job, ASSET_PATH(job->sidecar), p);
+		free(p);
+		if(r < 0)
+		{
+			LOG(LOG_ERR, "%s: failed to read sidecar '%s': %s\n", job->name, ASSET_PATH(job->sidecar), strerror(errno));
+			return -1;
+		}
+		for(c = 0; c < job->nmeta; c++)
+		{
+			if(job->meta[c].value)
+			{
+				LOG(LOG_DEBUG, "%s: %s is '%s'\n", job->name, job->meta[c].name, job->meta[c].value);
+			}
+		}
+	}
+	if(required && (!job->kind || !job->key))
+	{
+		LOG(LOG_ERR, "%s: metadata does not include both a kind and a key\n", job->name);
+		return -1;
+	}
+	return 0;
+}
+
+/* Compile a path (from the configuration key given) and add it to the list
+ * of fields to be extracted; empty steps, as in "a//b" or "a/", are rejected
+ * rather than being taken to end the path
+ */
+static int
+meta_addpath(const char *key, const char *name, const char *path)
+{
+	struct meta_path *m;
+	char *buf, *s, *t;
+	int ok;
+
+	if(npaths == META_MAXFIELDS)
+	{
+		LOG(LOG_ERR, "%s: no more than %d fields may be extracted\n", key, META_MAXFIELDS);
+		errno = EINVAL;
+		return -1;
+	}
+	m = &(paths[npaths]);
+	memset(m, 0, sizeof(struct meta_path));
+	m->name = name;
+	buf = strdup(path);
+	if(!buf)
+	{
+		return -1;
+	}
+	s = buf;
+	if(s[0] == '/' && s[1] == '/')
+	{
+		s += 2;
+	}
+	else if(s[0] == '/')
+	{
+		m->absolute = 1;
+		s++;
+	}
+	ok = 0;
+	while(*s)
+	{
+		t = strchr(s, '/');
+		if(t)
+		{
+			*t = 0;
+		}
+		if(*s == '@')
+		{
+			if(t || !s[1])
+			{
+				break;
+			}
+			m->attr = s + 1;
+			s = strchr(s, 0);
+			ok = 1;
+			continue;
+		}
+		if(!*s || m->nsteps == META_MAXSTEPS)
+		{
+			break;
+		}
+		m->steps[m->nsteps] = s;
+		m->nsteps++;
+		if(!t)
+		{
+			s = strchr(s, 0);
+			ok = 1;
+			break;
+		}
+		s = t + 1;
+	}
+	if(!ok || *s || !m->nsteps)
+	{
+		LOG(LOG_ERR, "%s: invalid path '%s' for field '%s'\n", key, path, name);
+		free(buf);
+		errno = EINVAL;
+		return -1;
+	}
+	npaths++;
+	return 0;
+}
+
+/* Parse a sidecar, attaching any fields found to the job */
+static int
+meta_parse(JOB *job, const char *path, struct meta_parser *p)
+{
+	ssize_t r;
+	size_t c;
+	int fd;
 
-	(void) job;
+	p->job = job;
+	p->state = S_TEXT;
+	p->depth = 0;
+	p->text.field = -1;
+	p->attr.field = -1;
+	p->nfound = 0;
+	for(c = 0; c < npaths; c++)
+	{
+		p->values[c] = NULL;
+	}
+	do
+	{
+		fd = open(path, O_RDONLY);
+	}
+	while(fd == -1 && errno == EINTR);
+	if(fd == -1)
+	{
+		return -1;
+	}
+	for(;;)
+	{
+		r = read(fd, p->buf, sizeof(p->buf));
+		if(r == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if(r <= 0 || meta_feed(p, p->buf, r))
+		{
+			break;
+		}
+	}
+	close(fd);
+	if(r < 0)
+	{
+		return -1;
+	}
+	job->meta = (META_FIELD *) arena_calloc(job->arena, npaths * sizeof(META_FIELD));
+	if(!job->meta)
+	{
+		return -1;
+	}
+	for(c = 0; c < npaths; c++)
+	{
+		job->meta[c].name = paths[c].name;
+		job->meta[c].value = p->values[c];
+	}
+	job->nmeta = npaths;
+	/* The first two fields are always the kind and the key */
+	job->kind = job->meta[0].value;
+	job->key = job->meta[1].value;
+	return 0;
+}
+
+/* Feed a chunk of a document to the parser; returns 1 once every field
+ * has been found
+ */
+static int
+meta_feed(struct meta_parser *p, const char *buf, size_t len)
+{
+	size_t c, n;
+	int ch;
 
+	for(c = 0; c < len; c++)
+	{
+		ch = (unsigned char) buf[c];
+		switch(p->state)
+		{
+		case S_TEXT:
+			if(ch == '<')
+			{
+				p->state = S_LT;
+			}
+			else if(p->text.field != -1)
+			{
+				meta_append(&(p->text), ch);
+			}
+			break;
+		case S_LT:
+			p->namelen = 0;
+			p->match = 0;
+			if(ch == '/')
+			{
+				p->state = S_ENDTAG;
+			}
+			else if(ch == '?')
+			{
+				p->state = S_PI;
+			}
+			else if(ch == '!')
+			{
+				p->state = S_BANG;
+			}
+			else
+			{
+				p->name[p->namelen++] = ch;
+				p->state = S_NAME;
+			}
+			break;
+		case S_NAME:
+			if(isspace(ch) || ch == '>' || ch == '/')
+			{
+				meta_push(p);
+				p->state = (ch == '>' ? S_TEXT : (ch == '/' ? S_EMPTY : S_TAG));
+			}
+			else if(p->namelen < META_MAXNAME - 1)
+			{
+				p->name[p->namelen++] = ch;
+			}
+			else
+			{
+				/* Too long to be matched */
+				p->name[0] = 0;
+			}
+			break;
+		case S_TAG:
+			if(ch == '>')
+			{
+				p->state = S_TEXT;
+			}
+			else if(ch == '/')
+			{
+				p->state = S_EMPTY;
+			}
+			else if(!isspace(ch))
+			{
+				p->namelen = 0;
+				p->name[p->namelen++] = ch;
+				p->state = S_ATTRNAME;
+			}
+			break;
+		case S_ATTRNAME:
+			if(ch == '=')
+			{
+				p->attr.field = meta_attr(p);
+				p->quote = 0;
+				p->state = S_ATTRVAL;
+			}
+			else if(isspace(ch))
+			{
+				p->state = S_ATTREQ;
+			}
+			else if(ch == '>' || ch == '/')
+			{
+				/* An attribute without a value */
+				p->state = (ch == '>' ? S_TEXT : S_EMPTY);
+			}
+			else if(p->namelen < META_MAXNAME - 1)
+			{
+				p->name[p->namelen++] = ch;
+			}
+			break;
+		case S_ATTREQ:
+			if(ch == '=')
+			{
+				p->attr.field = meta_attr(p);
+				p->quote = 0;
+				p->state = S_ATTRVAL;
+			}
+			else if(!isspace(ch))
+			{
+				p->state = S_TAG;
+				c--;
+			}
+			break;
+		case S_ATTRVAL:
+			if(!p->quote)
+			{
+				if(ch == '"' || ch == '\'')
+				{
+					p->quote = ch;
+				}
+				else if(!isspace(ch))
+				{
+					/* An unquoted value */
+					p->quote = ' ';
+					c--;
+				}
+				break;
+			}
+			if(ch == p->quote || (p->quote == ' ' && (isspace(ch) || ch == '>')))
+			{
+				meta_finish(p, &(p->attr));
+				p->state = S_TAG;
+				if(ch == '>')
+				{
+					c--;
+				}
+			}
+			else if(p->attr.field != -1)
+			{
+				meta_append(&(p->attr), ch);
+			}
+			break;
+		case S_EMPTY:
+			if(ch == '>')
+			{
+				meta_pop(p);
+				p->state = S_TEXT;
+			}
+			else
+			{
+				p->state = S_TAG;
+				c--;
+			}
+			break;
+		case S_ENDTAG:
+			if(ch == '>')
+			{
+				meta_pop(p);
+				p->state = S_TEXT;
+			}
+			break;
+		case S_BANG:
+			/* Distinguish '<!--' and '<![CDATA[' from declarations */
+			p->name[p->namelen++] = ch;
+			if(p->namelen == 2 && !memcmp(p->name, "--", 2))
+			{
+				p->state = S_COMMENT;
+			}
+			else if(p->namelen == 7 && !memcmp(p->name, "[CDATA[", 7))
+			{
+				p->state = S_CDATA;
+			}
+			else if(memcmp(p->name, "--", (p->namelen < 2 ? p->namelen : 2)) &&
+					memcmp(p->name, "[CDATA[", p->namelen))
+			{
+				p->state = S_DECL;
+				p->match = 0;
+				c--;
+			}
+			break;
+		case S_COMMENT:
+			if(ch == '>' && p->match >= 2)
+			{
+				p->state = S_TEXT;
+			}
+			p->match = (ch == '-' ? p->match + 1 : 0);
+			break;
+		case S_CDATA:
+			if(ch == ']')
+			{
+				p->match++;
+				break;
+			}
+			if(ch == '>' && p->match >= 2)
+			{
+				p->match -= 2;
+				p->state = S_TEXT;
+			}
+			if(p->text.field != -1)
+			{
+				for(n = 0; n < p->match; n++)
+				{
+					meta_appendbyte(&(p->text), ']');
+				}
+				if(p->state == S_CDATA)
+				{
+					meta_appendbyte(&(p->text), ch);
+				}
+			}
+			p->match = 0;
+			break;
+		case S_DECL:
+			/* Skip a declaration, including any internal subset */
+			if(ch == '[')
+			{
+				p->match++;
+			}
+			else if(ch == ']' && p->match)
+			{
+				p->match--;
+			}
+			else if(ch == '>' && !p->match)
+			{
+				p->state = S_TEXT;
+			}
+			break;
+		case S_PI:
+			if(ch == '>' && p->match)
+			{
+				p->state = S_TEXT;
+			}
+			p->match = (ch == '?');
+			break;
+		}
+		if(p->nfound == npaths)
+		{
+			return 1;
+		}
+	}
 	return 0;
 }
+
+/* An element has begun */
+static void
+meta_push(struct meta_parser *p)
+{
+	size_t c;
+
+	if(p->depth < META_MAXDEPTH)
+	{
+		memcpy(p->stack[p->depth], p->name, p->namelen);
+		p->stack[p->depth][p->namelen] = 0;
+	}
+	p->depth++;
+	if(p->text.field != -1)
+	{
+		/* Already capturing the content of an ancestor */
+		return;
+	}
+	for(c = 0; c < npaths; c++)
+	{
+		if(!p->values[c] && !paths[c].attr && meta_match(p, &(paths[c])))
+		{
+			p->text.field = c;
+			p->text.len = 0;
+			p->text.inent = 0;
+			p->textdepth = p->depth;
+			break;
+		}
+	}
+}
+
+/* An element has ended */
+static void
+meta_pop(struct meta_parser *p)
+{
+	if(!p->depth)
+	{
+		return;
+	}
+	if(p->text.field != -1 && p->depth == p->textdepth)
+	{
+		meta_finish(p, &(p->text));
+	}
+	p->depth--;
+}
+
+/* An attribute of the current element has been named; return the index
+ * of the field it provides, if any, or -1
+ */
+static int
+meta_attr(struct meta_parser *p)
+{
+	size_t c;
+
+	p->name[p->namelen] = 0;
+	p->attr.len = 0;
+	p->attr.inent = 0;
+	for(c = 0; c < npaths; c++)
+	{
+		if(!p->values[c] && paths[c].attr && meta_step(paths[c].attr, p->name) &&
+		   meta_match(p, &(paths[c])))
+		{
+			return c;
+		}
+	}
+	return -1;
+}
+
+/* Determine whether the currently-open elements match a path */
+static int
+meta_match(struct meta_parser *p, const struct meta_path *path)
+{
+	size_t c, base;
+
+	if(p->depth > META_MAXDEPTH || p->depth < path->nsteps ||
+	   (path->absolute && p->depth != path->nsteps))
+	{
+		return 0;
+	}
+	base = p->depth - path->nsteps;
+	for(c = 0; c < path->nsteps; c++)
+	{
+		if(!meta_step(path->steps[c], p->stack[base + c]))
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Determine whether an element or attribute name matches a step of a
+ * path; a step without a namespace prefix matches the local part of the
+ * name
+ */
+static int
+meta_step(const char *step, const char *name)
+{
+	const char *t;
+
+	if(!name[0])
+	{
+		return 0;
+	}
+	if(!strcmp(step, "*"))
+	{
+		return 1;
+	}
+	if(!strchr(step, ':') && (t = strchr(name, ':')))
+	{
+		name = t + 1;
+	}
+	return !strcmp(step, name);
+}
+
+/* Append a character of a value, decoding character and entity
+ * references as they are completed
+ */
+static void
+meta_append(struct meta_value *v, int c)
+{
+	static const struct { const char *name; int c; } entities[] = {
+		{ "lt", '<' }, { "gt", '>' }, { "amp", '&' }, { "quot", '"' }, { "apos", '\'' },
+		{ NULL, 0 }
+	};
+	unsigned long n;
+	size_t i;
+	char *end;
+
+	if(!v->inent)
+	{
+		if(c == '&')
+		{
+			v->inent = 1;
+			v->entlen = 0;
+		}
+		else
+		{
+			meta_appendbyte(v, c);
+		}
+		return;
+	}
+	if(c != ';')
+	{
+		if(v->entlen < sizeof(v->ent) - 1)
+		{
+			v->ent[v->entlen++] = c;
+			return;
+		}
+		/* Not a reference after all; pass it through */
+		v->inent = 0;
+		meta_appendbyte(v, '&');
+		for(i = 0; i < v->entlen; i++)
+		{
+			meta_appendbyte(v, (unsigned char) v->ent[i]);
+		}
+		meta_append(v, c);
+		return;
+	}
+	v->inent = 0;
+	v->ent[v->entlen] = 0;
+	if(v->ent[0] == '#')
+	{
+		errno = 0;
+		if(v->ent[1] == 'x' || v->ent[1] == 'X')
+		{
+			n = strtoul(&(v->ent[2]), &end, 16);
+		}
+		else
+		{
+			n = strtoul(&(v->ent[1]), &end, 10);
+		}
+		if(!*end && end != &(v->ent[1]) && !errno)
+		{
+			meta_appendchar(v, n);
+			return;
+		}
+	}
+	else
+	{
+		for(i = 0; entities[i].name; i++)
+		{
+			if(!strcmp(entities[i].name, v->ent))
+			{
+				meta_appendchar(v, entities[i].c);
+				return;
+			}
+		}
+	}
+	meta_appendbyte(v, '&');
+	for(i = 0; i < v->entlen; i++)
+	{
+		meta_appendbyte(v, (unsigned char) v->ent[i]);
+	}
+	meta_appendbyte(v, ';');
+}
+
+/* Append a byte of the document to a value as-is (the document is taken
+ * to be UTF-8 already); anything beyond META_MAXVALUE is discarded
+ */
+static void
+meta_appendbyte(struct meta_value *v, int c)
+{
+	if(v->len + 1 < sizeof(v->buf))
+	{
+		v->buf[v->len++] = c;
+	}
+}
+
+/* Append a character given by a reference to a value, encoded as UTF-8;
+ * anything beyond META_MAXVALUE is discarded
+ */
+static void
+meta_appendchar(struct meta_value *v, unsigned long c)
+{
+	unsigned char u[4];
+	size_t n, i;
+
+	if(c < 0x80 || c > 0x10ffff)
+	{
+		u[0] = (c < 0x80 ? c : '?');
+		n = 1;
+	}
+	else if(c < 0x800)
+	{
+		u[0] = 0xc0 | (c >> 6);
+		u[1] = 0x80 | (c & 0x3f);
+		n = 2;
+	}
+	else if(c < 0x10000)
+	{
+		u[0] = 0xe0 | (c >> 12);
+		u[1] = 0x80 | ((c >> 6) & 0x3f);
+		u[2] = 0x80 | (c & 0x3f);
+		n = 3;
+	}
+	else
+	{
+		u[0] = 0xf0 | (c >> 18);
+		u[1] = 0x80 | ((c >> 12) & 0x3f);
+		u[2] = 0x80 | ((c >> 6) & 0x3f);
+		u[3] = 0x80 | (c & 0x3f);
+		n = 4;
+	}
+	if(v->len + n >= sizeof(v->buf))
+	{
+		return;
+	}
+	for(i = 0; i < n; i++)
+	{
+		v->buf[v->len++] = u[i];
+	}
+}
+
+/* A value is complete; record it, with leading and trailing whitespace
+ * removed
+ */
+static void
+meta_finish(struct meta_parser *p, struct meta_value *v)
+{
+	size_t start, end, i, n;
+	char *value;
+
+	if(v->field == -1)
+	{
+		return;
+	}
+	end = v->len;
+	if(v->len + 1 == sizeof(v->buf))
+	{
+		/* The value may have been truncated part of the way through a
+		 * multi-byte sequence, which mustn't be kept
+		 */
+		for(i = end; i > 0 && ((unsigned char) v->buf[i - 1] & 0xc0) == 0x80; i--);
+		if(i > 0 && (unsigned char) v->buf[i - 1] >= 0xc0)
+		{
+			n = ((unsigned char) v->buf[i - 1] >= 0xf0 ? 4 : ((unsigned char) v->buf[i - 1] >= 0xe0 ? 3 : 2));
+			if(end - (i - 1) < n)
+			{
+				end = i - 1;
+			}
+		}
+	}
+	start = 0;
+	while(start < end && isspace((unsigned char) v->buf[start]))
+	{
+		start++;
+	}
+	while(end > start && isspace((unsigned char) v->buf[end - 1]))
+	{
+		end--;
+	}
+	if(!p->values[v->field])
+	{
+		value = (char *) arena_alloc(p->job->arena, end - start + 1);
+		if(value)
+		{
+			memcpy(value, &(v->buf[start]), end - start);
+			value[end - start] = 0;
+			p->values[v->field] = value;
+			p->nfound++;
+		}
+	}
+	v->field = -1;
+}
@@ -0,0 +1,651 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_spool.h"
+#include "identify/mimedb.h"
+
+#include <time.h>
+
+/* spool-microbench times the steps spoold performs for every file it
+ * sees, in isolation: identification by extension and of sidecars,
+ * setting asset paths, formatting identifiers and creating storage
+ * containers. The ext_identify/linear_* benchmarks time a linear scan of
+ * the built-in extension table, as the ext identifier used to do, for
+ * comparison with the hash table it uses now.
+ *
+ * Usage: spool-microbench [OPTIONS] [FILTER...]
+ *
+ *   -t SECONDS    minimum time to run each benchmark for (default 0.5)
+ *   -r COUNT      number of times to run each benchmark; the median is
+ *                 reported (default 3)
+ *   -d DIR        directory to create containers within, ideally on a
+ *                 tmpfs (default /dev/shm, or /tmp if that doesn't exist)
+ *   -j FILE       write the results to FILE as JSON ('-' for stdout, in
+ *                 which case the table of results is written to stderr)
+ *   -b FILE       compare the results with a baseline written by -j
+ *   -x PERCENT    with -b, exit with a non-zero status if any benchmark
+ *                 is slower than its baseline by more than PERCENT
+ *
+ * Only the benchmarks whose names contain one of the FILTERs (if any are
+ * given) are run.
+ *
+ * As with Google Benchmark, each benchmark's loop is first run once, and
+ * then with an increasing number of iterations, until it takes at least
+ * the minimum time; the time per iteration is reported.
+ */
+
+#define MICRO_MAXREPS                   31
+#define MICRO_LINELEN                   512
+
+struct microbench
+{
+	const char *name;
+	/* Run the benchmark's loop for n iterations */
+	void (*run)(unsigned long n);
+	/* Median time per iteration, in nanoseconds, and the number of
+	 * iterations it was measured over
+	 */
+	double ns;
+	unsigned long iterations;
+	/* From the baseline, if any; zero if not present there */
+	double baseline;
+};
+
+/* Internal utilities */
+static void usage(void);
+static int setup(const char *dir);
+static void measure(struct microbench *b);
+static int selected(const char *name, char **filters, int nfilters);
+static int write_json(const char *path);
+static int read_baseline(const char *path);
+static int compare_ns(const void *a, const void *b);
+static void bench_ext_hit(unsigned long n);
+static void bench_ext_miss(unsigned long n);
+static void bench_ext_multi(unsigned long n);
+static void bench_ext_long(unsigned long n);
+static void bench_ext_linear_hit(unsigned long n);
+static void bench_ext_linear_miss(unsigned long n);
+static void bench_sidecar(unsigned long n);
+static void bench_path_short(unsigned long n);
+static void bench_path_long(unsigned long n);
+static void bench_path_basedir(unsigned long n);
+static void bench_id_create(unsigned long n);
+static void bench_create_container(unsigned long n);
+static void identify_loop(IDENTIFY *me, const char *path, unsigned long n);
+static void linear_loop(const char *path, unsigned long n);
+static void path_loop(const char *path, unsigned long n);
+static void next_uuid(uuid_t uu);
+
+const char *short_program_name = "spool-microbench";
+
+static struct microbench benches[] = {
+	{ "ext_identify/hit", bench_ext_hit, 0, 0, 0 },
+	{ "ext_identify/miss", bench_ext_miss, 0, 0, 0 },
+	{ "ext_identify/multipart", bench_ext_multi, 0, 0, 0 },
+	{ "ext_identify/long", bench_ext_long, 0, 0, 0 },
+	{ "ext_identify/linear_hit", bench_ext_linear_hit, 0, 0, 0 },
+	{ "ext_identify/linear_miss", bench_ext_linear_miss, 0, 0, 0 },
+	{ "sidecar_identify", bench_sidecar, 0, 0, 0 },
+	{ "asset_set_path/short", bench_path_short, 0, 0, 0 },
+	{ "asset_set_path/long", bench_path_long, 0, 0, 0 },
+	{ "asset_set_path_basedir", bench_path_basedir, 0, 0, 0 },
+	{ "id_create_uuid", bench_id_create, 0, 0, 0 },
+	{ "fs_create_container", bench_create_container, 0, 0, 0 },
+	{ NULL, NULL, 0, 0, 0 }
+};
+
+static double mintime = 0.5;
+static int reps = 3;
+static IDENTIFY *ext, *sidecar;
+static STORAGE *storage;
+static ASSET *asset;
+static const MIMETYPE *xmltype;
+static unsigned long long counter = 1;
+/* Results are accumulated here so that the loops can't be optimised away */
+static volatile unsigned long sink;
+
+int
+main(int argc, char **argv)
+{
+	const char *base, *json, *baseline;
+	struct stat sbuf;
+	FILE *out;
+	double threshold, change;
+	char *tmpdir, *dir;
+	int c, regressed;
+
+	base = NULL;
+	json = NULL;
+	baseline = NULL;
+	threshold = -1;
+	while((c = getopt(argc, argv, "t:r:d:j:b:x:h")) != -1)
+	{
+		switch(c)
+		{
+		case 't':
+			mintime = atof(optarg);
+			break;
+		case 'r':
+			reps = atoi(optarg);
+			break;
+		case 'd':
+			base = optarg;
+			break;
+		case 'j':
+			json = optarg;
+			break;
+		case 'b':
+			baseline = optarg;
+			break;
+		case 'x':
+			threshold = atof(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if(mintime <= 0 || reps < 1 || reps > MICRO_MAXREPS)
+	{
+		usage();
+	}
+	if(!base)
+	{
+		base = (!stat("/dev/shm", &sbuf) && S_ISDIR(sbuf.st_mode) ? "/dev/shm" : "/tmp");
+	}
+	tmpdir = (char *) malloc(strlen(base) + 32);
+	if(!tmpdir)
+	{
+		fprintf(stderr, "%s: failed to allocate memory: %s\n", short_program_name, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	sprintf(tmpdir, "%s/spool-microbench.XXXXXX", base);
+	dir = mkdtemp(tmpdir);
+	if(!dir)
+	{
+		fprintf(stderr, "%s: failed to create work directory in %s: %s\n", short_program_name, base, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if(setup(dir) < 0)
+	{
+		fprintf(stderr, "%s: failed to initialise: %s\n", short_program_name, strerror(errno));
+		util_remove_tree(dir);
+		exit(EXIT_FAILURE);
+	}
+	if(baseline && read_baseline(baseline) < 0)
+	{
+		fprintf(stderr, "%s: %s: %s\n", short_program_name, baseline, strerror(errno));
+		util_remove_tree(dir);
+		exit(EXIT_FAILURE);
+	}
+	regressed = 0;
+	out = (json && !strcmp(json, "-") ? stderr : stdout);
+	fprintf(out, "%-28s %14s %12s", "benchmark", "time/op", "iterations");
+	if(baseline)
+	{
+		fprintf(out, " %14s %9s", "baseline", "change");
+	}
+	fprintf(out, "\n");
+	for(c = 0; benches[c].name; c++)
+	{
+		if(!selected(benches[c].name, &(argv[optind]), argc - optind))
+		{
+			continue;
+		}
+		measure(&(benches[c]));
+		fprintf(out, "%-28s %11.1f ns %12lu", benches[c].name, benches[c].ns, benches[c].iterations);
+		if(baseline && benches[c].baseline > 0)
+		{
+			change = 100.0 * (benches[c].ns - benches[c].baseline) / benches[c].baseline;
+			fprintf(out, " %11.1f ns %+8.1f%%", benches[c].baseline, change);
+			if(threshold >= 0 && change > threshold)
+			{
+				fprintf(out, "  REGRESSED");
+				regressed = 1;
+			}
+		}
+		fprintf(out, "\n");
+		fflush(out);
+	}
+	if(util_remove_tree(dir))
+	{
+		fprintf(stderr, "%s: failed to remove %s: %s\n", short_program_name, dir, strerror(errno));
+	}
+	free(tmpdir);
+	if(json && write_json(json) < 0)
+	{
+		fprintf(stderr, "%s: %s: %s\n", short_program_name, json, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	return (regressed ? 1 : 0);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: %s [-t SECONDS] [-r COUNT] [-d DIR] [-j FILE] [-b FILE] [-x PERCENT] [FILTER...]\n", short_program_name);
+	exit(EXIT_FAILURE);
+}
+
+/* Create the handlers and the asset the benchmarks operate on */
+static int
+setup(const char *dir)
+{
+	char *store;
+
+	store = (char *) malloc(strlen(dir) + 7);
+	if(!store || config_init() < 0)
+	{
+		free(store);
+		return -1;
+	}
+	sprintf(store, "%s/store", dir);
+	if(mkdir(store, 0777))
+	{
+		free(store);
+		return -1;
+	}
+	config_set("fs:store", store);
+	config_set("log:level", "warning");
+	free(store);
+	if(log_init() < 0)
+	{
+		return -1;
+	}
+	ext = ext_create();
+	sidecar = sidecar_create();
+	storage = fs_create();
+	asset = asset_create();
+	if(!ext || !sidecar || !storage || !asset)
+	{
+		return -1;
+	}
+	xmltype = type_find("application/xml");
+	if(!xmltype)
+	{
+		errno = ENOENT;
+		return -1;
+	}
+	return 0;
+}
+
+/* Time a benchmark, in the manner of Google Benchmark: the number of
+ * iterations is increased until a run takes at least mintime, and that
+ * is repeated reps times
+ */
+static void
+measure(struct microbench *b)
+{
+	double times[MICRO_MAXREPS], elapsed, scale;
+	unsigned long long start;
+	unsigned long n, next;
+	int c;
+
+	for(c = 0; c < reps; c++)
+	{
+		n = 1;
+		for(;;)
+		{
+			start = stats_clock();
+			b->run(n);
+			elapsed = (stats_clock() - start) / 1e9;
+			if(elapsed >= mintime)
+			{
+				break;
+			}
+			/* Aim a little beyond the minimum, but grow by at most ten
+			 * times, as a single fast run is a poor predictor
+			 */
+			scale = (elapsed > 0 ? (mintime * 1.4) / elapsed : 10);
+			if(scale > 10)
+			{
+				scale = 10;
+			}
+			next = (unsigned long) (n * scale);
+			n = (next > n ? next : n + 1);
+		}
+		times[c] = (elapsed * 1e9) / n;
+		b->iterations = n;
+	}
+	qsort(times, reps, sizeof(double), compare_ns);
+	b->ns = times[reps / 2];
+}
+
+static int
+selected(const char *name, char **filters, int nfilters)
+{
+	int c;
+
+	if(!nfilters)
+	{
+		return 1;
+	}
+	for(c = 0; c < nfilters; c++)
+	{
+		if(strstr(name, filters[c]))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Write the results in the same shape as Google Benchmark's JSON output,
+ * one benchmark per line
+ */
+static int
+write_json(const char *path)
+{
+	FILE *f;
+	char date[64];
+	time_t now;
+	int c, first;
+
+	f = (strcmp(path, "-") ? fopen(path, "w") : stdout);
+	if(!f)
+	{
+		return -1;
+	}
+	now = time(NULL);
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+	fprintf(f, "{\n  \"context\": {\"date\": \"%s\", \"min_time\": %g, \"repetitions\": %d},\n  \"benchmarks\": [\n", date, mintime, reps);
+	first = 1;
+	for(c = 0; benches[c].name; c++)
+	{
+		if(!benches[c].iterations)
+		{
+			continue;
+		}
+		fprintf(f, "%s    {\"name\": \"%s\", \"iterations\": %lu, \"real_time\": %.3f, \"time_unit\": \"ns\"}",
+				(first ? "" : ",\n"), benches[c].name, benches[c].iterations, benches[c].ns);
+		first = 0;
+	}
+	fprintf(f, "\n  ]\n}\n");
+	if(f == stdout)
+	{
+		return (fflush(f) ? -1 : 0);
+	}
+	return (fclose(f) ? -1 : 0);
+}
+
+/* Read the times from a file written by write_json(); this relies on each
+ * benchmark being on a line of its own
+ */
+static int
+read_baseline(const char *path)
+{
+	FILE *f;
+	char line[MICRO_LINELEN], *name, *end, *t;
+	int c;
+
+	f = fopen(path, "r");
+	if(!f)
+	{
+		return -1;
+	}
+	while(fgets(line, sizeof(line), f))
+	{
+		name = strstr(line, "\"name\": \"");
+		t = strstr(line, "\"real_time\": ");
+		if(!name || !t)
+		{
+			continue;
+		}
+		name += 9;
+		end = strchr(name, '"');
+		if(!end)
+		{
+			continue;
+		}
+		*end = 0;
+		for(c = 0; benches[c].name; c++)
+		{
+			if(!strcmp(benches[c].name, name))
+			{
+				benches[c].baseline = strtod(t + 13, NULL);
+				break;
+			}
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+static int
+compare_ns(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+/* A common extension */
+static void
+bench_ext_hit(unsigned long n)
+{
+	identify_loop(ext, "incoming/asset000001.jpg", n);
+}
+
+/* An extension which isn't in mime.types */
+static void
+bench_ext_miss(unsigned long n)
+{
+	identify_loop(ext, "incoming/asset000001.unknownext", n);
+}
+
+/* Several '.'s, each of which is tried in turn */
+static void
+bench_ext_multi(unsigned long n)
+{
+	identify_loop(ext, "incoming/backup.2013.06.01.tar.gz", n);
+}
+
+/* An extension longer than any which will be looked up */
+static void
+bench_ext_long(unsigned long n)
+{
+	identify_loop(ext, "incoming/asset000001.thisisanextensionwhichismuchlongerthananyinmimetypesandisnotlookedup", n);
+}
+
+/* As ext_identify/hit, but scanning the table; how far the scan goes
+ * depends on where the extension falls in the table
+ */
+static void
+bench_ext_linear_hit(unsigned long n)
+{
+	linear_loop("incoming/asset000001.jpg", n);
+}
+
+/* As ext_identify/miss, but scanning the whole of the table */
+static void
+bench_ext_linear_miss(unsigned long n)
+{
+	linear_loop("incoming/asset000001.unknownext", n);
+}
+
+/* A typed asset which is a sidecar */
+static void
+bench_sidecar(unsigned long n)
+{
+	unsigned long c;
+
+	asset_set_path(asset, "incoming/asset000001.xml");
+	for(c = 0; c < n; c++)
+	{
+		asset->type = xmltype;
+		asset->sidecar = 0;
+		sink += sidecar->api->identify(sidecar, asset);
+	}
+}
+
+/* A path which fits within the asset */
+static void
+bench_path_short(unsigned long n)
+{
+	path_loop("/var/spool/incoming/asset000001.jpg", n);
+}
+
+/* A path which doesn't */
+static void
+bench_path_long(unsigned long n)
+{
+	path_loop("/var/spool/incoming/a-rather-deeply/nested/directory/structure/of-the-sort/which-watch-folders/sometimes/acquire/"
+			  "over-the-years/asset000001-with-a-long-descriptive-name.jpg", n);
+}
+
+/* Joining a directory and a name, as the 'file' source does */
+static void
+bench_path_basedir(unsigned long n)
+{
+	unsigned long c;
+
+	for(c = 0; c < n; c++)
+	{
+		asset_set_path_basedir(asset, "/var/spool/incoming", 19, "asset000001.jpg");
+		sink += asset->ext;
+	}
+}
+
+/* Formatting an identifier; identifiers are allocated from an arena, as
+ * they are for a job, which is released every so often
+ */
+static void
+bench_id_create(unsigned long n)
+{
+	ARENA *arena;
+	JOBID *id;
+	uuid_t uu;
+	unsigned long c;
+
+	next_uuid(uu);
+	arena = arena_create();
+	for(c = 0; arena && c < n; c++)
+	{
+		if(c && !(c % 64))
+		{
+			arena_release(arena);
+			arena = arena_create();
+		}
+		uu[15] = (unsigned char) c;
+		id = id_create_uuid(arena, uu);
+		sink += (id ? id->canonical[31] : 0);
+	}
+	arena_release(arena);
+}
+
+/* Creating a container for a new job, including creating the job and its
+ * identifier, with the default fs:width and fs:depth
+ */
+static void
+bench_create_container(unsigned long n)
+{
+	JOB *job;
+	ASSET *container;
+	uuid_t uu;
+	unsigned long c;
+
+	for(c = 0; c < n; c++)
+	{
+		job = job_create("bench", NULL);
+		if(!job)
+		{
+			break;
+		}
+		next_uuid(uu);
+		job->id = id_create_uuid(job->arena, uu);
+		container = (job->id ? storage->api->create_container(storage, job) : NULL);
+		sink += (container ? container->len : 0);
+		job_free(job);
+	}
+}
+
+static void
+identify_loop(IDENTIFY *me, const char *path, unsigned long n)
+{
+	unsigned long c;
+
+	asset_set_path(asset, path);
+	for(c = 0; c < n; c++)
+	{
+		asset->type = NULL;
+		sink += me->api->identify(me, asset);
+	}
+}
+
+/* Look up an asset's extension by comparing it with each entry of the
+ * built-in table in turn, as the ext identifier did before it used a
+ * hash table
+ */
+static void
+linear_loop(const char *path, unsigned long n)
+{
+	const MIMETYPE *type;
+	unsigned long c, d;
+
+	asset_set_path(asset, path);
+	for(c = 0; c < n; c++)
+	{
+		type = NULL;
+		for(d = 0; d < mimedb_nentries; d++)
+		{
+			if(!strcmp(ASSET_EXT(asset) + 1, mimedb_entries[d].ext))
+			{
+				type = mimedb_types[mimedb_entries[d].type];
+				break;
+			}
+		}
+		sink += (type != NULL);
+	}
+}
+
+static void
+path_loop(const char *path, unsigned long n)
+{
+	unsigned long c;
+
+	for(c = 0; c < n; c++)
+	{
+		asset_set_path(asset, path);
+		sink += asset->basename;
+	}
+}
+
+/* Generate a distinct (version 4) UUID without the cost of gathering
+ * randomness, using the splitmix64 sequence
+ */
+static void
+next_uuid(uuid_t uu)
+{
+	unsigned long long z;
+	int c, i;
+
+	for(i = 0; i < 2; i++)
+	{
+		z = (counter += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		z ^= z >> 31;
+		for(c = 0; c < 8; c++)
+		{
+			uu[i * 8 + c] = (unsigned char) (z >> (c * 8));
+		}
+	}
+	uu[6] = (uu[6] & 0x0f) | 0x40;
+	uu[8] = (uu[8] & 0x3f) | 0x80;
+}
@@ -21,6 +21,12 @@
 # ifdef HAVE_FCNTL_H
 #  include <fcntl.h>
 # endif
+# ifdef HAVE_STDINT_H
+#  include <stdint.h>
+# endif
+# ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+# endif
 
 # if defined(HAVE_UUID_UUID_H)
 #  include <uuid/uuid.h>
@@ -28,6 +34,7 @@
 #  include <uuid.h>
 # endif
 
+# include <syslog.h>
 # include <liburi.h>
 
 # include "iniparser.h"
@@ -36,6 +43,83 @@
 #  define EXIT_FAILURE                  1
 # endif
 
+# define SHA256_LEN                     32
+
+/* Log a message if its level (LOG_ERR..LOG_DEBUG, as for syslog) is
+ * enabled; the arguments aren't evaluated otherwise
+ */
+# ifdef WITHOUT_DEBUG_LOG
+#  define log_enabled(level)            ((level) < LOG_DEBUG && (level) <= log_level)
+# else
+#  define log_enabled(level)            ((level) <= log_level)
+# endif
+# define LOG(level, ...)                do { if(log_enabled(level)) log_write(level, __VA_ARGS__); } while(0)
+
+/* Record a span of work for the trace, if tracing is enabled (see
+ * trace.c); the arguments aren't evaluated otherwise
+ */
+# define TRACE(...)                     do { if(trace_enabled) trace_span(__VA_ARGS__); } while(0)
+
+/* Paths shorter than this are stored within the ASSET itself */
+# define ASSET_INLINE                   160
+
+/* An asset's path (empty if it has none), its last component, and its
+ * extension (the last '.' within its last component, or the end of the
+ * path if there isn't one)
+ */
+# define ASSET_PATH(asset)              ((asset)->len < ASSET_INLINE ? (asset)->buf : (asset)->heap)
+# define ASSET_BASENAME(asset)          (ASSET_PATH(asset) + (asset)->basename)
+# define ASSET_EXT(asset)               (ASSET_PATH(asset) + (asset)->ext)
+
+/* Journal events */
+# define JOURNAL_BEGIN                  0
+# define JOURNAL_ID                     1
+# define JOURNAL_CONTAINER              2
+# define JOURNAL_STORED                 3
+# define JOURNAL_RECIPE                 4
+# define JOURNAL_COMPLETE               5
+# define JOURNAL_ABORT                  6
+
+/* Built-in statistics */
+# define STAT_COLLECT                   0
+# define STAT_IDENTIFY                  1
+# define STAT_ID_ASSIGN                 2
+# define STAT_CREATE_CONTAINER          3
+# define STAT_COPY_ASSET                4
+# define STAT_JOBS_COLLECTED            5
+# define STAT_JOBS_COMPLETED            6
+# define STAT_JOBS_ABORTED              7
+# define STAT_BYTES_STORED              8
+# define STAT_ERRORS                    9
+# define STAT_RECIPES_RUN               10
+# define STAT_RECIPES_FAILED            11
+# define STAT_QUEUE_METADATA            12
+# define STAT_QUEUE_ID                  13
+# define STAT_QUEUE_STORE               14
+# define STAT_QUEUE_RECIPE              15
+# define STAT_DIRCACHE_MISSES           16
+# define STAT_CACHE_HITS                17
+# define STAT_CACHE_MISSES              18
+# define STAT_CACHE_STORES              19
+# define STAT_CACHE_EVICTIONS           20
+/* One counter per storage method (COPY_xxx), for each of these */
+# define STAT_STORE_FILES               21
+# define STAT_STORE_BYTES               27
+# define STAT_NBUILTIN                  33
+
+/* How an asset was placed into storage (see COPYSTATS) */
+# define COPY_RENAME                    0
+# define COPY_LINK                      1
+# define COPY_REFLINK                   2
+# define COPY_RANGE                     3
+# define COPY_SENDFILE                  4
+# define COPY_BUFFERED                  5
+# define COPY_NMETHODS                  6
+
+/* MIMETYPE flags */
+# define MIME_SIDECAR                   (1<<0)
+
+typedef struct arena_struct ARENA;
 typedef struct asset_struct ASSET;
 typedef struct job_struct JOB;
 typedef struct jobid_struct JOBID;
@@ -45,19 +129,59 @@ typedef struct identify_struct IDENTIFY;
 typedef struct identify_api_struct IDENTIFY_API;
 typedef struct storage_struct STORAGE;
 typedef struct storage_api_struct STORAGE_API;
+typedef struct recipe_struct RECIPE;
+typedef struct task_struct TASK;
+typedef struct sha256_struct SHA256;
+typedef struct ring_struct RING;
+typedef struct ringset_struct RINGSET;
+typedef struct copystats_struct COPYSTATS;
+typedef struct stat_struct STAT;
+typedef struct mimetype_struct MIMETYPE;
+typedef struct meta_field_struct META_FIELD;
+
+/* An interned MIME type: there is only ever one MIMETYPE for a given
+ * (lower-cased) type name, so types can be compared by pointer. Entries
+ * are immutable once registered and are never freed.
+ */
+struct mimetype_struct
+{
+	const char *name;
+	unsigned int flags;
+};
 
+/* An asset's path is kept in buf if it fits, and otherwise in heap, which
+ * is kept for re-use when the path is next set; the basename and
+ * extension are stored as offsets within the path, so that an asset can
+ * be copied without fixing up pointers. Use ASSET_PATH() and friends to
+ * obtain them.
+ */
 struct asset_struct
 {
-	char *path;
-	char *basename;
-	char *ext;
-	char *type;
+	/* Arena the asset (and heap) are allocated from, or NULL */
+	ARENA *arena;
+	size_t len;
+	size_t basename;
+	size_t ext;
+	char *heap;
+	size_t heapsize;
+	const MIMETYPE *type;
 	int container;
 	int sidecar;
+	char buf[ASSET_INLINE];
+};
+
+/* A field extracted from an asset's metadata */
+struct meta_field_struct
+{
+	const char *name;
+	/* NULL if the field wasn't found */
+	const char *value;
 };
 
 struct jobid_struct
 {
+	/* Arena the identifier is allocated from, or NULL */
+	ARENA *arena;
 	uuid_t uuid;
 	uuid_string_t formatted;
 	char canonical[33];
@@ -65,10 +189,14 @@ struct jobid_struct
 
 struct job_struct
 {
+	/* Updated atomically; jobs may be shared between pipeline threads */
 	int refcount;
+	/* The job, its identifier and its assets are allocated from this */
+	ARENA *arena;
 	char *name;
 	JOBID *id;
 	int aborted;
+	int begun;
 	int submitted;
 	int completed;
 	/* Source handler */
@@ -85,6 +213,21 @@ struct job_struct
 	ASSET *stored;
 	/* Stored sidecar */
 	ASSET *stored_sidecar;
+	/* Set if the job's identifier may already have a container, because
+	 * it's shared with other jobs through the index or was resumed from
+	 * the journal
+	 */
+	int reused;
+	/* Metadata (see meta.c); kind and key are also included in meta */
+	const char *kind;
+	const char *key;
+	META_FIELD *meta;
+	size_t nmeta;
+	/* Names of recipes already run (when resumed from the journal) */
+	char **done;
+	size_t ndone;
+	/* When collection of the job began (from stats_clock()), if tracing */
+	unsigned long long collected;
 };
 
 struct source_api_struct
@@ -97,6 +240,16 @@ struct source_api_struct
 	int (*abort)(SOURCE *me, JOB *job);
 	/* A job has been completed */
 	int (*complete)(SOURCE *me, JOB *job);
+	/* Wait until there may be new jobs to collect (optional) */
+	int (*wait)(SOURCE *me);
+	/* Re-create a job which had begun processing, without identifying
+	 * its asset (optional)
+	 */
+	JOB *(*resume)(SOURCE *me, const char *name);
+	/* Collect up to max jobs from the source at once, returning the
+	 * number collected (optional)
+	 */
+	int (*collect_batch)(SOURCE *me, JOB **jobs, size_t max);
 };
 
 # ifndef SOURCE_STRUCT_DEFINED
@@ -134,22 +287,82 @@ struct storage_struct
 };
 # endif
 
+struct task_struct
+{
+	/* Perform the task; called on one of the executor's threads */
+	void (*run)(TASK *task);
+};
+
+struct sha256_struct
+{
+	uint32_t state[8];
+	uint64_t count;
+	unsigned char buf[64];
+};
+
+/* A ring of fixed-size slots belonging to a single thread (see ring.c) */
+struct ring_struct
+{
+	RING *next;
+	char *slots;
+	/* Numbered from 1, in the order the rings were created */
+	unsigned int id;
+	/* Advanced only by the owning thread */
+	volatile size_t head;
+	/* Advanced only by the draining thread */
+	volatile size_t tail;
+	/* Set when the owning thread has exited */
+	volatile int dead;
+};
+
+/* How a file was copied (see copy.c) */
+struct copystats_struct
+{
+	/* The mechanism which was used (COPY_xxx) */
+	int method;
+	off_t bytes;
+	double seconds;
+};
+
+/* The rings of every thread which has used a set */
+struct ringset_struct
+{
+	size_t slotsize;
+	size_t nslots;
+	unsigned int nrings;
+	pthread_key_t key;
+	RING *rings;
+	pthread_mutex_t lock;
+	pthread_mutex_t drain_lock;
+};
+
 extern const char *short_program_name;
+extern int log_level;
+extern int trace_enabled;
 
 int config_init(void);
 int config_load(void);
 int config_set(const char *key, const char *value);
 const char *config_get(const char *key, const char *defval);
+int config_get_int(const char *key, int defval);
 
 int plugin_load(void);
 SOURCE *plugin_source(const char *name);
 IDENTIFY **plugin_identify_list(void);
 STORAGE *plugin_storage(const char *name);
 
+ARENA *arena_create(void);
+void arena_release(ARENA *arena);
+void *arena_alloc(ARENA *arena, size_t size);
+void *arena_calloc(ARENA *arena, size_t size);
+char *arena_strdup(ARENA *arena, const char *s);
+
 ASSET *asset_create(void);
+ASSET *asset_create_arena(ARENA *arena);
+ASSET *asset_copy(ARENA *arena, const ASSET *src);
 int asset_free(ASSET *asset);
 int asset_reset(ASSET *asset);
-int asset_set_type(ASSET *asset, const char *type);
+int asset_set_type(ASSET *asset, const MIMETYPE *type);
 int asset_set_path(ASSET *asset, const char *path);
 int asset_set_path_basedir(ASSET *asset, const char *basedir, size_t baselen, const char *path);
 int asset_set_path_basedir_ext(ASSET *asset, const char *basedir, size_t baselen, const char *name, char *ext);
@@ -161,25 +374,98 @@ int job_addref(JOB *job);
 int job_free(JOB *job);
 JOB *job_collect(void);
 JOB *job_collect_wait(void);
+int job_collect_batch(JOB **jobs, size_t max);
+int job_collect_batch_wait(JOB **jobs, size_t max);
+size_t job_abort_failed(JOB **jobs, int *status, size_t njobs, const char *what);
 int job_abort(JOB *job);
 int job_begin(JOB *job);
+int job_begin_batch(JOB **jobs, size_t njobs, int *status);
 int job_submitted(JOB *job);
+int job_complete(JOB *job);
 int job_set_source_asset(JOB *job, ASSET *asset);
 int job_set_sidecar(JOB *job, ASSET *asset);
 int job_set_container(JOB *job, ASSET *asset);
 int job_set_id(JOB *job, JOBID *id);
 
 int type_identify_asset(ASSET *asset);
+const MIMETYPE *type_intern(const char *name);
+const MIMETYPE *type_find(const char *name);
 
+int meta_init(void);
 int meta_locate(JOB *job);
 
-JOBID *id_create_uuid(uuid_t uuid);
+JOBID *id_create_uuid(ARENA *arena, uuid_t uuid);
 int id_free(JOBID *id);
 int id_assign(JOB *job);
+int id_assign_batch(JOB **jobs, size_t njobs, int *status);
+
+int index_open(void);
+int index_assign(const char *kind, const char *key, uuid_t uuid);
+int index_assign_batch(const char **kinds, const char **keys, uuid_t *uuids, int *found, size_t count);
 
 int process_job(JOB *job);
+int process_batch(JOB **jobs, size_t njobs, int *status);
+
+int pipeline_run(void);
+
+int recipe_load(void);
+int recipe_submit(JOB *job);
+
+int executor_start(int count);
+int executor_submit(TASK *task);
+
+int journal_open(void);
+JOB *journal_resume(void);
+int journal_record(JOB *job, int event, const char *arg, const char *arg2);
+int journal_record_batch(JOB **jobs, size_t njobs, int event, const char **args);
+
+char *util_path_join(const char *dir, const char *name);
+int util_remove_tree(const char *path);
+int util_escape(char **buf, size_t *len, size_t *alloc, char sep, const char *str);
+void util_unescape(char *str);
+int util_write(int fd, const void *buf, size_t len);
+unsigned long util_hash(const void *data, size_t len);
+
+int copy_file(const char *srcpath, const char *destpath, int oflag, COPYSTATS *stats);
+const char *copy_method_name(int method);
+
+int ring_init(RINGSET *set, size_t slotsize, size_t nslots);
+void *ring_reserve(RINGSET *set, RING **ring);
+size_t ring_commit(RING *ring);
+RING *ring_drain_begin(RINGSET *set);
+void *ring_peek(RINGSET *set, RING *ring);
+void ring_consume(RING *ring);
+void ring_drain_end(RINGSET *set);
+
+int cache_init(void);
+int cache_enabled(void);
+int cache_fetch(const unsigned char *key, const char *dest);
+int cache_store(const unsigned char *key, const char *src);
+
+void sha256_init(SHA256 *ctx);
+void sha256_update(SHA256 *ctx, const void *data, size_t len);
+void sha256_final(SHA256 *ctx, unsigned char *digest);
+int sha256_file(const char *path, unsigned char *digest);
+void sha256_format(const unsigned char *digest, char *buf);
+
+int log_init(void);
+void log_write(int level, const char *fmt, ...);
+void log_flush(void);
+
+int stats_init(void);
+int stats_register(const char *name, const char *label, const char *value, const char *help);
+unsigned long long stats_clock(void);
+void stats_time(int id, unsigned long long start);
+void stats_add(int id, long long n);
+long long stats_get(int id);
+
+int trace_init(void);
+void trace_span(const char *name, const char *label, size_t count, unsigned long long start, unsigned long long bytes);
+void trace_job(const JOB *job);
+void trace_flush(void);
 
 int store_create_container(JOB *job);
+int store_create_container_batch(JOB **jobs, size_t njobs, int *status);
 int store_copy_source(JOB *job);
 
 /* Built-in sources */
@@ -189,6 +475,7 @@ SOURCE *file_create(void);
 /* Built-in identification mechanisms */
 
 IDENTIFY *ext_create(void);
+IDENTIFY *magic_create(void);
 IDENTIFY *sidecar_create(void);
 
 /* Built-in storage */
@@ -0,0 +1,354 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_spool.h"
+
+/* The pipeline runs each of the stages performed by the serial loop in
+ * main() on its own pool of worker threads, connected by bounded queues:--
+ *
+ *   collect -> [queue] -> metadata -> [queue] -> id -> [queue] -> store
+ *
+ * A job is passed from one stage to the next along with the reference
+ * held by the stage which produced it; a stage which fails a job aborts
+ * it (releasing that reference) rather than passing it on. Because a full
+ * queue blocks the stage feeding it, a slow store stage applies
+ * back-pressure all the way to collection rather than allowing the
+ * backlog to accumulate in memory.
+ *
+ * Workers take up to spoold:batch jobs from their input queue at a time
+ * (whatever is waiting, rather than waiting for a full batch), so that
+ * when a backlog arrives, identifiers and containers are assigned to many
+ * jobs at once.
+ */
+
+#define PIPELINE_NSTAGES                4
+#define PIPELINE_MAXWORKERS             64
+#define PIPELINE_BATCH                  32
+
+typedef struct queue_struct QUEUE;
+typedef struct stage_struct STAGE;
+
+struct queue_struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t notempty;
+	pthread_cond_t notfull;
+	JOB **jobs;
+	size_t size;
+	size_t head;
+	size_t count;
+	/* Gauge tracking the queue's length */
+	int stat;
+};
+
+struct stage_struct
+{
+	const char *name;
+	int (*process)(JOB **jobs, size_t njobs, int *status);
+	/* What a job which fails this stage has failed to do */
+	const char *failure;
+	/* Queue jobs are taken from (NULL for the collect stage) */
+	QUEUE *input;
+	/* Queue jobs are passed on to (NULL for the final stage) */
+	QUEUE *output;
+	int nworkers;
+};
+
+/* Stage handlers */
+static void *stage_collect(void *arg);
+static void *stage_worker(void *arg);
+static int stage_metadata(JOB **jobs, size_t njobs, int *status);
+static int stage_id(JOB **jobs, size_t njobs, int *status);
+static int stage_store(JOB **jobs, size_t njobs, int *status);
+
+/* Internal utilities */
+static int queue_init(QUEUE *q, size_t size, int stat);
+static void queue_push(QUEUE *q, JOB *job);
+static size_t queue_pop(QUEUE *q, JOB **jobs, size_t max);
+
+static QUEUE queues[PIPELINE_NSTAGES - 1];
+static STAGE stages[PIPELINE_NSTAGES] = {
+	{ "collect", NULL, NULL, NULL, &(queues[0]), 1 },
+	{ "metadata", stage_metadata, "locate metadata for job", &(queues[0]), &(queues[1]), 1 },
+	{ "id", stage_id, "assign identifier for job", &(queues[1]), &(queues[2]), 1 },
+	{ "store", stage_store, "submit job for processing", &(queues[2]), NULL, 1 },
+};
+static size_t batch = PIPELINE_BATCH;
+
+/* Serialises collection: sources are not re-entrant, and a job must have
+ * been moved out of the source's way before the next scan begins.
+ */
+static pthread_mutex_t collect_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Start the pipeline's worker threads; this doesn't return unless
+ * something goes wrong.
+ */
+int
+pipeline_run(void)
+{
+	pthread_t *threads;
+	char key[64];
+	size_t c, nthreads, qsize;
+	int n, w, r;
+
+	qsize = config_get_int("pipeline:queue", 32);
+	if(qsize < 1)
+	{
+		qsize = 1;
+	}
+	n = config_get_int("spoold:batch", PIPELINE_BATCH);
+	batch = (n < 1 ? 1 : n);
+	nthreads = 0;
+	for(c = 0; c < PIPELINE_NSTAGES; c++)
+	{
+		sprintf(key, "pipeline:%s", stages[c].name);
+		n = config_get_int(key, stages[c].nworkers);
+		if(n < 1 || n > PIPELINE_MAXWORKERS)
+		{
+			LOG(LOG_ERR, "%s: worker count must be between 1 and %d\n", key, PIPELINE_MAXWORKERS);
+			errno = EINVAL;
+			return -1;
+		}
+		stages[c].nworkers = n;
+		nthreads += n;
+	}
+	for(c = 0; c < PIPELINE_NSTAGES - 1; c++)
+	{
+		if(queue_init(&(queues[c]), qsize, STAT_QUEUE_METADATA + c) < 0)
+		{
+			return -1;
+		}
+	}
+	threads = (pthread_t *) calloc(nthreads, sizeof(pthread_t));
+	if(!threads)
+	{
+		return -1;
+	}
+	nthreads = 0;
+	for(c = 0; c < PIPELINE_NSTAGES; c++)
+	{
+		LOG(LOG_INFO, "pipeline: starting %d '%s' worker(s)\n", stages[c].nworkers, stages[c].name);
+		for(w = 0; w < stages[c].nworkers; w++)
+		{
+			r = pthread_create(&(threads[nthreads]), NULL, (stages[c].input ? stage_worker : stage_collect), &(stages[c]));
+			if(r)
+			{
+				errno = r;
+				return -1;
+			}
+			nthreads++;
+		}
+	}
+	/* Worker threads only exit on fatal errors, at which point they
+	 * terminate the process.
+	 */
+	for(c = 0; c < nthreads; c++)
+	{
+		pthread_join(threads[c], NULL);
+	}
+	free(threads);
+	return 0;
+}
+
+/* Collect jobs from sources and feed them into the pipeline */
+static void *
+stage_collect(void *arg)
+{
+	STAGE *stage;
+	JOB **jobs;
+	int *status;
+	size_t n, c;
+	int r;
+
+	stage = (STAGE *) arg;
+	jobs = (JOB **) calloc(batch, sizeof(JOB *));
+	status = (int *) calloc(batch, sizeof(int));
+	if(!jobs || !status)
+	{
+		LOG(LOG_ERR, "pipeline: failed to allocate memory: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	for(;;)
+	{
+		pthread_mutex_lock(&collect_lock);
+		r = job_collect_batch_wait(jobs, batch);
+		if(r < 0)
+		{
+			LOG(LOG_ERR, "unexpected error while waiting for a job: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		n = r;
+		for(c = 0; c < n; c++)
+		{
+			status[c] = 0;
+		}
+		job_begin_batch(jobs, n, status);
+		pthread_mutex_unlock(&collect_lock);
+		for(c = 0; c < n; c++)
+		{
+			if(status[c])
+			{
+				job_abort(jobs[c]);
+				continue;
+			}
+			queue_push(stage->output, jobs[c]);
+		}
+	}
+	return NULL;
+}
+
+/* Take batches of jobs from a stage's input queue, process them, and pass
+ * them on
+ */
+static void *
+stage_worker(void *arg)
+{
+	STAGE *stage;
+	JOB **jobs;
+	int *status;
+	size_t n, c;
+
+	stage = (STAGE *) arg;
+	jobs = (JOB **) calloc(batch, sizeof(JOB *));
+	status = (int *) calloc(batch, sizeof(int));
+	if(!jobs || !status)
+	{
+		LOG(LOG_ERR, "pipeline: failed to allocate memory: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	for(;;)
+	{
+		n = queue_pop(stage->input, jobs, batch);
+		for(c = 0; c < n; c++)
+		{
+			status[c] = 0;
+		}
+		stage->process(jobs, n, status);
+		n = job_abort_failed(jobs, status, n, stage->failure);
+		if(stage->output)
+		{
+			for(c = 0; c < n; c++)
+			{
+				queue_push(stage->output, jobs[c]);
+			}
+		}
+	}
+	return NULL;
+}
+
+static int
+stage_metadata(JOB **jobs, size_t njobs, int *status)
+{
+	size_t c;
+	int r;
+
+	r = 0;
+	for(c = 0; c < njobs; c++)
+	{
+		if(meta_locate(jobs[c]) < 0)
+		{
+			status[c] = -1;
+			r = -1;
+		}
+	}
+	return r;
+}
+
+static int
+stage_id(JOB **jobs, size_t njobs, int *status)
+{
+	return id_assign_batch(jobs, njobs, status);
+}
+
+static int
+stage_store(JOB **jobs, size_t njobs, int *status)
+{
+	size_t c;
+	int r;
+
+	r = process_batch(jobs, njobs, status);
+	for(c = 0; c < njobs; c++)
+	{
+		if(!status[c])
+		{
+			job_submitted(jobs[c]);
+		}
+	}
+	return r;
+}
+
+static int
+queue_init(QUEUE *q, size_t size, int stat)
+{
+	q->jobs = (JOB **) calloc(size, sizeof(JOB *));
+	if(!q->jobs)
+	{
+		return -1;
+	}
+	q->size = size;
+	q->head = 0;
+	q->count = 0;
+	q->stat = stat;
+	pthread_mutex_init(&(q->lock), NULL);
+	pthread_cond_init(&(q->notempty), NULL);
+	pthread_cond_init(&(q->notfull), NULL);
+	return 0;
+}
+
+/* Append a job to a queue, waiting until there is space for it */
+static void
+queue_push(QUEUE *q, JOB *job)
+{
+	pthread_mutex_lock(&(q->lock));
+	while(q->count == q->size)
+	{
+		pthread_cond_wait(&(q->notfull), &(q->lock));
+	}
+	q->jobs[(q->head + q->count) % q->size] = job;
+	q->count++;
+	stats_add(q->stat, 1);
+	pthread_cond_signal(&(q->notempty));
+	pthread_mutex_unlock(&(q->lock));
+}
+
+/* Remove up to max jobs from the head of a queue, waiting until there is
+ * at least one, and return the number removed
+ */
+static size_t
+queue_pop(QUEUE *q, JOB **jobs, size_t max)
+{
+	size_t n;
+
+	pthread_mutex_lock(&(q->lock));
+	while(!q->count)
+	{
+		pthread_cond_wait(&(q->notempty), &(q->lock));
+	}
+	for(n = 0; n < max && q->count; n++)
+	{
+		jobs[n] = q->jobs[q->head];
+		q->head = (q->head + 1) % q->size;
+		q->count--;
+	}
+	stats_add(q->stat, -(long long) n);
+	pthread_cond_broadcast(&(q->notfull));
+	pthread_mutex_unlock(&(q->lock));
+	return n;
+}
@@ -22,7 +22,7 @@
 
 static SOURCE *file_source;
 static STORAGE *fs_storage;
-static IDENTIFY *identify_plugins[3];
+static IDENTIFY *identify_plugins[4];
 
 int
 plugin_load(void)
@@ -30,25 +30,31 @@ plugin_load(void)
 	file_source = file_create();
 	if(!file_source)
 	{
-		fprintf(stderr, "%s: failed to construct 'file' source: %s\n", short_program_name, strerror(errno));
+		LOG(LOG_ERR, "failed to construct 'file' source: %s\n", strerror(errno));
 		return -1;
 	}
 	identify_plugins[0] = ext_create();
 	if(!identify_plugins[0])
 	{
-		fprintf(stderr, "%s: failed to construct 'ext' identification mechanism: %s\n", short_program_name, strerror(errno));
+		LOG(LOG_ERR, "failed to construct 'ext' identification mechanism: %s\n", strerror(errno));
 		return -1;
 	}
-	identify_plugins[1] = sidecar_create();
-	if(!identify_plugins[0])
+	identify_plugins[1] = magic_create();
+	if(!identify_plugins[1])
+	{
+		LOG(LOG_ERR, "failed to construct 'magic' identification mechanism: %s\n", strerror(errno));
+		return -1;
+	}
+	identify_plugins[2] = sidecar_create();
+	if(!identify_plugins[2])
 	{
-		fprintf(stderr, "%s: failed to construct 'ext' identification mechanism: %s\n", short_program_name, strerror(errno));
+		LOG(LOG_ERR, "failed to construct 'sidecar' identification mechanism: %s\n", strerror(errno));
 		return -1;
 	}
 	fs_storage = fs_create();
 	if(!fs_storage)
 	{
-		fprintf(stderr, "%s: failed to construct 'fs' storage mechanism: %s\n", short_program_name, strerror(errno));
+		LOG(LOG_ERR, "failed to construct 'fs' storage mechanism: %s\n", strerror(errno));
 		return -1;
 	}
 	return 0;
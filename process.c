@@ -20,32 +20,64 @@
 
 #include "p_spool.h"
 
+/* Process a job: create its container, copy its source assets into
+ * storage, and submit it to any applicable recipes
+ */
 int
 process_job(JOB *job)
 {
+	int status;
+
+	status = 0;
+	process_batch(&job, 1, &status);
+	return status;
+}
+
+/* Process a batch of jobs, as process_job() does for one, except that
+ * they are begun, and their containers created, together.
+ * Jobs whose status[n] is already non-zero are skipped, and status[n] is
+ * set to -1 for any job which couldn't be processed. Returns -1 if any of
+ * the jobs failed, or 0 otherwise.
+ */
+int
+process_batch(JOB **jobs, size_t njobs, int *status)
+{
+	size_t c;
 	int r;
 
-	fprintf(stderr, "%s: %s: processing job\n", short_program_name, job->name);
-	r = job_begin(job);
-	if(r < 0)
+	for(c = 0; c < njobs; c++)
 	{
-		fprintf(stderr, "%s: %s: failed to prepare job for processing: %s\n", short_program_name, job->name, strerror(errno));
-		return -1;
+		if(!status[c])
+		{
+			LOG(LOG_DEBUG, "%s: processing job\n", jobs[c]->name);
+		}
 	}
-	r = store_create_container(job);
-	if(r < 0)
+	job_begin_batch(jobs, njobs, status);
+	store_create_container_batch(jobs, njobs, status);
+	r = 0;
+	for(c = 0; c < njobs; c++)
 	{
-		fprintf(stderr, "%s: %s: failed to create container for job: %s\n", short_program_name, job->name, strerror(errno));
-		return -1;
+		if(status[c])
+		{
+			r = -1;
+			continue;
+		}
+		if(store_copy_source(jobs[c]) < 0)
+		{
+			LOG(LOG_ERR, "%s: failed to copy source asset to storage: %s\n", jobs[c]->name, strerror(errno));
+			status[c] = -1;
+			r = -1;
+			continue;
+		}
+		/* Locate suitable recipes, build the dependency graph and submit
+		 * them for processing
+		 */
+		if(recipe_submit(jobs[c]) < 0)
+		{
+			LOG(LOG_ERR, "%s: failed to submit recipes for job: %s\n", jobs[c]->name, strerror(errno));
+			status[c] = -1;
+			r = -1;
+		}
 	}
-	r = store_copy_source(job);
-	if(r < 0)
-	{
-		fprintf(stderr, "%s: %s: failed to copy source asset to storage: %s\n", short_program_name, job->name, strerror(errno));
-	}
-	/* Locate suitable recipes */
-	/* Build the recipe dependency graph */
-	/* Begin recipe submission and processing */
-	return 0;
+	return r;
 }
-
@@ -0,0 +1,1057 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_spool.h"
+
+#ifdef HAVE_SYS_WAIT_H
+# include <sys/wait.h>
+#endif
+
+/* Recipes are loaded from the *.recipe files in recipe:dir. Each is an
+ * INI file of the form:--
+ *
+ * [recipe]
+ * exec=command ${source} ${output}
+ * directory=1          ; ${output} is a directory rather than a file
+ * create=1             ; create ${output} before running the command
+ * requires=a b         ; recipes (by name) which must be run first
+ * cache=0              ; never cache the recipe's output
+ *
+ * [supports]
+ * application/pdf=1    ; types the recipe applies to
+ * image/any=1          ; ...or all image types
+ * any=1                ; ...or all types
+ *
+ * A recipe's name is its filename without the '.recipe' suffix. The
+ * command is run by /bin/sh, with ${source} (the stored asset),
+ * ${output} (the recipe's output within the job's container, which is
+ * named after the recipe), ${container}, ${id}, ${type} and
+ * ${output:NAME} (the output of a required recipe) substituted.
+ *
+ * When a job has been stored, the recipes which apply to it are assembled
+ * into a dependency graph, and each is submitted to the executor as soon
+ * as all of the recipes it requires have finished, so that independent
+ * recipes run concurrently. Once every recipe has finished, the job is
+ * complete. A recipe which requires one that doesn't apply to the asset,
+ * or that failed, is skipped.
+ *
+ * If the recipe cache is enabled (see cache.c), a recipe's output is
+ * looked up there before the recipe is run, and added to it afterwards.
+ * The key is a digest of the content of the source asset, the recipe file
+ * itself, the asset's type and the keys of the recipes it requires; a
+ * recipe whose command refers to ${id} or ${container} produces output
+ * specific to the job, and so isn't cached (nor is anything requiring it).
+ */
+
+#define RECIPE_SUFFIX                   ".recipe"
+
+typedef struct recipe_run_struct RECIPE_RUN;
+typedef struct recipe_task_struct RECIPE_TASK;
+
+struct recipe_struct
+{
+	char *name;
+	char *exec;
+	int directory;
+	int create;
+	/* Types the recipe applies to */
+	char **types;
+	size_t ntypes;
+	/* The interned type for each entry in types, or NULL if the entry is
+	 * a wildcard
+	 */
+	const MIMETYPE **mimetypes;
+	/* Names of required recipes */
+	char **requires;
+	size_t nrequires;
+	/* Indices of required recipes, once resolved */
+	size_t *deps;
+	/* Digest of the recipe file */
+	unsigned char digest[SHA256_LEN];
+	/* Whether the recipe's output may be cached */
+	int cache;
+	/* Histogram of the recipe's run times */
+	int stat;
+	/* State used while sorting */
+	int mark;
+};
+
+/* The recipes being run for a particular job */
+struct recipe_run_struct
+{
+	JOB *job;
+	RECIPE_TASK *tasks;
+	size_t ntasks;
+	/* Updated atomically */
+	size_t remaining;
+	size_t failed;
+	/* The asset's type */
+	const MIMETYPE *type;
+	/* Digest of the source asset, if hashed (1) or if hashing failed (-1);
+	 * it's hashed by whichever task first needs it, holding lock
+	 */
+	unsigned char digest[SHA256_LEN];
+	int hashed;
+	pthread_mutex_t lock;
+};
+
+struct recipe_task_struct
+{
+	/* Must be first */
+	TASK task;
+	RECIPE_RUN *run;
+	RECIPE *recipe;
+	char *output;
+	/* Number of unfinished dependencies; updated atomically */
+	size_t pending;
+	/* Set if any dependency failed */
+	int skip;
+	int failed;
+	/* Indices of the tasks this one requires, in the order of the
+	 * recipe's requires list
+	 */
+	size_t *deps;
+	/* Indices of the tasks which depend upon this one */
+	size_t *dependents;
+	size_t ndependents;
+	/* Cache key, if the output may be cached */
+	unsigned char key[SHA256_LEN];
+	int cache;
+};
+
+/* Internal utilities */
+static RECIPE *recipe_read(const char *dir, const char *filename);
+static void recipe_destroy(RECIPE *recipe);
+static int recipe_resolve(void);
+static int recipe_visit(size_t index, RECIPE **sorted, size_t *nsorted);
+static int recipe_applies(RECIPE *recipe, const MIMETYPE *type);
+static int recipe_wildcard(const char *type);
+static int recipe_split(const char *list, char ***words, size_t *nwords);
+static int task_key(RECIPE_TASK *t);
+static void task_run(TASK *task);
+static int task_done(RECIPE_TASK *t);
+static int task_exec(RECIPE_TASK *t);
+static char *task_expand(RECIPE_TASK *t);
+static const char *task_variable(RECIPE_TASK *t, const char *name, size_t len);
+static void run_finished(RECIPE_RUN *run);
+static void run_free(RECIPE_RUN *run);
+
+/* Recipes, ordered such that every recipe follows those it requires */
+static RECIPE **recipes;
+static size_t nrecipes;
+
+/* Load the recipes and start the executor which runs them */
+int
+recipe_load(void)
+{
+	const char *dir;
+	DIR *d;
+	struct dirent *de;
+	RECIPE *recipe, **p;
+	size_t l, sl;
+	int workers;
+
+	dir = config_get("recipe:dir", "recipes");
+	workers = config_get_int("recipe:workers", 4);
+	d = opendir(dir);
+	if(!d)
+	{
+		if(errno == ENOENT)
+		{
+			LOG(LOG_WARNING, "%s: recipe directory does not exist; no recipes will be run\n", dir);
+			return 0;
+		}
+		LOG(LOG_ERR, "%s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+	sl = strlen(RECIPE_SUFFIX);
+	while((de = readdir(d)))
+	{
+		l = strlen(de->d_name);
+		if(de->d_name[0] == '.' || l <= sl || strcmp(&(de->d_name[l - sl]), RECIPE_SUFFIX))
+		{
+			continue;
+		}
+		recipe = recipe_read(dir, de->d_name);
+		if(!recipe)
+		{
+			closedir(d);
+			return -1;
+		}
+		p = (RECIPE **) realloc(recipes, (nrecipes + 1) * sizeof(RECIPE *));
+		if(!p)
+		{
+			recipe_destroy(recipe);
+			closedir(d);
+			return -1;
+		}
+		recipes = p;
+		recipes[nrecipes] = recipe;
+		nrecipes++;
+	}
+	closedir(d);
+	if(recipe_resolve() < 0)
+	{
+		return -1;
+	}
+	LOG(LOG_INFO, "loaded %lu recipe(s) from %s\n", (unsigned long) nrecipes, dir);
+	if(!nrecipes)
+	{
+		return 0;
+	}
+	if(cache_init() < 0)
+	{
+		LOG(LOG_ERR, "failed to initialise the recipe cache: %s\n", strerror(errno));
+		return -1;
+	}
+	if(executor_start(workers) < 0)
+	{
+		LOG(LOG_ERR, "failed to start %d recipe worker(s): %s\n", workers, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Submit the recipes which apply to a job's stored asset for processing;
+ * once they have all finished (immediately, if there are none), the job
+ * is completed.
+ */
+int
+recipe_submit(JOB *job)
+{
+	RECIPE_RUN *run;
+	RECIPE_TASK *t;
+	const MIMETYPE *type;
+	long *taskof;
+	size_t c, d, n, *p;
+	int ok;
+
+	type = (job->stored && job->stored->type ? job->stored->type : job->asset->type);
+	run = (RECIPE_RUN *) calloc(1, sizeof(RECIPE_RUN));
+	taskof = (long *) calloc(nrecipes + 1, sizeof(long));
+	if(!run || !taskof)
+	{
+		free(run);
+		free(taskof);
+		return -1;
+	}
+	run->job = job;
+	run->type = type;
+	pthread_mutex_init(&(run->lock), NULL);
+	if(nrecipes)
+	{
+		run->tasks = (RECIPE_TASK *) calloc(nrecipes, sizeof(RECIPE_TASK));
+		if(!run->tasks)
+		{
+			run_free(run);
+			free(taskof);
+			return -1;
+		}
+	}
+	/* Build the graph; because recipes are sorted, a recipe's dependencies
+	 * will always have been considered before it is
+	 */
+	n = 0;
+	for(c = 0; c < nrecipes; c++)
+	{
+		taskof[c] = -1;
+		if(!type || !recipe_applies(recipes[c], type))
+		{
+			continue;
+		}
+		ok = 1;
+		for(d = 0; d < recipes[c]->nrequires; d++)
+		{
+			if(taskof[recipes[c]->deps[d]] == -1)
+			{
+				LOG(LOG_WARNING, "%s: skipping recipe '%s' because it requires '%s', which does not apply\n", job->name, recipes[c]->name, recipes[c]->requires[d]);
+				ok = 0;
+				break;
+			}
+		}
+		if(!ok)
+		{
+			continue;
+		}
+		t = &(run->tasks[n]);
+		t->task.run = task_run;
+		t->run = run;
+		t->recipe = recipes[c];
+		t->pending = recipes[c]->nrequires;
+		if(recipes[c]->nrequires)
+		{
+			t->deps = (size_t *) calloc(recipes[c]->nrequires, sizeof(size_t));
+			if(!t->deps)
+			{
+				run->ntasks = n;
+				run_free(run);
+				free(taskof);
+				return -1;
+			}
+		}
+		for(d = 0; d < recipes[c]->nrequires; d++)
+		{
+			run->tasks[n].deps[d] = taskof[recipes[c]->deps[d]];
+			t = &(run->tasks[taskof[recipes[c]->deps[d]]]);
+			p = (size_t *) realloc(t->dependents, (t->ndependents + 1) * sizeof(size_t));
+			if(!p)
+			{
+				run->ntasks = n + 1;
+				run_free(run);
+				free(taskof);
+				return -1;
+			}
+			t->dependents = p;
+			t->dependents[t->ndependents] = n;
+			t->ndependents++;
+		}
+		taskof[c] = n;
+		n++;
+	}
+	free(taskof);
+	run->ntasks = n;
+	run->remaining = n;
+	if(!n)
+	{
+		run_free(run);
+		job_addref(job);
+		return job_complete(job) < 0 ? -1 : 0;
+	}
+	LOG(LOG_INFO, "%s: submitting %lu recipe(s)\n", job->name, (unsigned long) n);
+	/* The run holds a reference to the job until it has finished; once
+	 * the first task has been submitted, it may do so at any moment
+	 */
+	job_addref(job);
+	for(c = 0; c < n; c++)
+	{
+		/* Not 'pending', which submitted tasks may already be updating */
+		if(!run->tasks[c].recipe->nrequires)
+		{
+			if(executor_submit(&(run->tasks[c].task)) < 0)
+			{
+				LOG(LOG_ERR, "%s: failed to submit recipe '%s': %s\n", job->name, run->tasks[c].recipe->name, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	return 0;
+}
+
+/* Read a recipe file */
+static RECIPE *
+recipe_read(const char *dir, const char *filename)
+{
+	dictionary *ini;
+	RECIPE *p;
+	char *path, **tp;
+	const char *s;
+	size_t c;
+	int n;
+
+	path = util_path_join(dir, filename);
+	p = (RECIPE *) calloc(1, sizeof(RECIPE));
+	if(!path || !p)
+	{
+		free(path);
+		free(p);
+		return NULL;
+	}
+	ini = iniparser_load(path);
+	if(!ini)
+	{
+		LOG(LOG_ERR, "%s: failed to load recipe\n", path);
+		free(path);
+		free(p);
+		errno = EINVAL;
+		return NULL;
+	}
+	p->name = strdup(filename);
+	s = iniparser_getstring(ini, "recipe:exec", NULL);
+	if(!p->name || !s || !(p->exec = strdup(s)))
+	{
+		if(p->name && !s)
+		{
+			LOG(LOG_ERR, "%s: recipe has no 'exec' command\n", path);
+			errno = EINVAL;
+		}
+		iniparser_freedict(ini);
+		recipe_destroy(p);
+		free(path);
+		return NULL;
+	}
+	p->name[strlen(filename) - strlen(RECIPE_SUFFIX)] = 0;
+	if(sha256_file(path, p->digest) < 0)
+	{
+		LOG(LOG_ERR, "%s: %s\n", path, strerror(errno));
+		iniparser_freedict(ini);
+		recipe_destroy(p);
+		free(path);
+		return NULL;
+	}
+	p->cache = iniparser_getboolean(ini, "recipe:cache", 1) &&
+		!strstr(p->exec, "${id}") && !strstr(p->exec, "${container}");
+	p->stat = stats_register("spool_recipe_seconds", "recipe", p->name, "Time taken to run each recipe");
+	p->directory = iniparser_getboolean(ini, "recipe:directory", 0);
+	p->create = iniparser_getboolean(ini, "recipe:create", 0);
+	if(recipe_split(iniparser_getstring(ini, "recipe:requires", ""), &(p->requires), &(p->nrequires)) < 0)
+	{
+		iniparser_freedict(ini);
+		recipe_destroy(p);
+		free(path);
+		return NULL;
+	}
+	for(n = 0; n < ini->size; n++)
+	{
+		if(!ini->key[n] || strncmp(ini->key[n], "supports:", 9) || !ini->key[n][9] ||
+		   !ini->val[n] || !strchr("1yYtT", ini->val[n][0]))
+		{
+			continue;
+		}
+		tp = (char **) realloc(p->types, (p->ntypes + 1) * sizeof(char *));
+		if(!tp || !(tp[p->ntypes] = strdup(&(ini->key[n][9]))))
+		{
+			if(tp)
+			{
+				p->types = tp;
+			}
+			iniparser_freedict(ini);
+			recipe_destroy(p);
+			free(path);
+			return NULL;
+		}
+		p->types = tp;
+		p->ntypes++;
+	}
+	iniparser_freedict(ini);
+	if(!p->ntypes)
+	{
+		LOG(LOG_WARNING, "%s: recipe does not support any types\n", path);
+	}
+	else
+	{
+		/* Intern the types listed explicitly, so that matching them is a
+		 * pointer comparison
+		 */
+		p->mimetypes = (const MIMETYPE **) calloc(p->ntypes, sizeof(MIMETYPE *));
+		if(!p->mimetypes)
+		{
+			recipe_destroy(p);
+			free(path);
+			return NULL;
+		}
+		for(c = 0; c < p->ntypes; c++)
+		{
+			if(recipe_wildcard(p->types[c]))
+			{
+				continue;
+			}
+			p->mimetypes[c] = type_intern(p->types[c]);
+			if(!p->mimetypes[c])
+			{
+				LOG(LOG_ERR, "%s: invalid type '%s'\n", path, p->types[c]);
+				recipe_destroy(p);
+				free(path);
+				return NULL;
+			}
+		}
+	}
+	free(path);
+	return p;
+}
+
+static void
+recipe_destroy(RECIPE *recipe)
+{
+	size_t c;
+
+	for(c = 0; c < recipe->ntypes; c++)
+	{
+		free(recipe->types[c]);
+	}
+	for(c = 0; c < recipe->nrequires; c++)
+	{
+		free(recipe->requires[c]);
+	}
+	free(recipe->types);
+	free(recipe->mimetypes);
+	free(recipe->requires);
+	free(recipe->deps);
+	free(recipe->name);
+	free(recipe->exec);
+	free(recipe);
+}
+
+/* Resolve the names of required recipes and sort the recipes so that
+ * each follows all of those it requires, failing if there is a cycle.
+ */
+static int
+recipe_resolve(void)
+{
+	RECIPE **sorted;
+	size_t c, d, e, nsorted;
+
+	for(c = 0; c < nrecipes; c++)
+	{
+		recipes[c]->deps = (size_t *) calloc(recipes[c]->nrequires + 1, sizeof(size_t));
+		if(!recipes[c]->deps)
+		{
+			return -1;
+		}
+		for(d = 0; d < recipes[c]->nrequires; d++)
+		{
+			for(e = 0; e < nrecipes; e++)
+			{
+				if(!strcmp(recipes[e]->name, recipes[c]->requires[d]))
+				{
+					break;
+				}
+			}
+			if(e == nrecipes)
+			{
+				LOG(LOG_ERR, "recipe '%s' requires '%s', which does not exist\n", recipes[c]->name, recipes[c]->requires[d]);
+				errno = EINVAL;
+				return -1;
+			}
+			recipes[c]->deps[d] = e;
+		}
+	}
+	sorted = (RECIPE **) calloc(nrecipes + 1, sizeof(RECIPE *));
+	if(!sorted)
+	{
+		return -1;
+	}
+	nsorted = 0;
+	for(c = 0; c < nrecipes; c++)
+	{
+		if(recipe_visit(c, sorted, &nsorted) < 0)
+		{
+			free(sorted);
+			return -1;
+		}
+	}
+	/* Dependencies are indices into the unsorted list; renumber them */
+	for(c = 0; c < nrecipes; c++)
+	{
+		for(d = 0; d < sorted[c]->nrequires; d++)
+		{
+			for(e = 0; sorted[e] != recipes[sorted[c]->deps[d]]; e++);
+			sorted[c]->deps[d] = e;
+		}
+	}
+	free(recipes);
+	recipes = sorted;
+	return 0;
+}
+
+/* Depth-first traversal for recipe_resolve() */
+static int
+recipe_visit(size_t index, RECIPE **sorted, size_t *nsorted)
+{
+	RECIPE *recipe;
+	size_t c;
+
+	recipe = recipes[index];
+	if(recipe->mark == 2)
+	{
+		return 0;
+	}
+	if(recipe->mark == 1)
+	{
+		LOG(LOG_ERR, "recipe '%s' depends upon itself\n", recipe->name);
+		errno = EINVAL;
+		return -1;
+	}
+	recipe->mark = 1;
+	for(c = 0; c < recipe->nrequires; c++)
+	{
+		if(recipe_visit(recipe->deps[c], sorted, nsorted) < 0)
+		{
+			return -1;
+		}
+	}
+	recipe->mark = 2;
+	sorted[*nsorted] = recipe;
+	(*nsorted)++;
+	return 0;
+}
+
+/* Determine whether a recipe applies to a type */
+static int
+recipe_applies(RECIPE *recipe, const MIMETYPE *type)
+{
+	const char *t;
+	size_t c, l;
+
+	for(c = 0; c < recipe->ntypes; c++)
+	{
+		if(recipe->mimetypes[c])
+		{
+			if(recipe->mimetypes[c] == type)
+			{
+				return 1;
+			}
+			continue;
+		}
+		t = recipe->types[c];
+		if(!strcmp(t, "any") || !strcmp(t, "*"))
+		{
+			return 1;
+		}
+		/* A whole major type (e.g., 'image/any') */
+		l = strlen(t);
+		if(l > 4 && !strcmp(&(t[l - 4]), "/any") && !strncasecmp(t, type->name, l - 3))
+		{
+			return 1;
+		}
+		if(l > 2 && t[l - 1] == '*' && t[l - 2] == '/' && !strncasecmp(t, type->name, l - 1))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Determine whether a 'supports' entry matches more than one type */
+static int
+recipe_wildcard(const char *type)
+{
+	size_t l;
+
+	l = strlen(type);
+	return (!strcmp(type, "any") || !strcmp(type, "*") ||
+			(l > 4 && !strcmp(&(type[l - 4]), "/any")) ||
+			(l > 2 && type[l - 1] == '*' && type[l - 2] == '/'));
+}
+
+/* Split a whitespace-separated list into an array of strings */
+static int
+recipe_split(const char *list, char ***words, size_t *nwords)
+{
+	const char *start;
+	char **p;
+
+	for(;;)
+	{
+		while(isspace((unsigned char) *list) || *list == ',')
+		{
+			list++;
+		}
+		if(!*list)
+		{
+			return 0;
+		}
+		start = list;
+		while(*list && !isspace((unsigned char) *list) && *list != ',')
+		{
+			list++;
+		}
+		p = (char **) realloc(*words, (*nwords + 1) * sizeof(char *));
+		if(!p)
+		{
+			return -1;
+		}
+		*words = p;
+		p[*nwords] = (char *) malloc(list - start + 1);
+		if(!p[*nwords])
+		{
+			return -1;
+		}
+		memcpy(p[*nwords], start, list - start);
+		p[*nwords][list - start] = 0;
+		(*nwords)++;
+	}
+}
+
+/* Compute a task's cache key, if its output can be cached. This is done
+ * on the executor thread running the task (by which time the tasks it
+ * requires have finished and computed their own keys), so that hashing
+ * a large asset doesn't hold up whatever submitted the job; the asset is
+ * only hashed once, by the first task which needs it.
+ */
+static int
+task_key(RECIPE_TASK *t)
+{
+	RECIPE_RUN *run;
+	RECIPE_TASK *dep;
+	SHA256 ctx;
+	size_t c;
+	int hashed;
+
+	run = t->run;
+	if(!t->recipe->cache)
+	{
+		return 0;
+	}
+	for(c = 0; c < t->recipe->nrequires; c++)
+	{
+		if(!run->tasks[t->deps[c]].cache)
+		{
+			return 0;
+		}
+	}
+	pthread_mutex_lock(&(run->lock));
+	if(!run->hashed)
+	{
+		run->hashed = 1;
+		if(sha256_file(run->job->stored ? ASSET_PATH(run->job->stored) : ASSET_PATH(run->job->asset), run->digest) < 0)
+		{
+			LOG(LOG_WARNING, "%s: failed to compute digest of asset; recipe outputs will not be cached: %s\n", run->job->name, strerror(errno));
+			run->hashed = -1;
+		}
+	}
+	hashed = run->hashed;
+	pthread_mutex_unlock(&(run->lock));
+	if(hashed < 0)
+	{
+		return 0;
+	}
+	sha256_init(&ctx);
+	sha256_update(&ctx, run->digest, SHA256_LEN);
+	sha256_update(&ctx, t->recipe->digest, SHA256_LEN);
+	sha256_update(&ctx, run->type->name, strlen(run->type->name) + 1);
+	for(c = 0; c < t->recipe->nrequires; c++)
+	{
+		dep = &(run->tasks[t->deps[c]]);
+		sha256_update(&ctx, dep->key, SHA256_LEN);
+	}
+	sha256_final(&ctx, t->key);
+	t->cache = 1;
+	return 1;
+}
+
+/* Run a recipe for a job on an executor thread, then submit any recipes
+ * which were waiting for it.
+ */
+static void
+task_run(TASK *task)
+{
+	RECIPE_TASK *t, *dep;
+	RECIPE_RUN *run;
+	size_t c;
+
+	t = (RECIPE_TASK *) task;
+	run = t->run;
+	t->output = util_path_join(ASSET_PATH(run->job->container), t->recipe->name);
+	if(!t->output)
+	{
+		t->failed = 1;
+	}
+	if(!t->skip && !t->failed && cache_enabled())
+	{
+		task_key(t);
+	}
+	if(t->skip)
+	{
+		LOG(LOG_WARNING, "%s: skipping recipe '%s' because a recipe it requires failed\n", run->job->name, t->recipe->name);
+		t->failed = 1;
+	}
+	else if(t->failed)
+	{
+		LOG(LOG_ERR, "%s: failed to run recipe '%s': %s\n", run->job->name, t->recipe->name, strerror(errno));
+	}
+	else if(task_done(t))
+	{
+		LOG(LOG_INFO, "%s: recipe '%s' was completed before restarting\n", run->job->name, t->recipe->name);
+	}
+	else if(util_remove_tree(t->output) < 0)
+	{
+		/* A re-used container may hold the output of an earlier run,
+		 * which mustn't be written to in place: it may share its storage
+		 * with outputs elsewhere
+		 */
+		LOG(LOG_ERR, "%s: failed to remove previous output of recipe '%s': %s\n", run->job->name, t->recipe->name, strerror(errno));
+		t->failed = 1;
+	}
+	else if(t->cache && !cache_fetch(t->key, t->output))
+	{
+		LOG(LOG_INFO, "%s: using cached output of recipe '%s'\n", run->job->name, t->recipe->name);
+	}
+	else if(task_exec(t) < 0)
+	{
+		t->failed = 1;
+	}
+	else if(t->cache)
+	{
+		/* Failing to cache the output doesn't affect the job */
+		cache_store(t->key, t->output);
+	}
+	if(!t->failed && !task_done(t))
+	{
+		journal_record(run->job, JOURNAL_RECIPE, t->recipe->name, NULL);
+	}
+	if(t->failed)
+	{
+		__sync_add_and_fetch(&(run->failed), 1);
+	}
+	for(c = 0; c < t->ndependents; c++)
+	{
+		dep = &(run->tasks[t->dependents[c]]);
+		if(t->failed)
+		{
+			dep->skip = 1;
+		}
+		if(!__sync_sub_and_fetch(&(dep->pending), 1))
+		{
+			if(executor_submit(&(dep->task)) < 0)
+			{
+				LOG(LOG_ERR, "%s: failed to submit recipe '%s': %s\n", run->job->name, dep->recipe->name, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	if(!__sync_sub_and_fetch(&(run->remaining), 1))
+	{
+		run_finished(run);
+	}
+}
+
+/* Determine whether a recipe had already been run for a resumed job */
+static int
+task_done(RECIPE_TASK *t)
+{
+	size_t c;
+
+	for(c = 0; c < t->run->job->ndone; c++)
+	{
+		if(!strcmp(t->run->job->done[c], t->recipe->name))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Execute a recipe's command and wait for it to finish */
+static int
+task_exec(RECIPE_TASK *t)
+{
+	JOB *job;
+	char *cmd;
+	pid_t pid;
+	int status;
+	unsigned long long start;
+
+	job = t->run->job;
+	if(t->recipe->directory && t->recipe->create && mkdir(t->output, 0777) && errno != EEXIST)
+	{
+		LOG(LOG_ERR, "%s: %s: %s\n", job->name, t->output, strerror(errno));
+		return -1;
+	}
+	cmd = task_expand(t);
+	if(!cmd)
+	{
+		return -1;
+	}
+	LOG(LOG_INFO, "%s: running recipe '%s': %s\n", job->name, t->recipe->name, cmd);
+	stats_add(STAT_RECIPES_RUN, 1);
+	start = stats_clock();
+	pid = fork();
+	if(pid == -1)
+	{
+		LOG(LOG_ERR, "%s: failed to run recipe '%s': %s\n", job->name, t->recipe->name, strerror(errno));
+		free(cmd);
+		stats_add(STAT_RECIPES_FAILED, 1);
+		stats_add(STAT_ERRORS, 1);
+		return -1;
+	}
+	if(!pid)
+	{
+		execl("/bin/sh", "sh", "-c", cmd, (char *) NULL);
+		_exit(127);
+	}
+	free(cmd);
+	while(waitpid(pid, &status, 0) == -1)
+	{
+		if(errno != EINTR)
+		{
+			LOG(LOG_ERR, "%s: failed to wait for recipe '%s': %s\n", job->name, t->recipe->name, strerror(errno));
+			stats_add(STAT_RECIPES_FAILED, 1);
+			stats_add(STAT_ERRORS, 1);
+			return -1;
+		}
+	}
+	stats_time(t->recipe->stat, start);
+	TRACE(t->recipe->name, job->name, 0, start, 0);
+	if(!WIFEXITED(status) || WEXITSTATUS(status))
+	{
+		LOG(LOG_ERR, "%s: recipe '%s' failed (status %d)\n", job->name, t->recipe->name, (WIFEXITED(status) ? WEXITSTATUS(status) : -1));
+		stats_add(STAT_RECIPES_FAILED, 1);
+		stats_add(STAT_ERRORS, 1);
+		return -1;
+	}
+	LOG(LOG_INFO, "%s: recipe '%s' finished\n", job->name, t->recipe->name);
+	return 0;
+}
+
+/* Substitute variables into a recipe's command; values are quoted for the
+ * shell.
+ */
+static char *
+task_expand(RECIPE_TASK *t)
+{
+	const char *s, *e, *v;
+	char *buf, *p;
+	size_t len, alloc;
+
+	alloc = 0;
+	len = 0;
+	buf = NULL;
+	for(s = t->recipe->exec; ; s++)
+	{
+		v = NULL;
+		e = NULL;
+		if(s[0] == '$' && s[1] == '{' && (e = strchr(s, '}')))
+		{
+			v = task_variable(t, s + 2, e - s - 2);
+			if(!v)
+			{
+				LOG(LOG_ERR, "%s: recipe '%s': unknown variable '%.*s'\n", t->run->job->name, t->recipe->name, (int) (e - s + 1), s);
+				free(buf);
+				errno = EINVAL;
+				return NULL;
+			}
+		}
+		/* Ensure there is room for the next character, or the quoted value */
+		if(len + (v ? strlen(v) * 4 + 2 : 1) + 1 > alloc)
+		{
+			alloc = len + (v ? strlen(v) * 4 + 2 : 1) + 128;
+			p = (char *) realloc(buf, alloc);
+			if(!p)
+			{
+				free(buf);
+				return NULL;
+			}
+			buf = p;
+		}
+		if(!*s)
+		{
+			break;
+		}
+		if(!v)
+		{
+			buf[len] = *s;
+			len++;
+			continue;
+		}
+		buf[len] = '\'';
+		len++;
+		for(; *v; v++)
+		{
+			if(*v == '\'')
+			{
+				memcpy(&(buf[len]), "'\\''", 4);
+				len += 4;
+				continue;
+			}
+			buf[len] = *v;
+			len++;
+		}
+		buf[len] = '\'';
+		len++;
+		s = e;
+	}
+	buf[len] = 0;
+	return buf;
+}
+
+/* Return the value of a recipe variable */
+static const char *
+task_variable(RECIPE_TASK *t, const char *name, size_t len)
+{
+	JOB *job;
+	size_t c;
+
+	job = t->run->job;
+	if(len == 6 && !strncmp(name, "source", 6))
+	{
+		return (job->stored ? ASSET_PATH(job->stored) : ASSET_PATH(job->asset));
+	}
+	if(len == 6 && !strncmp(name, "output", 6))
+	{
+		return t->output;
+	}
+	if(len == 9 && !strncmp(name, "container", 9))
+	{
+		return ASSET_PATH(job->container);
+	}
+	if(len == 2 && !strncmp(name, "id", 2))
+	{
+		return job->id->canonical;
+	}
+	if(len == 4 && !strncmp(name, "type", 4))
+	{
+		return (job->stored && job->stored->type ? job->stored->type : job->asset->type)->name;
+	}
+	if(len > 7 && !strncmp(name, "output:", 7))
+	{
+		/* Only the outputs of required recipes are guaranteed to exist */
+		for(c = 0; c < t->recipe->nrequires; c++)
+		{
+			if(strlen(t->recipe->requires[c]) == len - 7 && !strncmp(t->recipe->requires[c], name + 7, len - 7))
+			{
+				break;
+			}
+		}
+		if(c == t->recipe->nrequires)
+		{
+			return NULL;
+		}
+		for(c = 0; c < t->run->ntasks; c++)
+		{
+			if(strlen(t->run->tasks[c].recipe->name) == len - 7 && !strncmp(t->run->tasks[c].recipe->name, name + 7, len - 7))
+			{
+				return t->run->tasks[c].output;
+			}
+		}
+		return NULL;
+	}
+	return NULL;
+}
+
+/* Every recipe for a job has finished */
+static void
+run_finished(RECIPE_RUN *run)
+{
+	JOB *job;
+
+	job = run->job;
+	if(run->failed)
+	{
+		LOG(LOG_WARNING, "%s: %lu of %lu recipe(s) failed\n", job->name, (unsigned long) run->failed, (unsigned long) run->ntasks);
+	}
+	run_free(run);
+	job_complete(job);
+}
+
+static void
+run_free(RECIPE_RUN *run)
+{
+	size_t c;
+
+	for(c = 0; c < run->ntasks; c++)
+	{
+		free(run->tasks[c].output);
+		free(run->tasks[c].deps);
+		free(run->tasks[c].dependents);
+	}
+	free(run->tasks);
+	pthread_mutex_destroy(&(run->lock));
+	free(run);
+}
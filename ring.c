@@ -0,0 +1,196 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_spool.h"
+
+/* Per-thread ring buffers, used by the logger and the tracer to let any
+ * thread record something without taking a lock.
+ *
+ * A RINGSET gives each thread which uses it a RING of its own, created
+ * on first use. Each ring has a single producer (its thread), which
+ * reserves a slot, fills it in and commits it, and a single consumer:
+ * whichever thread is draining the set, serialised by the set's
+ * drain_lock. A drain is bracketed by ring_drain_begin(), which returns
+ * the first ring of the set, and ring_drain_end(); in between, the rings
+ * may be walked via their next pointers, taking slots with ring_peek()
+ * and ring_consume().
+ *
+ * When a thread exits, its ring is marked dead, and freed by the first
+ * drain to find it empty.
+ */
+
+/* Internal utilities */
+static RING *ring_create(RINGSET *set);
+static void ring_release(void *ptr);
+
+/* Prepare a set of rings, each of which will have nslots slots of
+ * slotsize bytes
+ */
+int
+ring_init(RINGSET *set, size_t slotsize, size_t nslots)
+{
+	int r;
+
+	memset(set, 0, sizeof(RINGSET));
+	set->slotsize = slotsize;
+	set->nslots = nslots;
+	r = pthread_key_create(&(set->key), ring_release);
+	if(r)
+	{
+		errno = r;
+		return -1;
+	}
+	pthread_mutex_init(&(set->lock), NULL);
+	pthread_mutex_init(&(set->drain_lock), NULL);
+	return 0;
+}
+
+/* Return the next free slot in the calling thread's ring (creating the
+ * ring if needed), or NULL if the ring is full or couldn't be created;
+ * the slot isn't visible to the drain until ring_commit() is called
+ */
+void *
+ring_reserve(RINGSET *set, RING **ring)
+{
+	RING *p;
+
+	p = (RING *) pthread_getspecific(set->key);
+	if(!p)
+	{
+		p = ring_create(set);
+		if(!p)
+		{
+			return NULL;
+		}
+	}
+	*ring = p;
+	if(p->head - p->tail >= set->nslots)
+	{
+		return NULL;
+	}
+	return &(p->slots[(p->head % set->nslots) * set->slotsize]);
+}
+
+/* Make the slot returned by ring_reserve() visible to the drain,
+ * returning the number of slots now waiting to be drained
+ */
+size_t
+ring_commit(RING *ring)
+{
+	/* The slot must be complete before the drain can see it */
+	__sync_synchronize();
+	ring->head++;
+	return ring->head - ring->tail;
+}
+
+/* Begin draining a set, returning its first ring */
+RING *
+ring_drain_begin(RINGSET *set)
+{
+	RING *first;
+
+	pthread_mutex_lock(&(set->drain_lock));
+	pthread_mutex_lock(&(set->lock));
+	first = set->rings;
+	pthread_mutex_unlock(&(set->lock));
+	/* Rings are only added to the head of the list, and only removed
+	 * by ring_drain_end(), so the list from 'first' onwards is stable
+	 * until then
+	 */
+	return first;
+}
+
+/* Return the oldest slot in a ring, or NULL if it's empty */
+void *
+ring_peek(RINGSET *set, RING *ring)
+{
+	if(ring->tail == ring->head)
+	{
+		return NULL;
+	}
+	__sync_synchronize();
+	return &(ring->slots[(ring->tail % set->nslots) * set->slotsize]);
+}
+
+/* Release the slot returned by ring_peek() back to its thread */
+void
+ring_consume(RING *ring)
+{
+	__sync_synchronize();
+	ring->tail++;
+}
+
+/* Finish draining a set, freeing the rings of threads which have exited,
+ * now that they're empty
+ */
+void
+ring_drain_end(RINGSET *set)
+{
+	RING *ring, **prev;
+
+	pthread_mutex_lock(&(set->lock));
+	for(prev = &(set->rings); *prev; )
+	{
+		ring = *prev;
+		if(ring->dead && ring->tail == ring->head)
+		{
+			*prev = ring->next;
+			free(ring->slots);
+			free(ring);
+			continue;
+		}
+		prev = &(ring->next);
+	}
+	pthread_mutex_unlock(&(set->lock));
+	pthread_mutex_unlock(&(set->drain_lock));
+}
+
+static RING *
+ring_create(RINGSET *set)
+{
+	RING *ring;
+
+	ring = (RING *) calloc(1, sizeof(RING));
+	if(!ring)
+	{
+		return NULL;
+	}
+	ring->slots = (char *) malloc(set->nslots * set->slotsize);
+	if(!ring->slots)
+	{
+		free(ring);
+		return NULL;
+	}
+	pthread_setspecific(set->key, ring);
+	pthread_mutex_lock(&(set->lock));
+	set->nrings++;
+	ring->id = set->nrings;
+	ring->next = set->rings;
+	set->rings = ring;
+	pthread_mutex_unlock(&(set->lock));
+	return ring;
+}
+
+/* Called when a thread exits; the drain frees the ring once it's empty */
+static void
+ring_release(void *ptr)
+{
+	((RING *) ptr)->dead = 1;
+}
@@ -0,0 +1,229 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_spool.h"
+
+/* SHA-256, as specified by FIPS 180-4 */
+
+#define ROTR(x, n)                      (((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z)                     (((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z)                    (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define EP0(x)                          (ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define EP1(x)                          (ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define SIG0(x)                         (ROTR(x, 7) ^ ROTR(x, 18) ^ ((x) >> 3))
+#define SIG1(x)                         (ROTR(x, 17) ^ ROTR(x, 19) ^ ((x) >> 10))
+
+#define SHA256_READLEN                  65536
+
+static const uint32_t k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void transform(SHA256 *ctx, const unsigned char *block);
+
+void
+sha256_init(SHA256 *ctx)
+{
+	ctx->state[0] = 0x6a09e667;
+	ctx->state[1] = 0xbb67ae85;
+	ctx->state[2] = 0x3c6ef372;
+	ctx->state[3] = 0xa54ff53a;
+	ctx->state[4] = 0x510e527f;
+	ctx->state[5] = 0x9b05688c;
+	ctx->state[6] = 0x1f83d9ab;
+	ctx->state[7] = 0x5be0cd19;
+	ctx->count = 0;
+}
+
+void
+sha256_update(SHA256 *ctx, const void *data, size_t len)
+{
+	const unsigned char *p;
+	size_t used, n;
+
+	p = (const unsigned char *) data;
+	used = (size_t) (ctx->count % 64);
+	ctx->count += len;
+	if(used)
+	{
+		n = 64 - used;
+		if(n > len)
+		{
+			n = len;
+		}
+		memcpy(&(ctx->buf[used]), p, n);
+		p += n;
+		len -= n;
+		if(used + n < 64)
+		{
+			return;
+		}
+		transform(ctx, ctx->buf);
+	}
+	while(len >= 64)
+	{
+		transform(ctx, p);
+		p += 64;
+		len -= 64;
+	}
+	memcpy(ctx->buf, p, len);
+}
+
+void
+sha256_final(SHA256 *ctx, unsigned char *digest)
+{
+	unsigned char pad[72];
+	uint64_t bits;
+	size_t used, n, c;
+
+	bits = ctx->count * 8;
+	used = (size_t) (ctx->count % 64);
+	n = (used < 56 ? 56 - used : 120 - used);
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for(c = 0; c < 8; c++)
+	{
+		pad[n + c] = (unsigned char) (bits >> (56 - c * 8));
+	}
+	sha256_update(ctx, pad, n + 8);
+	for(c = 0; c < 8; c++)
+	{
+		digest[c * 4] = (unsigned char) (ctx->state[c] >> 24);
+		digest[c * 4 + 1] = (unsigned char) (ctx->state[c] >> 16);
+		digest[c * 4 + 2] = (unsigned char) (ctx->state[c] >> 8);
+		digest[c * 4 + 3] = (unsigned char) ctx->state[c];
+	}
+}
+
+/* Compute the digest of a file's contents */
+int
+sha256_file(const char *path, unsigned char *digest)
+{
+	SHA256 ctx;
+	unsigned char *buf;
+	ssize_t r;
+	int fd;
+
+	buf = (unsigned char *) malloc(SHA256_READLEN);
+	if(!buf)
+	{
+		return -1;
+	}
+	do
+	{
+		fd = open(path, O_RDONLY);
+	}
+	while(fd == -1 && errno == EINTR);
+	if(fd == -1)
+	{
+		free(buf);
+		return -1;
+	}
+	sha256_init(&ctx);
+	for(;;)
+	{
+		r = read(fd, buf, SHA256_READLEN);
+		if(r == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if(r <= 0)
+		{
+			break;
+		}
+		sha256_update(&ctx, buf, r);
+	}
+	close(fd);
+	free(buf);
+	if(r < 0)
+	{
+		return -1;
+	}
+	sha256_final(&ctx, digest);
+	return 0;
+}
+
+/* Format a digest as hex */
+void
+sha256_format(const unsigned char *digest, char *buf)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t c;
+
+	for(c = 0; c < SHA256_LEN; c++)
+	{
+		buf[c * 2] = hex[digest[c] >> 4];
+		buf[c * 2 + 1] = hex[digest[c] & 15];
+	}
+	buf[SHA256_LEN * 2] = 0;
+}
+
+static void
+transform(SHA256 *ctx, const unsigned char *block)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+	size_t i;
+
+	for(i = 0; i < 16; i++)
+	{
+		w[i] = ((uint32_t) block[i * 4] << 24) | ((uint32_t) block[i * 4 + 1] << 16) |
+			((uint32_t) block[i * 4 + 2] << 8) | (uint32_t) block[i * 4 + 3];
+	}
+	for(; i < 64; i++)
+	{
+		w[i] = SIG1(w[i - 2]) + w[i - 7] + SIG0(w[i - 15]) + w[i - 16];
+	}
+	a = ctx->state[0];
+	b = ctx->state[1];
+	c = ctx->state[2];
+	d = ctx->state[3];
+	e = ctx->state[4];
+	f = ctx->state[5];
+	g = ctx->state[6];
+	h = ctx->state[7];
+	for(i = 0; i < 64; i++)
+	{
+		t1 = h + EP1(e) + CH(e, f, g) + k[i] + w[i];
+		t2 = EP0(a) + MAJ(a, b, c);
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	ctx->state[0] += a;
+	ctx->state[1] += b;
+	ctx->state[2] += c;
+	ctx->state[3] += d;
+	ctx->state[4] += e;
+	ctx->state[5] += f;
+	ctx->state[6] += g;
+	ctx->state[7] += h;
+}
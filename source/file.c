@@ -22,6 +22,98 @@
 
 #include "p_spool.h"
 
+#ifdef HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
+#ifdef HAVE_SYS_SYSCALL_H
+# include <sys/syscall.h>
+#endif
+
+#define SNAPSHOT_BUFSIZE                65536
+#define NEGCACHE_SIZE                   65536
+#define QUARANTINE_GRACE                300
+
+#define SNAPSHOT_NAME(snap, ent)        (&((snap)->names[(ent)->name]))
+#ifdef DT_UNKNOWN
+# define SNAPSHOT_DTYPE(de)             ((de)->d_type)
+#else
+# define SNAPSHOT_DTYPE(de)             0
+#endif
+
+/* States of snapshot entries */
+#define ENT_UNKNOWN                     0
+#define ENT_SKIPPED                     1
+#define ENT_SIDECAR                     2
+#define ENT_COLLECTED                   3
+/* A sidecar which has been attached to a job */
+#define ENT_ATTACHED                    4
+
+/* A snapshot of the contents of the incoming directory */
+struct snapshot
+{
+	struct snapentry *entries;
+	size_t nentries;
+	size_t nalloc;
+	/* All of the entries' names, each nul-terminated */
+	char *names;
+	size_t nameslen;
+	size_t namesalloc;
+	/* Stem index */
+	size_t *buckets;
+	size_t nbuckets;
+	/* The next entry to be considered for collection */
+	size_t cursor;
+};
+
+struct snapentry
+{
+	/* Offset of the name within snapshot::names */
+	size_t name;
+	size_t len;
+	/* Length of the name up to the first '.' */
+	size_t stemlen;
+	/* Next entry in the same index chain (1-based), or zero */
+	size_t next;
+	int state;
+	/* Set if the file has been passed over for long enough that it
+	 * should be quarantined
+	 */
+	int due;
+};
+
+/* An entry in the negative cache: a file which was passed over, either
+ * because it couldn't be identified or because it's a sidecar, and which
+ * needn't be identified again unless it changes
+ */
+struct negentry
+{
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	/* ENT_SKIPPED or ENT_SIDECAR */
+	int state;
+	/* The type of a sidecar */
+	const MIMETYPE *type;
+	/* When the verdict was first reached */
+	time_t since;
+	/* The scan in which the file was last seen */
+	unsigned long gen;
+	int used;
+};
+
+#if defined(HAVE_SYS_SYSCALL_H) && defined(SYS_getdents64)
+/* The structure returned by getdents64() */
+struct snapdirent
+{
+	unsigned long long d_ino;
+	long long d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[1];
+};
+#endif
+
 struct source_struct
 {
 	/* Common to all source instances */
@@ -35,6 +127,37 @@ struct source_struct
 	size_t pendinglen;
 	char *complete;
 	size_t completelen;
+	/* The current directory snapshot, if any */
+	struct snapshot *snap;
+	/* Scratch asset used while identifying candidate files; jobs take
+	 * copies of it in their own arenas
+	 */
+	ASSET *scratch;
+	/* The negative cache, an open-addressed table keyed by device and
+	 * inode, which persists between scans
+	 */
+	struct negentry *neg;
+	size_t negslots;
+	size_t negcount;
+	size_t negmax;
+	unsigned long neggen;
+	/* Directory passed-over files are moved to once they have been
+	 * passed over for more than 'grace' seconds, if any
+	 */
+	char *quarantine;
+	size_t quarantinelen;
+	int grace;
+#ifdef HAVE_SYS_INOTIFY_H
+	/* Change notification descriptor, or -1 if polling */
+	int notifyfd;
+	/* Set if the whole directory must be scanned */
+	int rescan;
+	/* Names of files we've been notified about */
+	char **names;
+	size_t nnames;
+	size_t nextname;
+	size_t namesalloc;
+#endif
 };
 
 /* Source API methods */
@@ -42,24 +165,51 @@ static JOB *file_collect(SOURCE *me);
 static int file_begin(SOURCE *me, JOB *job);
 static int file_abort(SOURCE *me, JOB *job);
 static int file_complete(SOURCE *me, JOB *job);
+static int file_wait(SOURCE *me);
+static JOB *file_resume(SOURCE *me, const char *name);
+static int file_collect_batch(SOURCE *me, JOB **jobs, size_t max);
 
 /* Source API method table */
 static SOURCE_API file_api = {
 	file_collect,
 	file_begin,
 	file_abort,
-	file_complete
+	file_complete,
+	file_wait,
+	file_resume,
+	file_collect_batch
 };
 
 /* Internal utilities */
-static const char *basename(const char *filepath);
+static JOB *collect_scan(SOURCE *me);
+static int collect_name(SOURCE *me, const char *name, ASSET **asset, JOB **job, time_t *since);
+static int findsidecar(SOURCE *me, JOB *job);
+static int identify_cached(SOURCE *me, ASSET *asset, time_t *since);
+static struct negentry *neg_lookup(SOURCE *me, const struct stat *sbuf);
+static int neg_add(SOURCE *me, const struct stat *sbuf, int state, const MIMETYPE *type);
+static int neg_rehash(SOURCE *me, size_t nslots, int purge);
+static void neg_purge(SOURCE *me);
+static size_t neg_hash(dev_t dev, ino_t ino);
+static void quarantine_snapshot(SOURCE *me);
+static struct snapshot *snapshot_create(const char *path);
+static void snapshot_free(struct snapshot *snap);
+static int snapshot_add(struct snapshot *snap, int dirfd, const char *name, int type);
+static int snapshot_index(struct snapshot *snap);
+static size_t snapshot_lookup(struct snapshot *snap, const char *stem, size_t stemlen);
+#ifdef HAVE_SYS_INOTIFY_H
+static JOB *collect_notified(SOURCE *me);
+static int notify_read(SOURCE *me);
+static void notify_reset(SOURCE *me);
+#endif
 static int movetodest(JOB *job, const char *destdir, size_t destlen, int updatepaths);
+static int moveasset(JOB *job, ASSET *asset, const char *destdir, size_t destlen, int updatepaths);
 
 /* Construct a new source instance for the 'file' handler */
 SOURCE *
 file_create(void)
 {
 	SOURCE *p;
+	const char *s;
 
 	p = (SOURCE *) calloc(1, sizeof(SOURCE));
 	if(!p)
@@ -71,12 +221,15 @@ file_create(void)
 	p->aborted = strdup(config_get("file:failed", "failed"));
 	p->pending = strdup(config_get("file:pending", "pending"));
 	p->complete = strdup(config_get("file:complete", "complete"));
-	if(!p->incoming || !p->aborted || !p->pending || !p->complete)
+	s = config_get("file:quarantine", NULL);
+	p->quarantine = (s ? strdup(s) : NULL);
+	if(!p->incoming || !p->aborted || !p->pending || !p->complete || (s && !p->quarantine))
 	{
 		free(p->incoming);
 		free(p->aborted);
 		free(p->pending);
 		free(p->complete);
+		free(p->quarantine);
 		free(p);
 		return NULL;
 	}
@@ -84,145 +237,880 @@ file_create(void)
 	p->abortedlen = strlen(p->aborted);
 	p->pendinglen = strlen(p->pending);
 	p->completelen = strlen(p->complete);
+	p->negmax = config_get_int("file:negcache", NEGCACHE_SIZE);
+	if(p->quarantine)
+	{
+		p->quarantinelen = strlen(p->quarantine);
+		p->grace = config_get_int("file:grace", QUARANTINE_GRACE);
+	}
+#ifdef HAVE_SYS_INOTIFY_H
+	/* Always scan the directory at startup */
+	p->rescan = 1;
+	p->notifyfd = -1;
+	if(config_get_int("file:notify", 1))
+	{
+		p->notifyfd = inotify_init();
+		if(p->notifyfd == -1 ||
+		   inotify_add_watch(p->notifyfd, p->incoming, IN_CLOSE_WRITE|IN_MOVED_TO) == -1)
+		{
+			LOG(LOG_WARNING, "%s: unable to watch for changes, falling back to polling: %s\n", p->incoming, strerror(errno));
+			if(p->notifyfd != -1)
+			{
+				close(p->notifyfd);
+			}
+			p->notifyfd = -1;
+		}
+	}
+#endif
 	return p;
 }
 
-/* Collect a job by scanning a source directory */
+/* Collect a job from the source directory. If change notifications are
+ * available, only the files we have been told about are considered;
+ * otherwise (or at startup, or if notifications have been lost) the whole
+ * directory is scanned.
+ */
 static JOB *
 file_collect(SOURCE *me)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	if(me->notifyfd != -1 && !me->rescan)
+	{
+		return collect_notified(me);
+	}
+#endif
+	return collect_scan(me);
+}
+
+/* Collect up to max jobs from the source directory. All of them come from
+ * the same snapshot (or list of notified files), and the batch ends early
+ * once that has been exhausted rather than scanning the directory again.
+ */
+static int
+file_collect_batch(SOURCE *me, JOB **jobs, size_t max)
+{
+	size_t n;
+
+	for(n = 0; n < max; n++)
+	{
+		errno = 0;
+		jobs[n] = file_collect(me);
+		if(!jobs[n])
+		{
+			if(!n && errno)
+			{
+				return -1;
+			}
+			break;
+		}
+	}
+	return (int) n;
+}
+
+/* Wait until there might be something new to collect */
+static int
+file_wait(SOURCE *me)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	if(me->notifyfd != -1)
+	{
+		return notify_read(me);
+	}
+#endif
+	(void) me;
+
+	sleep(1);
+	return 0;
+}
+
+/* Collect a job by scanning a source directory. The directory is read once
+ * into a snapshot, which is then worked through by successive calls until
+ * it has been exhausted, so that draining a backlog doesn't involve
+ * re-reading the directory for every job.
+ */
+static JOB *
+collect_scan(SOURCE *me)
 {
 	JOB *job;
-	ASSET *asset;
-	DIR *dir;
-	struct dirent *de;
-	const char *srcdir;
-	size_t srclen, sl, bl;
+	struct snapentry *ent;
+	time_t since, now;
 	int r;
 	
-	srcdir = me->incoming;
-	srclen = me->incominglen;
-	dir = opendir(srcdir);
-	if(!dir)
+	if(!me->snap)
 	{
-		fprintf(stderr, "%s: %s: %s\n", short_program_name, srcdir, strerror(errno));
-		return NULL;
+		me->snap = snapshot_create(me->incoming);
+		if(!me->snap)
+		{
+			LOG(LOG_ERR, "%s: %s\n", me->incoming, strerror(errno));
+			return NULL;
+		}
 	}
-	asset = NULL;
 	job = NULL;
-	for(;;)
+	now = time(NULL);
+	while(me->snap->cursor < me->snap->nentries)
 	{
-		de = readdir(dir);
-		if(!de)
+		ent = &(me->snap->entries[me->snap->cursor]);
+		me->snap->cursor++;
+		if(ent->state != ENT_UNKNOWN)
 		{
-			break;
+			/* Already identified while looking for a sidecar */
+			continue;
 		}
-		if(de->d_name[0] == '.')
+		r = collect_name(me, SNAPSHOT_NAME(me->snap, ent), &(me->scratch), &job, &since);
+		if(r < 0)
 		{
-			continue;
+			return NULL;
 		}
-		if(asset)
+		ent->state = r;
+		if(me->quarantine && since && now - since >= me->grace)
 		{
-			asset_reset(asset);
+			ent->due = 1;
 		}
-		else
+		if(r == ENT_COLLECTED)
 		{
-			asset = asset_create();
-			if(!asset)
-			{
-				return NULL;
-			}
+			break;
 		}
-		asset_set_path_basedir(asset, srcdir, srclen, de->d_name);
-		r = type_identify_asset(asset);
+	}
+	if(!job)
+	{
+		/* Anything which wasn't seen during this scan has gone away */
+		quarantine_snapshot(me);
+		neg_purge(me);
+		snapshot_free(me->snap);
+		me->snap = NULL;
+#ifdef HAVE_SYS_INOTIFY_H
+		/* The scan has caught up with everything, including anything we
+		 * have been notified about in the meantime.
+		 */
+		me->rescan = 0;
+		notify_reset(me);
+#endif
+	}
+	return job;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* Collect a job from the list of files we've been notified about */
+static JOB *
+collect_notified(SOURCE *me)
+{
+	JOB *job;
+	char *name;
+	int r;
+
+	job = NULL;
+	while(me->nextname < me->nnames)
+	{
+		name = me->names[me->nextname];
+		me->names[me->nextname] = NULL;
+		me->nextname++;
+		r = collect_name(me, name, &(me->scratch), &job, NULL);
+		free(name);
 		if(r < 0)
 		{
-			fprintf(stderr, "%s: failed to identify asset '%s': %s\n", short_program_name, de->d_name, strerror(errno));
-			asset_free(asset);
-			closedir(dir);
 			return NULL;
 		}
-		if(r == 0)
+		if(r == ENT_COLLECTED)
 		{
-			continue;
+			break;
 		}
-		if(asset->sidecar)
+	}
+	if(me->nextname == me->nnames)
+	{
+		notify_reset(me);
+		/* Any snapshot taken to find sidecars is now stale */
+		snapshot_free(me->snap);
+		me->snap = NULL;
+	}
+	return job;
+}
+#endif
+
+/* Consider a single file in the source directory, creating a job if it's an
+ * asset which can be processed. *asset is a scratch asset which is
+ * re-used between calls. Returns ENT_COLLECTED if *job was set, ENT_SIDECAR
+ * or ENT_SKIPPED if the file was passed over, or -1 on error. If the file
+ * had already been passed over by an earlier scan, *since (if since is
+ * non-NULL) is set to when that happened, and otherwise to zero.
+ */
+static int
+collect_name(SOURCE *me, const char *name, ASSET **asset, JOB **job, time_t *since)
+{
+	ASSET *copy;
+	int r;
+
+	if(*asset)
+	{
+		asset_reset(*asset);
+	}
+	else
+	{
+		*asset = asset_create();
+		if(!*asset)
+		{
+			return -1;
+		}
+	}
+	asset_set_path_basedir(*asset, me->incoming, me->incominglen, name);
+	r = identify_cached(me, *asset, since);
+	if(r != ENT_UNKNOWN)
+	{
+		return r;
+	}
+	*job = job_create(name, me);
+	if(!*job)
+	{
+		return -1;
+	}
+	/* The job takes a copy of the scratch asset in its own arena */
+	copy = asset_copy((*job)->arena, *asset);
+	if(!copy || job_set_source_asset(*job, copy) < 0)
+	{
+		job_free(*job);
+		*job = NULL;
+		return -1;
+	}
+	if(findsidecar(me, *job) < 0)
+	{
+		job_free(*job);
+		*job = NULL;
+		return -1;
+	}
+	return ENT_COLLECTED;
+}
+
+/* Look for a sidecar matching a job's source asset. A sidecar's name
+ * begins with either the asset's whole filename or its filename less the
+ * extension, followed by a '.'; either way, it shares the asset's stem
+ * (the part of the name before the first '.'), and so only the snapshot
+ * entries indexed under that stem need to be considered.
+ */
+static int
+findsidecar(SOURCE *me, JOB *job)
+{
+	ASSET *asset, *copy;
+	struct snapentry *ent;
+	const char *basename, *name;
+	size_t bl, stemlen, i;
+	int r;
+
+	if(!me->snap)
+	{
+		me->snap = snapshot_create(me->incoming);
+		if(!me->snap)
+		{
+			LOG(LOG_ERR, "%s: %s\n", me->incoming, strerror(errno));
+			return -1;
+		}
+	}
+	basename = ASSET_BASENAME(job->asset);
+	bl = job->asset->ext - job->asset->basename;
+	stemlen = strcspn(basename, ".");
+	for(i = snapshot_lookup(me->snap, basename, stemlen); i; i = ent->next)
+	{
+		ent = &(me->snap->entries[i - 1]);
+		/* A sidecar which another asset has claimed will be moved along
+		 * with it
+		 */
+		if(ent->state != ENT_UNKNOWN && ent->state != ENT_SIDECAR)
 		{
 			continue;
 		}
-		job = job_create(de->d_name, me);
-		if(!job)
+		name = SNAPSHOT_NAME(me->snap, ent);
+		/* Candidate filename begins with the asset filename (less its
+		 * extension) followed by a '.'
+		 */
+		if(ent->len <= bl ||
+		   strncmp(name, basename, bl) ||
+		   name[bl] != '.' ||
+		   !strcmp(name, basename))
 		{
-			asset_free(asset);
-			closedir(dir);
-			return NULL;
+			continue;
 		}
-		job_set_source_asset(job, asset);
-		/* Look for a matching sidecar */
-		asset = asset_create();
-		if(!asset)
+		if(me->scratch)
 		{
-			return NULL;
+			asset_reset(me->scratch);
 		}
-		rewinddir(dir);
-		sl = strlen(job->asset->basename);
-		bl = sl - strlen(job->asset->ext);
-		for(;;)
+		else
 		{
-			de = readdir(dir);
-			if(!de)
-			{
-				break;
-			}
-			if(de->d_name[0] == '.')
-			{
-				continue;
-			}
-			if(strlen(de->d_name) > sl &&
-			   !strncmp(de->d_name, job->asset->basename, sl) &&
-			   de->d_name[sl] == '.')
-			{
-				asset_reset(asset);
-				/* Candidate filename begins with the asset filename */
-				asset_set_path_basedir(asset, srcdir, srclen, de->d_name);
-			}
-			else if(strlen(de->d_name) > bl &&
-					!strncmp(de->d_name, job->asset->basename, bl) &&
-					strcmp(de->d_name, job->asset->basename) &&
-					de->d_name[bl] == '.')
+			me->scratch = asset_create();
+			if(!me->scratch)
 			{
-				asset_reset(asset);
-				/* Candidate filename begins with the asset filename */
-				asset_set_path_basedir(asset, srcdir, srclen, de->d_name);
+				return -1;
 			}
-			else
+		}
+		asset = me->scratch;
+		asset_set_path_basedir(asset, me->incoming, me->incominglen, name);
+		r = identify_cached(me, asset, NULL);
+		if(r < 0)
+		{
+			return -1;
+		}
+		if(r == ENT_SKIPPED)
+		{
+			ent->state = ENT_SKIPPED;
+			continue;
+		}
+		if(r == ENT_SIDECAR)
+		{
+			copy = asset_copy(job->arena, asset);
+			if(!copy || job_set_sidecar(job, copy) < 0)
 			{
-				continue;
+				return -1;
 			}
-			r = type_identify_asset(asset);
-			if(r < 0)
+			ent->state = ENT_ATTACHED;
+			break;
+		}
+	}
+	return 0;
+}
+
+/* Identify a candidate file, consulting the negative cache first so that
+ * a file which has already been passed over isn't identified again unless
+ * it changes. Returns ENT_SKIPPED if the file has gone away or can't be
+ * identified, ENT_SIDECAR if it's a sidecar, ENT_UNKNOWN if it's an asset
+ * which can be collected, or -1 on error. If since is non-NULL, it's set
+ * to when a cached verdict was first reached, or to zero.
+ */
+static int
+identify_cached(SOURCE *me, ASSET *asset, time_t *since)
+{
+	struct stat sbuf;
+	struct negentry *neg;
+	int r;
+
+	if(since)
+	{
+		*since = 0;
+	}
+	if(stat(ASSET_PATH(asset), &sbuf))
+	{
+		/* Already collected, or gone away; this isn't an error */
+		errno = 0;
+		return ENT_SKIPPED;
+	}
+	neg = neg_lookup(me, &sbuf);
+	if(neg)
+	{
+		neg->gen = me->neggen;
+		if(since)
+		{
+			*since = neg->since;
+		}
+		if(neg->state == ENT_SIDECAR)
+		{
+			asset_set_type(asset, neg->type);
+			asset->sidecar = 1;
+		}
+		return neg->state;
+	}
+	r = type_identify_asset(asset);
+	if(r < 0)
+	{
+		LOG(LOG_ERR, "failed to identify asset '%s': %s\n", ASSET_BASENAME(asset), strerror(errno));
+		return -1;
+	}
+	if(r && !asset->sidecar)
+	{
+		return ENT_UNKNOWN;
+	}
+	r = (r ? ENT_SIDECAR : ENT_SKIPPED);
+	if(neg_add(me, &sbuf, r, asset->type) < 0)
+	{
+		return -1;
+	}
+	return r;
+}
+
+/* Find the negative cache entry for a file, provided that the file hasn't
+ * changed since the entry was added
+ */
+static struct negentry *
+neg_lookup(SOURCE *me, const struct stat *sbuf)
+{
+	struct negentry *neg;
+	size_t h;
+
+	if(!me->negslots)
+	{
+		return NULL;
+	}
+	h = neg_hash(sbuf->st_dev, sbuf->st_ino) & (me->negslots - 1);
+	while(me->neg[h].used)
+	{
+		neg = &(me->neg[h]);
+		if(neg->dev == sbuf->st_dev && neg->ino == sbuf->st_ino)
+		{
+			if(neg->size != sbuf->st_size || neg->mtime != sbuf->st_mtime)
 			{
-				fprintf(stderr, "%s: failed to identify asset '%s': %s\n", short_program_name, de->d_name, strerror(errno));
-				asset_free(asset);
-				closedir(dir);
 				return NULL;
 			}
-			if(r == 0)
-			{
-				continue;
-			}
-			if(asset->sidecar)
+			return neg;
+		}
+		h = (h + 1) & (me->negslots - 1);
+	}
+	return NULL;
+}
+
+/* Add a file to the negative cache, replacing any existing entry for it */
+static int
+neg_add(SOURCE *me, const struct stat *sbuf, int state, const MIMETYPE *type)
+{
+	struct negentry *neg;
+	size_t h;
+
+	if(!me->negmax)
+	{
+		return 0;
+	}
+	if(me->negcount >= me->negmax)
+	{
+		/* Rather than track which entries are least useful, start over */
+		LOG(LOG_DEBUG, "%s: negative cache is full; discarding it\n", me->incoming);
+		memset(me->neg, 0, me->negslots * sizeof(struct negentry));
+		me->negcount = 0;
+	}
+	if((me->negcount + 1) * 2 > me->negslots &&
+	   neg_rehash(me, (me->negslots ? me->negslots * 2 : 64), 0) < 0)
+	{
+		return -1;
+	}
+	h = neg_hash(sbuf->st_dev, sbuf->st_ino) & (me->negslots - 1);
+	while(me->neg[h].used &&
+		  (me->neg[h].dev != sbuf->st_dev || me->neg[h].ino != sbuf->st_ino))
+	{
+		h = (h + 1) & (me->negslots - 1);
+	}
+	neg = &(me->neg[h]);
+	if(!neg->used)
+	{
+		me->negcount++;
+	}
+	neg->dev = sbuf->st_dev;
+	neg->ino = sbuf->st_ino;
+	neg->size = sbuf->st_size;
+	neg->mtime = sbuf->st_mtime;
+	neg->state = state;
+	neg->type = type;
+	neg->since = time(NULL);
+	neg->gen = me->neggen;
+	neg->used = 1;
+	return 0;
+}
+
+/* Re-build the negative cache with a new number of slots (which must be
+ * a power of two), dropping the entries which weren't seen during the
+ * current scan if purge is set
+ */
+static int
+neg_rehash(SOURCE *me, size_t nslots, int purge)
+{
+	struct negentry *old;
+	size_t oldslots, c, h;
+
+	old = me->neg;
+	oldslots = me->negslots;
+	me->neg = (struct negentry *) calloc(nslots, sizeof(struct negentry));
+	if(!me->neg)
+	{
+		me->neg = old;
+		return -1;
+	}
+	me->negslots = nslots;
+	me->negcount = 0;
+	for(c = 0; c < oldslots; c++)
+	{
+		if(!old[c].used || (purge && old[c].gen != me->neggen))
+		{
+			continue;
+		}
+		h = neg_hash(old[c].dev, old[c].ino) & (nslots - 1);
+		while(me->neg[h].used)
+		{
+			h = (h + 1) & (nslots - 1);
+		}
+		me->neg[h] = old[c];
+		me->negcount++;
+	}
+	free(old);
+	return 0;
+}
+
+/* Drop the negative cache entries for files which weren't seen during the
+ * scan which has just finished, and begin a new one
+ */
+static void
+neg_purge(SOURCE *me)
+{
+	if(me->negcount)
+	{
+		/* If this fails, the entries will be dropped after the next scan */
+		neg_rehash(me, me->negslots, 1);
+	}
+	me->neggen++;
+}
+
+/* Hash the device and inode numbers of a file */
+static size_t
+neg_hash(dev_t dev, ino_t ino)
+{
+	unsigned char key[sizeof(ino_t) + sizeof(dev_t)];
+
+	memcpy(key, &ino, sizeof(ino));
+	memcpy(&(key[sizeof(ino)]), &dev, sizeof(dev));
+	return (size_t) util_hash(key, sizeof(key));
+}
+
+/* Once a scan has finished, move the files it passed over which were
+ * already due to be quarantined into the quarantine directory. A sidecar
+ * is only quarantined if none of the assets collected during the scan
+ * claimed it.
+ */
+static void
+quarantine_snapshot(SOURCE *me)
+{
+	struct snapentry *ent;
+	const char *name;
+	char *src, *dest;
+	size_t c;
+
+	if(!me->quarantine || !me->snap)
+	{
+		return;
+	}
+	for(c = 0; c < me->snap->nentries; c++)
+	{
+		ent = &(me->snap->entries[c]);
+		if(!ent->due || (ent->state != ENT_SKIPPED && ent->state != ENT_SIDECAR))
+		{
+			continue;
+		}
+		name = SNAPSHOT_NAME(me->snap, ent);
+		src = (char *) malloc(me->incominglen + ent->len + 2);
+		dest = (char *) malloc(me->quarantinelen + ent->len + 2);
+		if(!src || !dest)
+		{
+			LOG(LOG_ERR, "%s: %s\n", me->incoming, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		strcpy(src, me->incoming);
+		src[me->incominglen] = '/';
+		strcpy(&(src[me->incominglen + 1]), name);
+		strcpy(dest, me->quarantine);
+		dest[me->quarantinelen] = '/';
+		strcpy(&(dest[me->quarantinelen + 1]), name);
+		if(rename(src, dest))
+		{
+			LOG(LOG_WARNING, "failed to move '%s' to '%s': %s\n", src, dest, strerror(errno));
+		}
+		else
+		{
+			LOG(LOG_NOTICE, "%s: %s has been passed over for more than %ds; moved to '%s'\n", name, (ent->state == ENT_SIDECAR ? "orphaned sidecar" : "unidentifiable file"), me->grace, dest);
+		}
+		free(src);
+		free(dest);
+	}
+}
+
+/* Read the contents of a directory into a new snapshot, skipping hidden
+ * files and anything which isn't a regular file, and index it by stem
+ */
+static struct snapshot *
+snapshot_create(const char *path)
+{
+	struct snapshot *snap;
+#if defined(HAVE_SYS_SYSCALL_H) && defined(SYS_getdents64)
+	struct snapdirent *de;
+	char *buf;
+	long r, c;
+#else
+	DIR *dir;
+	struct dirent *de;
+#endif
+	int fd, e;
+
+	snap = (struct snapshot *) calloc(1, sizeof(struct snapshot));
+	if(!snap)
+	{
+		return NULL;
+	}
+#if defined(HAVE_SYS_SYSCALL_H) && defined(SYS_getdents64)
+	/* Read the directory in large chunks, straight from the kernel */
+	buf = (char *) malloc(SNAPSHOT_BUFSIZE);
+	if(!buf)
+	{
+		free(snap);
+		return NULL;
+	}
+	do
+	{
+		fd = open(path, O_RDONLY|O_DIRECTORY);
+	}
+	while(fd == -1 && errno == EINTR);
+	if(fd == -1)
+	{
+		e = errno;
+		free(buf);
+		free(snap);
+		errno = e;
+		return NULL;
+	}
+	for(;;)
+	{
+		r = syscall(SYS_getdents64, fd, buf, SNAPSHOT_BUFSIZE);
+		if(r == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if(r <= 0)
+		{
+			break;
+		}
+		for(c = 0; c < r; c += de->d_reclen)
+		{
+			de = (struct snapdirent *) &(buf[c]);
+			if(snapshot_add(snap, fd, de->d_name, de->d_type) < 0)
 			{
-				job_set_sidecar(job, asset);
-				asset = NULL;
+				r = -1;
 				break;
 			}
 		}
-		break;
+		if(r < 0)
+		{
+			break;
+		}
+	}
+	e = errno;
+	close(fd);
+	free(buf);
+#else
+	dir = opendir(path);
+	if(!dir)
+	{
+		free(snap);
+		return NULL;
 	}
+	fd = dirfd(dir);
+	errno = 0;
+	while((de = readdir(dir)))
+	{
+		if(snapshot_add(snap, fd, de->d_name, SNAPSHOT_DTYPE(de)) < 0)
+		{
+			break;
+		}
+	}
+	e = errno;
 	closedir(dir);
-	asset_free(asset);
-	return job;
+#endif
+	if(e || snapshot_index(snap) < 0)
+	{
+		snapshot_free(snap);
+		errno = e;
+		return NULL;
+	}
+	return snap;
+}
+
+static void
+snapshot_free(struct snapshot *snap)
+{
+	if(!snap)
+	{
+		return;
+	}
+	free(snap->entries);
+	free(snap->names);
+	free(snap->buckets);
+	free(snap);
+}
+
+/* Add a directory entry to a snapshot, if it's a candidate for collection.
+ * The entry's type is used when the filesystem provides it, so that most
+ * entries can be accepted or skipped without stat()ing them.
+ */
+static int
+snapshot_add(struct snapshot *snap, int dirfd, const char *name, int type)
+{
+	struct snapentry *ent;
+	struct stat sbuf;
+	size_t len, n;
+	char *p;
+
+	if(name[0] == '.')
+	{
+		return 0;
+	}
+#ifdef DT_UNKNOWN
+	if(type != DT_REG)
+	{
+		if(type != DT_UNKNOWN && type != DT_LNK)
+		{
+			return 0;
+		}
+		if(fstatat(dirfd, name, &sbuf, 0) || !S_ISREG(sbuf.st_mode))
+		{
+			return 0;
+		}
+	}
+#else
+	(void) type;
+
+	if(fstatat(dirfd, name, &sbuf, 0) || !S_ISREG(sbuf.st_mode))
+	{
+		return 0;
+	}
+#endif
+	len = strlen(name);
+	/* Both arrays grow geometrically, so that reading a large directory
+	 * involves few reallocations
+	 */
+	if(snap->nentries == snap->nalloc)
+	{
+		n = (snap->nalloc ? snap->nalloc * 2 : 256);
+		ent = (struct snapentry *) realloc(snap->entries, n * sizeof(struct snapentry));
+		if(!ent)
+		{
+			return -1;
+		}
+		snap->entries = ent;
+		snap->nalloc = n;
+	}
+	if(snap->nameslen + len + 1 > snap->namesalloc)
+	{
+		n = snap->namesalloc * 2 + len + 1 + 8192;
+		p = (char *) realloc(snap->names, n);
+		if(!p)
+		{
+			return -1;
+		}
+		snap->names = p;
+		snap->namesalloc = n;
+	}
+	ent = &(snap->entries[snap->nentries]);
+	ent->name = snap->nameslen;
+	ent->len = len;
+	ent->stemlen = strcspn(name, ".");
+	ent->next = 0;
+	ent->state = ENT_UNKNOWN;
+	ent->due = 0;
+	memcpy(&(snap->names[snap->nameslen]), name, len + 1);
+	snap->nameslen += len + 1;
+	snap->nentries++;
+	return 0;
+}
+
+/* Build the stem index of a snapshot */
+static int
+snapshot_index(struct snapshot *snap)
+{
+	struct snapentry *ent;
+	size_t c, h;
+
+	snap->nbuckets = 64;
+	while(snap->nbuckets < snap->nentries * 2)
+	{
+		snap->nbuckets <<= 1;
+	}
+	snap->buckets = (size_t *) calloc(snap->nbuckets, sizeof(size_t));
+	if(!snap->buckets)
+	{
+		return -1;
+	}
+	/* Insert in reverse so that each chain is in directory order */
+	for(c = snap->nentries; c > 0; c--)
+	{
+		ent = &(snap->entries[c - 1]);
+		h = util_hash(SNAPSHOT_NAME(snap, ent), ent->stemlen) & (snap->nbuckets - 1);
+		ent->next = snap->buckets[h];
+		snap->buckets[h] = c;
+	}
+	return 0;
+}
+
+/* Return the (1-based) index of the first entry in the chain for a stem,
+ * or zero if there are none. The chain may include entries with other
+ * stems which happen to share the same hash.
+ */
+static size_t
+snapshot_lookup(struct snapshot *snap, const char *stem, size_t stemlen)
+{
+	return snap->buckets[util_hash(stem, stemlen) & (snap->nbuckets - 1)];
+}
+
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* Block until change notifications arrive for the source directory, and
+ * add the names of the files concerned to the list of candidates
+ */
+static int
+notify_read(SOURCE *me)
+{
+	union
+	{
+		struct inotify_event ev;
+		char buf[4096];
+	} u;
+	struct inotify_event *ev;
+	ssize_t r, c;
+	char **p;
+
+	do
+	{
+		r = read(me->notifyfd, u.buf, sizeof(u.buf));
+	}
+	while(r == -1 && errno == EINTR);
+	if(r == -1)
+	{
+		return -1;
+	}
+	for(c = 0; c < r; c += sizeof(struct inotify_event) + ev->len)
+	{
+		ev = (struct inotify_event *) &(u.buf[c]);
+		if(ev->mask & IN_Q_OVERFLOW)
+		{
+			/* Events have been lost, so fall back to a full scan */
+			LOG(LOG_WARNING, "%s: change notification queue overflowed; rescanning\n", me->incoming);
+			me->rescan = 1;
+			continue;
+		}
+		if(!ev->len || ev->name[0] == '.' || me->rescan)
+		{
+			continue;
+		}
+		if(me->nnames == me->namesalloc)
+		{
+			p = (char **) realloc(me->names, (me->namesalloc + 32) * sizeof(char *));
+			if(!p)
+			{
+				return -1;
+			}
+			me->names = p;
+			me->namesalloc += 32;
+		}
+		me->names[me->nnames] = strdup(ev->name);
+		if(!me->names[me->nnames])
+		{
+			return -1;
+		}
+		me->nnames++;
+	}
+	return 0;
+}
+
+/* Discard the list of notified files */
+static void
+notify_reset(SOURCE *me)
+{
+	size_t c;
+
+	for(c = me->nextname; c < me->nnames; c++)
+	{
+		free(me->names[c]);
+	}
+	me->nnames = 0;
+	me->nextname = 0;
 }
+#endif
 
 /* Abort a job */
 static int
@@ -242,81 +1130,102 @@ file_begin(SOURCE *me, JOB *job)
 static int
 file_complete(SOURCE *me, JOB *job)
 {
+	if(access(ASSET_PATH(job->asset), F_OK) && errno == ENOENT)
+	{
+		/* The asset was moved into storage when it was ingested; so
+		 * will its sidecar have been, unless that had to be copied
+		 */
+		if(job->sidecar && !access(ASSET_PATH(job->sidecar), F_OK))
+		{
+			return moveasset(job, job->sidecar, me->complete, me->completelen, 0);
+		}
+		return 0;
+	}
 	return movetodest(job, me->complete, me->completelen, 0);
 }
 
-static const char *
-basename(const char *filepath)
+/* Re-create a job which had been moved to 'pending' before a restart; the
+ * caller determines whether the asset is still there, and identifies it
+ * (from the stored copy, if it has been stored)
+ */
+static JOB *
+file_resume(SOURCE *me, const char *name)
 {
-	const char *t;
-	
-	t = strrchr(filepath, '/');
-	if(t)
+	ASSET *asset;
+	JOB *job;
+
+	asset = asset_create();
+	if(!asset)
 	{
-		return t + 1;
+		return NULL;
 	}
-	return filepath;
+	asset_set_path_basedir(asset, me->pending, me->pendinglen, name);
+	job = job_create(name, me);
+	if(!job)
+	{
+		asset_free(asset);
+		return NULL;
+	}
+	job_set_source_asset(job, asset);
+	return job;
 }
 
+/* Move a job's asset, and its sidecar if it has one, into destdir,
+ * updating their paths if updatepaths is set. A sidecar travels with
+ * the asset it was claimed by, so that it isn't left behind in the
+ * incoming directory to be quarantined as an orphan.
+ */
 static int
 movetodest(JOB *job, const char *destdir, size_t destlen, int updatepaths)
 {
-	const char *t, *st;
-	char *fn;
-	size_t l, sl;
-
-	t = basename(job->asset->path);
-	l = strlen(t);
-	if(job->sidecar)
+	if(moveasset(job, job->asset, destdir, destlen, updatepaths) < 0)
 	{
-		st = basename(job->sidecar->path);
-		sl = strlen(st);
-		if(sl > l)
-		{
-			l = sl;
-		}
+		return -1;
 	}
-	else
+	if(!job->sidecar)
 	{
-		st = NULL;
+		return 0;
 	}
+	if(access(ASSET_PATH(job->sidecar), F_OK) && errno == ENOENT)
+	{
+		/* Claimed by another job (e.g., one collected before a rescan) */
+		LOG(LOG_WARNING, "%s: sidecar '%s' has gone away\n", job->name, ASSET_PATH(job->sidecar));
+		asset_free(job->sidecar);
+		job->sidecar = NULL;
+		return 0;
+	}
+	return moveasset(job, job->sidecar, destdir, destlen, updatepaths);
+}
+
+static int
+moveasset(JOB *job, ASSET *asset, const char *destdir, size_t destlen, int updatepaths)
+{
+	const char *t;
+	char *fn;
+	size_t l;
+
+	t = ASSET_BASENAME(asset);
+	l = strlen(t);
 	fn = (char *) malloc(destlen + l + 2);
 	if(!fn)
 	{
-		fprintf(stderr, "%s: %s: %s\n", short_program_name, job->name, strerror(errno));
+		LOG(LOG_ERR, "%s: %s\n", job->name, strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 	strcpy(fn, destdir);
 	fn[destlen] = '/';
 	strcpy(&(fn[destlen + 1]), t);
-	fprintf(stderr, "%s: %s: moving '%s' to '%s'\n", short_program_name, job->name, job->asset->path, fn);
-	if(rename(job->asset->path, fn))
+	LOG(LOG_DEBUG, "%s: moving '%s' to '%s'\n", job->name, ASSET_PATH(asset), fn);
+	if(rename(ASSET_PATH(asset), fn))
 	{
-		fprintf(stderr, "%s: %s: failed to move '%s' to '%s': %s\n", short_program_name, job->name, job->asset->path, fn, strerror(errno));
+		LOG(LOG_ERR, "%s: failed to move '%s' to '%s': %s\n", job->name, ASSET_PATH(asset), fn, strerror(errno));
 		free(fn);
 		return -1;
 	}
 	if(updatepaths)
 	{
-		asset_set_path(job->asset, fn);
+		asset_set_path(asset, fn);
 	}
-/*	if(job->sidecar)
-	{
-		strcpy(fn, destdir);
-		fn[destlen] = '/';
-		strcpy(&(fn[destlen + 1]), st);
-		fprintf(stderr, "%s: %s: moving '%s' to '%s'\n", short_program_name, job->name, job->sidecar, fn);
-		if(rename(job->sidecar, fn))
-		{
-			fprintf(stderr, "%s: %s: failed to move '%s' to '%s': %s\n", short_program_name, job->name, job->sidecar, fn, strerror(errno));
-			free(fn);
-			return -1;
-		}
-		if(updatepaths)
-		{
-			job_set_sidecar(job, fn);
-		}
-		} */
 	free(fn);
 	return 0;
 }
@@ -0,0 +1,615 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_spool.h"
+
+#ifdef HAVE_SYS_SOCKET_H
+# include <sys/socket.h>
+#endif
+#ifdef HAVE_SYS_UN_H
+# include <sys/un.h>
+#endif
+#ifdef HAVE_POLL_H
+# include <poll.h>
+#endif
+#include <stdarg.h>
+#include <time.h>
+
+/* Statistics are counters, gauges and latency histograms, identified by
+ * small integers: the built-in ones are listed below (and in p_spool.h),
+ * and others (such as the per-recipe histograms) are registered at
+ * startup. Updates are lock-free, so they can be made from any thread.
+ *
+ * Histograms are log-linear, in the manner of HDR histograms: each power
+ * of two (in nanoseconds) is divided into HIST_SUB equal sub-buckets, so
+ * that any value is recorded to within 1/HIST_SUB of its magnitude.
+ *
+ * If stats:socket is set, a thread serves the statistics over a Unix
+ * domain socket there: a client may send 'json' or 'prometheus' (the
+ * default) followed by a newline, or an HTTP GET request for /metrics or
+ * /json, and the statistics are written back in that format before the
+ * connection is closed.
+ */
+
+#define STATS_MAX                       256
+#define HIST_SUBBITS                    4
+#define HIST_SUB                        (1 << HIST_SUBBITS)
+/* Values of 2^HIST_MAXBITS ns (about 18 minutes) or more share a bucket */
+#define HIST_MAXBITS                    40
+#define HIST_BUCKETS                    ((HIST_MAXBITS - HIST_SUBBITS + 1) * HIST_SUB)
+#define STATS_REQLEN                    256
+
+#define STATS_COUNTER                   0
+#define STATS_GAUGE                     1
+#define STATS_HISTOGRAM                 2
+
+struct stat_struct
+{
+	const char *name;
+	/* Optional label (e.g., 'recipe') and its value */
+	const char *label;
+	const char *value;
+	int kind;
+	const char *help;
+	/* Counter or gauge value, or histogram count; updated atomically */
+	long long count;
+	/* Histograms only */
+	unsigned long long sum;
+	unsigned long long min;
+	unsigned long long max;
+	unsigned long long *buckets;
+};
+
+struct buffer
+{
+	char *buf;
+	size_t len;
+	size_t alloc;
+};
+
+/* Internal utilities */
+static void *stats_serve(void *arg);
+static void stats_respond(int fd);
+static int hist_index(unsigned long long v);
+static unsigned long long hist_lower(int index);
+static unsigned long long hist_quantile(STAT *s, unsigned long long count, double q);
+static void format_prometheus(struct buffer *b);
+static void format_json(struct buffer *b);
+static void append(struct buffer *b, const char *fmt, ...);
+static void send_all(int fd, struct buffer *b);
+
+static STAT stats[STATS_MAX] = {
+	{ "spool_collect_seconds", NULL, NULL, STATS_HISTOGRAM, "Time taken to collect a job (or a batch of jobs) from a source", 0, 0, 0, 0, NULL },
+	{ "spool_identify_seconds", NULL, NULL, STATS_HISTOGRAM, "Time taken to identify the type of an asset", 0, 0, 0, 0, NULL },
+	{ "spool_id_assign_seconds", NULL, NULL, STATS_HISTOGRAM, "Time taken to assign identifiers to a job (or a batch of jobs)", 0, 0, 0, 0, NULL },
+	{ "spool_create_container_seconds", NULL, NULL, STATS_HISTOGRAM, "Time taken to create a job's storage container", 0, 0, 0, 0, NULL },
+	{ "spool_copy_asset_seconds", NULL, NULL, STATS_HISTOGRAM, "Time taken to copy an asset into storage", 0, 0, 0, 0, NULL },
+	{ "spool_jobs_collected_total", NULL, NULL, STATS_COUNTER, "Jobs collected from sources", 0, 0, 0, 0, NULL },
+	{ "spool_jobs_completed_total", NULL, NULL, STATS_COUNTER, "Jobs completed", 0, 0, 0, 0, NULL },
+	{ "spool_jobs_aborted_total", NULL, NULL, STATS_COUNTER, "Jobs aborted", 0, 0, 0, 0, NULL },
+	{ "spool_bytes_stored_total", NULL, NULL, STATS_COUNTER, "Bytes copied into storage", 0, 0, 0, 0, NULL },
+	{ "spool_errors_total", NULL, NULL, STATS_COUNTER, "Errors while identifying, storing or processing assets", 0, 0, 0, 0, NULL },
+	{ "spool_recipes_run_total", NULL, NULL, STATS_COUNTER, "Recipes run", 0, 0, 0, 0, NULL },
+	{ "spool_recipes_failed_total", NULL, NULL, STATS_COUNTER, "Recipes which failed", 0, 0, 0, 0, NULL },
+	{ "spool_queue_length", "queue", "metadata", STATS_GAUGE, "Jobs waiting between pipeline stages", 0, 0, 0, 0, NULL },
+	{ "spool_queue_length", "queue", "id", STATS_GAUGE, "Jobs waiting between pipeline stages", 0, 0, 0, 0, NULL },
+	{ "spool_queue_length", "queue", "store", STATS_GAUGE, "Jobs waiting between pipeline stages", 0, 0, 0, 0, NULL },
+	{ "spool_queue_length", "queue", "recipe", STATS_GAUGE, "Jobs waiting between pipeline stages", 0, 0, 0, 0, NULL },
+	{ "spool_fs_dircache_misses_total", NULL, NULL, STATS_COUNTER, "Containers whose parent directory wasn't in the storage directory cache", 0, 0, 0, 0, NULL },
+	{ "spool_recipe_cache_hits_total", NULL, NULL, STATS_COUNTER, "Recipe outputs found in the recipe cache", 0, 0, 0, 0, NULL },
+	{ "spool_recipe_cache_misses_total", NULL, NULL, STATS_COUNTER, "Recipe outputs not found in the recipe cache", 0, 0, 0, 0, NULL },
+	{ "spool_recipe_cache_stores_total", NULL, NULL, STATS_COUNTER, "Recipe outputs added to the recipe cache", 0, 0, 0, 0, NULL },
+	{ "spool_recipe_cache_evictions_total", NULL, NULL, STATS_COUNTER, "Entries evicted from the recipe cache", 0, 0, 0, 0, NULL },
+	{ "spool_store_files_total", "method", "rename", STATS_COUNTER, "Assets placed into storage, by method", 0, 0, 0, 0, NULL },
+	{ "spool_store_files_total", "method", "link", STATS_COUNTER, "Assets placed into storage, by method", 0, 0, 0, 0, NULL },
+	{ "spool_store_files_total", "method", "reflink", STATS_COUNTER, "Assets placed into storage, by method", 0, 0, 0, 0, NULL },
+	{ "spool_store_files_total", "method", "copy_file_range", STATS_COUNTER, "Assets placed into storage, by method", 0, 0, 0, 0, NULL },
+	{ "spool_store_files_total", "method", "sendfile", STATS_COUNTER, "Assets placed into storage, by method", 0, 0, 0, 0, NULL },
+	{ "spool_store_files_total", "method", "read/write", STATS_COUNTER, "Assets placed into storage, by method", 0, 0, 0, 0, NULL },
+	{ "spool_store_bytes_total", "method", "rename", STATS_COUNTER, "Bytes placed into storage, by method", 0, 0, 0, 0, NULL },
+	{ "spool_store_bytes_total", "method", "link", STATS_COUNTER, "Bytes placed into storage, by method", 0, 0, 0, 0, NULL },
+	{ "spool_store_bytes_total", "method", "reflink", STATS_COUNTER, "Bytes placed into storage, by method", 0, 0, 0, 0, NULL },
+	{ "spool_store_bytes_total", "method", "copy_file_range", STATS_COUNTER, "Bytes placed into storage, by method", 0, 0, 0, 0, NULL },
+	{ "spool_store_bytes_total", "method", "sendfile", STATS_COUNTER, "Bytes placed into storage, by method", 0, 0, 0, 0, NULL },
+	{ "spool_store_bytes_total", "method", "read/write", STATS_COUNTER, "Bytes placed into storage, by method", 0, 0, 0, 0, NULL },
+};
+static int nstats = STAT_NBUILTIN;
+static char *sockpath;
+
+/* Allocate the built-in histograms and start serving statistics, if a
+ * socket has been configured
+ */
+int
+stats_init(void)
+{
+	struct sockaddr_un sa;
+	const char *path;
+	pthread_t thread;
+	int c, fd, r;
+
+	for(c = 0; c < nstats; c++)
+	{
+		if(stats[c].kind == STATS_HISTOGRAM && !stats[c].buckets)
+		{
+			stats[c].buckets = (unsigned long long *) calloc(HIST_BUCKETS, sizeof(unsigned long long));
+			if(!stats[c].buckets)
+			{
+				return -1;
+			}
+			stats[c].min = ~0ULL;
+		}
+	}
+	path = config_get("stats:socket", NULL);
+	if(!path || !path[0])
+	{
+		return 0;
+	}
+	if(strlen(path) >= sizeof(sa.sun_path))
+	{
+		LOG(LOG_ERR, "%s: socket path is too long\n", path);
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	sockpath = strdup(path);
+	if(!sockpath)
+	{
+		return -1;
+	}
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd == -1)
+	{
+		return -1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	/* Remove the socket left behind by a previous instance */
+	unlink(path);
+	if(bind(fd, (struct sockaddr *) &sa, sizeof(sa)) || listen(fd, 8))
+	{
+		LOG(LOG_ERR, "%s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	r = pthread_create(&thread, NULL, stats_serve, (void *) (long) fd);
+	if(r)
+	{
+		close(fd);
+		errno = r;
+		return -1;
+	}
+	pthread_detach(thread);
+	LOG(LOG_INFO, "serving statistics on %s\n", path);
+	return 0;
+}
+
+/* Register a histogram with an optional label, returning its identifier;
+ * this must be done before stats_init() is called.
+ */
+int
+stats_register(const char *name, const char *label, const char *value, const char *help)
+{
+	STAT *s;
+
+	if(nstats == STATS_MAX)
+	{
+		errno = ENOSPC;
+		return -1;
+	}
+	s = &(stats[nstats]);
+	s->name = name;
+	s->label = label;
+	s->value = (value ? strdup(value) : NULL);
+	s->kind = STATS_HISTOGRAM;
+	s->help = help;
+	s->min = ~0ULL;
+	s->buckets = (unsigned long long *) calloc(HIST_BUCKETS, sizeof(unsigned long long));
+	if(!s->buckets || (value && !s->value))
+	{
+		free(s->buckets);
+		s->buckets = NULL;
+		return -1;
+	}
+	nstats++;
+	return nstats - 1;
+}
+
+/* Return a monotonic timestamp in nanoseconds */
+unsigned long long
+stats_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Record the time elapsed since start (from stats_clock()) in a histogram */
+void
+stats_time(int id, unsigned long long start)
+{
+	STAT *s;
+	unsigned long long v, cur;
+
+	if(id < 0 || id >= nstats || !stats[id].buckets)
+	{
+		return;
+	}
+	s = &(stats[id]);
+	v = stats_clock() - start;
+	__sync_add_and_fetch(&(s->buckets[hist_index(v)]), 1);
+	__sync_add_and_fetch(&(s->sum), v);
+	__sync_add_and_fetch(&(s->count), 1);
+	for(cur = s->min; v < cur; cur = s->min)
+	{
+		if(__sync_bool_compare_and_swap(&(s->min), cur, v))
+		{
+			break;
+		}
+	}
+	for(cur = s->max; v > cur; cur = s->max)
+	{
+		if(__sync_bool_compare_and_swap(&(s->max), cur, v))
+		{
+			break;
+		}
+	}
+}
+
+/* Add to a counter or gauge */
+void
+stats_add(int id, long long n)
+{
+	if(id < 0 || id >= nstats)
+	{
+		return;
+	}
+	__sync_add_and_fetch(&(stats[id].count), n);
+}
+
+/* Return the value of a counter or gauge, or the count of a histogram */
+long long
+stats_get(int id)
+{
+	if(id < 0 || id >= nstats)
+	{
+		return 0;
+	}
+	return __sync_add_and_fetch(&(stats[id].count), 0);
+}
+
+/* Accept connections on the statistics socket, one at a time */
+static void *
+stats_serve(void *arg)
+{
+	int fd, cfd;
+
+	fd = (int) (long) arg;
+	for(;;)
+	{
+		cfd = accept(fd, NULL, NULL);
+		if(cfd == -1)
+		{
+			if(errno == EINTR || errno == ECONNABORTED)
+			{
+				continue;
+			}
+			LOG(LOG_ERR, "%s: %s\n", sockpath, strerror(errno));
+			sleep(1);
+			continue;
+		}
+		stats_respond(cfd);
+		close(cfd);
+	}
+	return NULL;
+}
+
+/* Read a client's request (if it sends one promptly) and respond to it */
+static void
+stats_respond(int fd)
+{
+	struct pollfd pfd;
+	struct buffer b, h;
+	char req[STATS_REQLEN];
+	size_t len;
+	ssize_t r;
+	int json, http;
+
+	len = 0;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while(len < sizeof(req) - 1 && poll(&pfd, 1, 250) == 1)
+	{
+		r = read(fd, &(req[len]), sizeof(req) - 1 - len);
+		if(r <= 0)
+		{
+			break;
+		}
+		len += r;
+		if(memchr(req, '\n', len))
+		{
+			break;
+		}
+	}
+	req[len] = 0;
+	http = !strncmp(req, "GET ", 4);
+	if(http)
+	{
+		json = (strstr(req, "/json") || strstr(req, "format=json"));
+	}
+	else
+	{
+		json = !strncmp(req, "json", 4);
+	}
+	memset(&b, 0, sizeof(b));
+	if(json)
+	{
+		format_json(&b);
+	}
+	else
+	{
+		format_prometheus(&b);
+	}
+	if(!b.buf)
+	{
+		return;
+	}
+	if(http)
+	{
+		memset(&h, 0, sizeof(h));
+		append(&h, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %lu\r\nConnection: close\r\n\r\n",
+			   (json ? "application/json" : "text/plain; version=0.0.4"), (unsigned long) b.len);
+		if(h.buf)
+		{
+			send_all(fd, &h);
+			free(h.buf);
+		}
+	}
+	send_all(fd, &b);
+	free(b.buf);
+}
+
+static int
+hist_index(unsigned long long v)
+{
+	int msb, shift;
+
+	if(v < HIST_SUB)
+	{
+		return (int) v;
+	}
+	for(msb = 0; (v >> msb) > 1; msb++);
+	if(msb >= HIST_MAXBITS)
+	{
+		return HIST_BUCKETS - 1;
+	}
+	shift = msb - HIST_SUBBITS;
+	return (shift + 1) * HIST_SUB + (int) ((v >> shift) & (HIST_SUB - 1));
+}
+
+/* The smallest value recorded in a bucket */
+static unsigned long long
+hist_lower(int index)
+{
+	int shift;
+
+	if(index < HIST_SUB)
+	{
+		return index;
+	}
+	shift = index / HIST_SUB - 1;
+	return (unsigned long long) (HIST_SUB + index % HIST_SUB) << shift;
+}
+
+/* Estimate a quantile from a histogram's buckets */
+static unsigned long long
+hist_quantile(STAT *s, unsigned long long count, double q)
+{
+	unsigned long long seen, target;
+	int c;
+
+	if(!count)
+	{
+		return 0;
+	}
+	target = (unsigned long long) (q * count + 0.5);
+	if(target < 1)
+	{
+		target = 1;
+	}
+	seen = 0;
+	for(c = 0; c < HIST_BUCKETS; c++)
+	{
+		seen += s->buckets[c];
+		if(seen >= target)
+		{
+			/* Report the midpoint of the bucket, within the observed range */
+			if(c + 1 < HIST_BUCKETS)
+			{
+				target = (hist_lower(c) + hist_lower(c + 1)) / 2;
+			}
+			else
+			{
+				target = hist_lower(c);
+			}
+			if(target > s->max)
+			{
+				target = s->max;
+			}
+			if(target < s->min)
+			{
+				target = s->min;
+			}
+			return target;
+		}
+	}
+	return s->max;
+}
+
+/* Format the statistics in the Prometheus text exposition format; the
+ * histograms' buckets are aggregated into 1-2.5-5 steps from 1us to 100s
+ */
+static void
+format_prometheus(struct buffer *b)
+{
+	static const double bounds[] = {
+		1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4, 1e-3, 2.5e-3, 5e-3,
+		1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 25, 50, 100
+	};
+	STAT *s;
+	unsigned long long cumulative, count;
+	char label[256];
+	int c, d, i;
+
+	for(c = 0; c < nstats; c++)
+	{
+		s = &(stats[c]);
+		if(!c || strcmp(s->name, stats[c - 1].name))
+		{
+			append(b, "# HELP %s %s\n# TYPE %s %s\n", s->name, s->help, s->name,
+				   (s->kind == STATS_COUNTER ? "counter" : (s->kind == STATS_GAUGE ? "gauge" : "histogram")));
+		}
+		if(s->label)
+		{
+			snprintf(label, sizeof(label), "%s=\"%s\"", s->label, s->value);
+		}
+		else
+		{
+			label[0] = 0;
+		}
+		if(s->kind != STATS_HISTOGRAM)
+		{
+			append(b, "%s%s%s%s %lld\n", s->name, (label[0] ? "{" : ""), label, (label[0] ? "}" : ""), s->count);
+			continue;
+		}
+		if(!s->buckets)
+		{
+			continue;
+		}
+		cumulative = 0;
+		i = 0;
+		for(d = 0; d < (int) (sizeof(bounds) / sizeof(bounds[0])); d++)
+		{
+			for(; i < HIST_BUCKETS && hist_lower(i + 1) <= (unsigned long long) (bounds[d] * 1e9); i++)
+			{
+				cumulative += s->buckets[i];
+			}
+			append(b, "%s_bucket{%s%sle=\"%g\"} %llu\n", s->name, label, (label[0] ? "," : ""), bounds[d], cumulative);
+		}
+		/* Count the buckets rather than using s->count, so that the totals
+		 * agree even if values are being recorded concurrently
+		 */
+		for(; i < HIST_BUCKETS; i++)
+		{
+			cumulative += s->buckets[i];
+		}
+		count = cumulative;
+		append(b, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", s->name, label, (label[0] ? "," : ""), count);
+		append(b, "%s_sum%s%s%s %.9f\n", s->name, (label[0] ? "{" : ""), label, (label[0] ? "}" : ""), s->sum / 1e9);
+		append(b, "%s_count%s%s%s %llu\n", s->name, (label[0] ? "{" : ""), label, (label[0] ? "}" : ""), count);
+	}
+}
+
+/* Format the statistics as a JSON array of objects */
+static void
+format_json(struct buffer *b)
+{
+	STAT *s;
+	unsigned long long count;
+	int c;
+
+	append(b, "[");
+	for(c = 0; c < nstats; c++)
+	{
+		s = &(stats[c]);
+		append(b, "%s\n  {\"name\": \"%s\"", (c ? "," : ""), s->name);
+		if(s->label)
+		{
+			/* Labels are recipe names and the like, which needn't be escaped */
+			append(b, ", \"labels\": {\"%s\": \"%s\"}", s->label, s->value);
+		}
+		if(s->kind != STATS_HISTOGRAM)
+		{
+			append(b, ", \"type\": \"%s\", \"value\": %lld}", (s->kind == STATS_COUNTER ? "counter" : "gauge"), s->count);
+			continue;
+		}
+		count = s->count;
+		append(b, ", \"type\": \"histogram\", \"count\": %llu, \"sum\": %.9f, \"min\": %.9f, \"max\": %.9f, \"p50\": %.9f, \"p90\": %.9f, \"p99\": %.9f, \"p999\": %.9f}",
+			   count, s->sum / 1e9, (count ? s->min : 0) / 1e9, s->max / 1e9,
+			   hist_quantile(s, count, 0.5) / 1e9, hist_quantile(s, count, 0.9) / 1e9,
+			   hist_quantile(s, count, 0.99) / 1e9, hist_quantile(s, count, 0.999) / 1e9);
+	}
+	append(b, "\n]\n");
+}
+
+static void
+append(struct buffer *b, const char *fmt, ...)
+{
+	va_list ap;
+	char *p;
+	int r;
+
+	for(;;)
+	{
+		va_start(ap, fmt);
+		r = vsnprintf((b->buf ? &(b->buf[b->len]) : NULL), b->alloc - b->len, fmt, ap);
+		va_end(ap);
+		if(r < 0)
+		{
+			return;
+		}
+		if(b->len + r < b->alloc)
+		{
+			b->len += r;
+			return;
+		}
+		p = (char *) realloc(b->buf, b->alloc + r + 4096);
+		if(!p)
+		{
+			return;
+		}
+		b->buf = p;
+		b->alloc += r + 4096;
+	}
+}
+
+/* Write a buffer to a client, which may have gone away: MSG_NOSIGNAL
+ * prevents that from raising SIGPIPE
+ */
+static void
+send_all(int fd, struct buffer *b)
+{
+	size_t c;
+	ssize_t r;
+
+	for(c = 0; c < b->len; c += r)
+	{
+		r = send(fd, &(b->buf[c]), b->len - c, MSG_NOSIGNAL);
+		if(r == -1 && errno == EINTR)
+		{
+			r = 0;
+			continue;
+		}
+		if(r <= 0)
+		{
+			break;
+		}
+	}
+}
@@ -18,8 +18,16 @@
 # include "config.h"
 #endif
 
+/* Default shape of the storage hierarchy; see fs_create_container() */
 #define HIERWIDTH                       3
 #define HIERDEPTH                       4
+/* Default number of digits of a time-ordered identifier used for the top
+ * level of the hierarchy when fs:shard is 'time'; 6 hex digits of a
+ * millisecond timestamp is a new directory every 4.66 hours
+ */
+#define TIMEWIDTH                       6
+/* Default number of open directory descriptors cached */
+#define DIRCACHE_SIZE                   4096
 #define STORAGE_STRUCT_DEFINED          1
 
 #include "p_spool.h"
@@ -32,8 +40,45 @@ struct storage_struct
 	/* Private data */
 	char *path;
 	size_t pathlen;
+	/* How assets are brought into storage (INGEST_xxx) */
+	int ingest;
+	/* Shape of the hierarchy */
+	int shard;
+	size_t width;
+	size_t depth;
+	size_t timewidth;
+	/* Descriptor for the root of the store, or -1 if not yet opened */
+	int rootfd;
+	/* Cache of descriptors for directories within the hierarchy */
+	struct dircache *dircache;
+	size_t dircachesize;
+	pthread_rwlock_t dirlock;
+};
+
+/* A cached descriptor for a directory within the hierarchy; key is the
+ * directory's path relative to the root of the store (e.g., "AAA/BBB").
+ * The cache is direct-mapped: a new entry simply replaces whichever one
+ * occupied its slot.
+ */
+struct dircache
+{
+	char *key;
+	size_t keylen;
+	int fd;
 };
 
+/* Ingest modes: assets on the same filesystem as the store can be linked
+ * or moved into place instead of being copied; those on other filesystems
+ * are always copied.
+ */
+#define INGEST_COPY                     0
+#define INGEST_LINK                     1
+#define INGEST_RENAME                   2
+
+/* How containers are distributed across the hierarchy */
+#define SHARD_PREFIX                    0
+#define SHARD_TIME                      1
+
 /* Storage API methods */
 static ASSET *fs_create_container(STORAGE *me, JOB *job);
 static ASSET *fs_copy_asset(STORAGE *me, JOB *dest, ASSET *asset);
@@ -45,275 +90,440 @@ static STORAGE_API fs_api = {
 };
 
 /* Utilities */
-static int copy_file(const char *srcpath, const char *destpath);
-static int open_file(const char *path, int opt, int mode);
+static int ingest_file(STORAGE *me, const char *srcpath, const char *destdir, const char *destpath, COPYSTATS *stats);
+static int dir_lookup(STORAGE *me, const char *rel, size_t len);
+static void dir_insert(STORAGE *me, const char *rel, size_t len, int fd);
+static int dir_make(STORAGE *me, const char *rel, const size_t *ends);
 static int close_file(int filedes);
-static ssize_t read_file(int filedes, char *buf, ssize_t len);
-static ssize_t write_file(int filedes, const char *buf, ssize_t len);
 
 /* Create an instance of the storage mechanism */
 STORAGE *
 fs_create(void)
 {
 	STORAGE *p;
-	const char *basepath;
-	char *s;
-	size_t l;
+	const char *basepath, *ingest, *shard;
+	int width, depth, timewidth, cachesize;
+	size_t c, keylen;
+	char *keys;
 
 	basepath = config_get("fs:store", "store");
+	ingest = config_get("fs:ingest", "copy");
+	width = config_get_int("fs:width", HIERWIDTH);
+	depth = config_get_int("fs:depth", HIERDEPTH);
+	cachesize = config_get_int("fs:dircache", DIRCACHE_SIZE);
+	shard = config_get("fs:shard", "prefix");
+	timewidth = config_get_int("fs:timewidth", TIMEWIDTH);
+	/* Each level of the hierarchy uses the next 'width' hex digits of the
+	 * identifier, of which there are 32
+	 */
+	if(width < 1 || depth < 0 || width * depth > 32)
+	{
+		LOG(LOG_ERR, "fs:width and fs:depth must be positive and use no more than 32 digits\n");
+		errno = EINVAL;
+		return NULL;
+	}
+	if(cachesize < 16)
+	{
+		cachesize = 16;
+	}
 	p = (STORAGE *) calloc(1, sizeof(STORAGE));
 	if(!p)
 	{
 		return NULL;
 	}
 	p->api = &fs_api;
-	/* Ensure the path length includes enough space for an asset base
-	 * path.
-	 */
-	l = strlen(basepath) + ((HIERWIDTH + 1) * HIERDEPTH) + 32 + 4;
-	s = (char *) calloc(1, l);
-	if(!s)
+	if(!strcmp(shard, "time"))
+	{
+		/* The top level uses the leading digits of the timestamp (of
+		 * which there are 12), and the remaining levels the random digits
+		 * at the end of the identifier (of which there are 15)
+		 */
+		if(depth < 1 || timewidth < 1 || timewidth > 12 || width * (depth - 1) > 15)
+		{
+			LOG(LOG_ERR, "fs:shard: 'time' requires fs:timewidth between 1 and 12, and fs:width * (fs:depth - 1) to be no more than 15\n");
+			free(p);
+			errno = EINVAL;
+			return NULL;
+		}
+		p->shard = SHARD_TIME;
+	}
+	else if(strcmp(shard, "prefix"))
 	{
+		LOG(LOG_ERR, "fs:shard: unsupported sharding scheme '%s'\n", shard);
 		free(p);
+		errno = EINVAL;
 		return NULL;
 	}
-	strcpy(s, basepath);
-	p->path = s;
+	if(!strcmp(ingest, "link"))
+	{
+		p->ingest = INGEST_LINK;
+	}
+	else if(!strcmp(ingest, "rename"))
+	{
+		p->ingest = INGEST_RENAME;
+	}
+	else if(!strcmp(ingest, "copy"))
+	{
+		p->ingest = INGEST_COPY;
+	}
+	else
+	{
+		LOG(LOG_ERR, "fs:ingest: unsupported ingest mode '%s'\n", ingest);
+		free(p);
+		errno = EINVAL;
+		return NULL;
+	}
+	p->width = width;
+	p->depth = depth;
+	p->timewidth = (p->shard == SHARD_TIME ? (size_t) timewidth : 0);
+	p->rootfd = -1;
+	p->dircachesize = cachesize;
+	p->path = strdup(basepath);
+	p->dircache = (struct dircache *) calloc(cachesize, sizeof(struct dircache));
+	keylen = (width + 1) * depth + p->timewidth + 1;
+	keys = (char *) calloc(cachesize, keylen);
+	if(!p->path || !p->dircache || !keys)
+	{
+		free(p->path);
+		free(p->dircache);
+		free(keys);
+		free(p);
+		return NULL;
+	}
+	for(c = 0; c < p->dircachesize; c++)
+	{
+		p->dircache[c].key = &(keys[c * keylen]);
+		p->dircache[c].fd = -1;
+	}
+	pthread_rwlock_init(&(p->dirlock), NULL);
 	p->pathlen = strlen(basepath);
 	return p;
 }
 
-/* Create the storage area for a job */
+/* Create the storage area for a job.
+ *
+ * Containers are placed in a hierarchy of fs:depth levels of directories,
+ * each named after the next fs:width hex digits of the job's identifier.
+ * If width was 3 and depth was 4, the result would be:
+ *
+ * path/AAA/BBB/CCC/DDD/AAABBBCCDDDEEE...
+ *
+ * Descriptors for the directories in the hierarchy are cached, and
+ * containers created relative to them, so that in the common case creating
+ * a container takes a single mkdirat().
+ *
+ * If fs:shard is 'time', and the identifier is time-ordered (see id.c),
+ * the top level is instead named after the first fs:timewidth digits of
+ * the identifier's timestamp, and the levels below it after the random
+ * digits at the end of the identifier:
+ *
+ * path/TTTTTT/XXX/YYY/ZZZ/TTTTTT...XXXYYYZZZ
+ *
+ * so that containers created at around the same time share a top-level
+ * directory (and its descriptors remain cached), while still being spread
+ * evenly beneath it.
+ *
+ * If the job's identifier has been used before (see index.c), its
+ * container may already exist, in which case it's re-used.
+ */
 static ASSET *
 fs_create_container(STORAGE *me, JOB *job)
 {
-	size_t c, max, pp, start, end;
-	struct stat sbuf;
+	size_t c, max, rl, start, end;
+	size_t ends[32];
 	ASSET *asset;
-	int r;
+	char *path, *rel;
+	int r, fd, e, timed;
 
-	asset = asset_create();
+	asset = asset_create_arena(job->arena);
 	if(!asset)
 	{
 		return NULL;
 	}
 	asset->container = 1;
-	/* Ensure the base path is reset back to its original value */
-	me->path[me->pathlen] = 0;
-	/* Construct a base path based upon HIERWIDTH and HIERDEPTH, derived
-	 * from job->id. If HIERWIDTH was 3 and HIERDEPTH was 4, the result
-	 * would be:
-	 *
-	 * path/AAA/BBB/CCC/DDD/AAABBBCCDDDEEE...
-	 */	
-	pp = me->pathlen;
+	path = (char *) malloc(me->pathlen + ((me->width + 1) * me->depth) + me->timewidth + 32 + 4);
+	if(!path)
+	{
+		asset_free(asset);
+		return NULL;
+	}
+	memcpy(path, me->path, me->pathlen);
+	path[me->pathlen] = '/';
+	/* Build the path of the container's parent relative to the root */
+	rel = &(path[me->pathlen + 1]);
+	rl = 0;
 	max = strlen(job->id->canonical);
-	for(c = 0; c < HIERDEPTH; c++)
+	/* The version is the 13th digit */
+	timed = (me->shard == SHARD_TIME && max == 32 && job->id->canonical[12] == '7');
+	for(c = 0; c < me->depth; c++)
 	{
-		start = c * HIERWIDTH;
-		if(start > max)
+		if(timed)
 		{
-			break;
+			start = (c ? max - (me->depth - c) * me->width : 0);
+			end = (c ? start + me->width : me->timewidth);
 		}
-		end = start + HIERWIDTH;
-		if(end > max)
+		else
 		{
-			end = max;
+			start = c * me->width;
+			end = start + me->width;
 		}
-		me->path[pp] = '/';
-		pp++;
-		memcpy(&(me->path[pp]), &(job->id->canonical[start]), end - start);
-		pp += end - start;
-		me->path[pp] = 0;
-		r = stat(me->path, &sbuf);
-		if(!r)
+		if(end > max)
 		{
-			/* File exists */
-			if(S_ISDIR(sbuf.st_mode))
-			{
-				/* It's a directory */
-				continue;
-			}
+			end = max;
 		}
-		r = mkdir(me->path, 0777);
-		if(r < 0)
+		if(c)
 		{
-			fprintf(stderr, "%s: %s: %s\n", short_program_name, me->path, strerror(errno));
-			asset_free(asset);
-			return NULL;
+			rel[rl] = '/';
+			rl++;
 		}
+		memcpy(&(rel[rl]), &(job->id->canonical[start]), end - start);
+		rl += end - start;
+		ends[c] = rl;
 	}
-	me->path[pp] = '/';
-	pp++;
-	strcpy(&(me->path[pp]), job->id->canonical);
-	r = mkdir(me->path, 0777);
-	if(r < 0)
+	rel[rl] = 0;
+	pthread_rwlock_rdlock(&(me->dirlock));
+	fd = dir_lookup(me, rel, rl);
+	if(fd != -1)
 	{
-		fprintf(stderr, "%s: %s: %s\n", short_program_name, me->path, strerror(errno));
+		r = mkdirat(fd, job->id->canonical, 0777);
+		e = errno;
+		pthread_rwlock_unlock(&(me->dirlock));
+	}
+	else
+	{
+		pthread_rwlock_unlock(&(me->dirlock));
+		stats_add(STAT_DIRCACHE_MISSES, 1);
+		pthread_rwlock_wrlock(&(me->dirlock));
+		fd = dir_make(me, rel, ends);
+		r = (fd == -1 ? -1 : mkdirat(fd, job->id->canonical, 0777));
+		e = errno;
+		pthread_rwlock_unlock(&(me->dirlock));
+	}
+	if(r < 0 && !(e == EEXIST && job->reused))
+	{
+		LOG(LOG_ERR, "%s/%s: %s\n", (rl ? path : me->path), job->id->canonical, strerror(e));
+		free(path);
 		asset_free(asset);
+		errno = e;
 		return NULL;
 	}
-	r = asset_set_path(asset, me->path);
+	if(rl)
+	{
+		rel[rl] = '/';
+		rl++;
+	}
+	strcpy(&(rel[rl]), job->id->canonical);
+	r = asset_set_path(asset, path);
+	free(path);
 	if(r < 0)
 	{
 		asset_free(asset);
 		return NULL;
 	}
-	me->path[me->pathlen] = 0;	
 	return asset;
 }
 
-static ASSET *
-fs_copy_asset(STORAGE *me, JOB *job, ASSET *asset)
+/* Return the cached descriptor for a directory within the hierarchy, or -1;
+ * the caller must hold dirlock.
+ */
+static int
+dir_lookup(STORAGE *me, const char *rel, size_t len)
 {
-	ASSET *dest;
-	int r;
+	struct dircache *ent;
 
-	(void) me;
-	
-	dest = asset_create();
-	if(!dest)
+	if(!len)
 	{
-		return NULL;
+		return me->rootfd;
 	}
-	asset_set_path_basedir_ext(dest, job->container->path, 0, job->id->canonical, asset->ext);
-	asset_copy_attributes(dest, asset);
-	fprintf(stderr, "%s: %s: copying '%s' to '%s'\n", short_program_name, job->name, asset->path, dest->path);
-	/* Perform a file-copy operation */
-	r = copy_file(asset->path, dest->path);
-	if(r < 0)
+	ent = &(me->dircache[util_hash(rel, len) % me->dircachesize]);
+	if(ent->fd != -1 && ent->keylen == len && !memcmp(ent->key, rel, len))
 	{
-		asset_free(dest);
-		return NULL;
+		return ent->fd;
 	}
-	return dest;
+	return -1;
 }
 
-static int
-copy_file(const char *srcpath, const char *destpath)
+/* Add a directory's descriptor to the cache, closing the one it replaces;
+ * the caller must hold dirlock for writing.
+ */
+static void
+dir_insert(STORAGE *me, const char *rel, size_t len, int fd)
 {
-	static char *buf;
-	static ssize_t bufsize;
+	struct dircache *ent;
 
-	int sfd, dfd, e;
-	ssize_t rlen, r;
+	ent = &(me->dircache[util_hash(rel, len) % me->dircachesize]);
+	if(ent->fd != -1)
+	{
+		close_file(ent->fd);
+	}
+	memcpy(ent->key, rel, len);
+	ent->keylen = len;
+	ent->fd = fd;
+}
+
+/* Open (creating if needed) each level of the hierarchy below the deepest
+ * one which is already cached, and return a descriptor for the container's
+ * parent, which remains owned by the cache. ends[n] is the length of the
+ * relative path to level n + 1. The caller must hold dirlock for writing.
+ */
+static int
+dir_make(STORAGE *me, const char *rel, const size_t *ends)
+{
+	char name[33];
+	size_t level, start;
+	int fd, nfd;
 
-	/* Use and re-use a static buffer */
-	if(!buf)
+	if(me->rootfd == -1)
 	{
-		/* Use a 4MB buffer */
-		bufsize = (4 * 1024 * 1024);
-		buf = malloc(bufsize);
-		if(!buf)
+		do
+		{
+			me->rootfd = open(me->path, O_RDONLY|O_DIRECTORY);
+		}
+		while(me->rootfd == -1 && errno == EINTR);
+		if(me->rootfd == -1)
 		{
 			return -1;
 		}
 	}
-	sfd = open_file(srcpath, O_RDONLY, 0);
-	if(sfd < 0)
+	fd = -1;
+	for(level = me->depth; level > 0; level--)
 	{
-		return -1;
+		fd = dir_lookup(me, rel, ends[level - 1]);
+		if(fd != -1)
+		{
+			break;
+		}
 	}
-	dfd = open_file(destpath, O_WRONLY|O_CREAT, 0666);
-	if(dfd < 0)
+	if(!level)
 	{
-		e = errno;
-		close_file(sfd);
-		errno = e;
-		return -1;
+		fd = me->rootfd;
 	}
-	for(;;)
+	for(; level < me->depth; level++)
 	{
-		rlen = read_file(sfd, buf, bufsize);
-		if(rlen == -1)
+		start = (level ? ends[level - 1] + 1 : 0);
+		memcpy(name, &(rel[start]), ends[level] - start);
+		name[ends[level] - start] = 0;
+		nfd = openat(fd, name, O_RDONLY|O_DIRECTORY);
+		if(nfd == -1 && errno == ENOENT)
 		{
-			/* Read failed */
-			close_file(sfd);
-			close_file(dfd);
-			return -1;
-		}
-		if(!rlen)
-		{
-			break;
+			/* EEXIST means something else created it first */
+			if(mkdirat(fd, name, 0777) && errno != EEXIST)
+			{
+				return -1;
+			}
+			nfd = openat(fd, name, O_RDONLY|O_DIRECTORY);
 		}
-		r = write_file(sfd, buf, rlen);
-		if(r == -1)
+		if(nfd == -1)
 		{
-			/* Write failed */
-			close_file(sfd);
-			close_file(dfd);
 			return -1;
 		}
+		/* This may evict the parent, which is no longer needed */
+		dir_insert(me, rel, ends[level], nfd);
+		fd = nfd;
 	}
-	close_file(sfd);
-	close_file(dfd);
-	return 0;
+	return fd;
 }
 
-static int
-open_file(const char *path, int opt, int mode)
+static ASSET *
+fs_copy_asset(STORAGE *me, JOB *job, ASSET *asset)
 {
-	int fd;
+	COPYSTATS stats;
+	ASSET *dest;
+	int r;
 
-	do
+	dest = asset_create_arena(job->arena);
+	if(!dest)
 	{
-		fd = open(path, opt, mode);
+		return NULL;
 	}
-	while(fd == -1 && errno == EINTR);
-	return fd;
+	asset_set_path_basedir_ext(dest, ASSET_PATH(job->container), 0, job->id->canonical, ASSET_EXT(asset));
+	asset_copy_attributes(dest, asset);
+	LOG(LOG_DEBUG, "%s: copying '%s' to '%s'\n", job->name, ASSET_PATH(asset), ASSET_PATH(dest));
+	if(job->reused && unlink(ASSET_PATH(dest)) && errno != ENOENT)
+	{
+		/* Replace, rather than overwrite, a previously-stored copy, which
+		 * may share its inode with a file elsewhere
+		 */
+		LOG(LOG_ERR, "%s: %s\n", ASSET_PATH(dest), strerror(errno));
+		asset_free(dest);
+		return NULL;
+	}
+	r = 1;
+	if(me->ingest != INGEST_COPY)
+	{
+		r = ingest_file(me, ASSET_PATH(asset), ASSET_PATH(job->container), ASSET_PATH(dest), &stats);
+	}
+	if(r > 0)
+	{
+		/* Perform a file-copy operation */
+		r = copy_file(ASSET_PATH(asset), ASSET_PATH(dest), O_TRUNC, &stats);
+	}
+	if(r < 0)
+	{
+		asset_free(dest);
+		return NULL;
+	}
+	stats_add(STAT_BYTES_STORED, stats.bytes);
+	stats_add(STAT_STORE_FILES + stats.method, 1);
+	stats_add(STAT_STORE_BYTES + stats.method, stats.bytes);
+	LOG(LOG_DEBUG, "%s: stored %lld bytes in %.3fs (%.1f MB/s) using %s\n", job->name,
+			(long long) stats.bytes, stats.seconds,
+			(stats.seconds > 0 ? ((double) stats.bytes / (1024.0 * 1024.0)) / stats.seconds : 0.0),
+			copy_method_name(stats.method));
+	return dest;
 }
 
+/* Link or move a file into the store, if it's on the same filesystem as
+ * the destination directory. Returns 0 on success, -1 on failure, or 1 if
+ * the file must be copied instead.
+ */
 static int
-close_file(int filedes)
+ingest_file(STORAGE *me, const char *srcpath, const char *destdir, const char *destpath, COPYSTATS *stats)
 {
-
+	struct stat sbuf, dbuf;
 	int r;
 
-	do
+	if(stat(srcpath, &sbuf) || stat(destdir, &dbuf))
 	{
-		r = close(filedes);
+		return -1;
 	}
-	while(r == -1 && errno == EINTR);
-	return r;
+	if(sbuf.st_dev != dbuf.st_dev)
+	{
+		return 1;
+	}
+	stats->bytes = sbuf.st_size;
+	stats->seconds = 0;
+	if(me->ingest == INGEST_RENAME)
+	{
+		/* The asset will no longer be present in its source location */
+		stats->method = COPY_RENAME;
+		r = rename(srcpath, destpath);
+	}
+	else
+	{
+		stats->method = COPY_LINK;
+		r = link(srcpath, destpath);
+	}
+	if(r && (errno == EXDEV || errno == EPERM || errno == EMLINK))
+	{
+		/* Not possible after all (e.g., a bind mount, or a filesystem
+		 * which doesn't support hard links)
+		 */
+		return 1;
+	}
+	return (r ? -1 : 0);
 }
 
-static ssize_t
-read_file(int filedes, char *buf, ssize_t len)
+static int
+close_file(int filedes)
 {
-	ssize_t r;
+
+	int r;
 
 	do
 	{
-		r = read(filedes, buf, len);
+		r = close(filedes);
 	}
 	while(r == -1 && errno == EINTR);
 	return r;
 }
-
-static ssize_t
-write_file(int filedes, const char *buf, ssize_t len)
-{
-	ssize_t r;
-
-	while(len)
-	{
-		do
-		{
-			r = write(filedes, buf, len);
-		}
-		while(r == -1 && errno == EINTR);
-		if(r == -1)
-		{
-			return -1;
-		}
-		if(r > len)
-		{
-			/* Nonsensical */
-			errno = EINVAL;
-			return -1;
-		}
-		len -= r;
-		buf += r;
-	}
-	return 0;
-}
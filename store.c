@@ -20,35 +20,113 @@
 
 #include "p_spool.h"
 
+/* Internal utilities */
+static void trace_copy(JOB *job, ASSET *stored, unsigned long long start);
+
 /* Create storage for a job */
 int
 store_create_container(JOB *job)
+{
+	int status;
+
+	status = 0;
+	store_create_container_batch(&job, 1, &status);
+	return status;
+}
+
+/* Create storage for a batch of jobs, recording the new containers in the
+ * journal together. Jobs whose status[n] is already non-zero are skipped,
+ * and status[n] is set to -1 for any job whose container couldn't be
+ * created. Returns -1 if any of the jobs failed, or 0 otherwise.
+ */
+int
+store_create_container_batch(JOB **jobs, size_t njobs, int *status)
 {
 	STORAGE *storage;
 	ASSET *container;
-	int r;
+	JOB **created;
+	const char **paths;
+	unsigned long long start;
+	size_t c;
+	int r, e;
 
 	/* For the moment, we'll assign the storage manually. This should
 	 * be driven by defaults or something, though.
 	 */
 	storage = plugin_storage("file");
-	if(!storage)
+	created = (JOB **) calloc(njobs, sizeof(JOB *));
+	paths = (const char **) calloc(njobs, sizeof(char *));
+	if(!storage || !created || !paths)
 	{
+		e = errno;
+		free(created);
+		free(paths);
+		for(c = 0; c < njobs; c++)
+		{
+			if(!status[c])
+			{
+				LOG(LOG_ERR, "%s: failed to create container for job: %s\n", jobs[c]->name, strerror(e));
+				status[c] = -1;
+			}
+		}
 		return -1;
 	}
-	job->storage = storage;
-	container = job->storage->api->create_container(job->storage, job);
-	if(!container)
+	for(c = 0; c < njobs; c++)
 	{
-		return -1;
+		if(status[c])
+		{
+			continue;
+		}
+		jobs[c]->storage = storage;
+		if(jobs[c]->container)
+		{
+			/* Resumed from the journal */
+			continue;
+		}
+		start = stats_clock();
+		container = storage->api->create_container(storage, jobs[c]);
+		if(!container)
+		{
+			LOG(LOG_ERR, "%s: failed to create container for job: %s\n", jobs[c]->name, strerror(errno));
+			stats_add(STAT_ERRORS, 1);
+			status[c] = -1;
+			continue;
+		}
+		stats_time(STAT_CREATE_CONTAINER, start);
+		TRACE("create_container", jobs[c]->name, 0, start, 0);
+		if(job_set_container(jobs[c], container) < 0)
+		{
+			LOG(LOG_ERR, "%s: failed to create container for job: %s\n", jobs[c]->name, strerror(errno));
+			asset_free(container);
+			status[c] = -1;
+			continue;
+		}
+		created[c] = jobs[c];
+		paths[c] = ASSET_PATH(jobs[c]->container);
 	}
-	r = job_set_container(job, container);
-	if(r < 0)
+	if(journal_record_batch(created, njobs, JOURNAL_CONTAINER, paths) < 0)
 	{
-		asset_free(container);
-		return -1;
+		e = errno;
+		for(c = 0; c < njobs; c++)
+		{
+			if(created[c])
+			{
+				LOG(LOG_ERR, "%s: failed to record container of job: %s\n", jobs[c]->name, strerror(e));
+				status[c] = -1;
+			}
+		}
 	}
-	return 0;
+	free(created);
+	free(paths);
+	r = 0;
+	for(c = 0; c < njobs; c++)
+	{
+		if(status[c])
+		{
+			r = -1;
+		}
+	}
+	return r;
 }
 
 /* Copy source assets to destination storage */
@@ -56,23 +134,51 @@ int
 store_copy_source(JOB *job)
 {
 	ASSET *asset;
+	unsigned long long start;
 
+	if(job->stored)
+	{
+		/* Resumed from the journal */
+		return 0;
+	}
+	start = stats_clock();
 	asset = job->storage->api->copy_asset(job->storage, job, job->asset);
 	if(!asset)
 	{
+		stats_add(STAT_ERRORS, 1);
 		return -1;
 	}
+	stats_time(STAT_COPY_ASSET, start);
+	trace_copy(job, asset, start);
 	job->stored = asset;
 	if(job->sidecar)
 	{
+		start = stats_clock();
 		asset = job->storage->api->copy_asset(job->storage, job, job->sidecar);
 		if(!asset)
 		{
+			stats_add(STAT_ERRORS, 1);
 			return -1;
 		}
+		stats_time(STAT_COPY_ASSET, start);
+		trace_copy(job, asset, start);
 		job->stored_sidecar = asset;
 	}
-	return 0;
+	return journal_record(job, JOURNAL_STORED, ASSET_PATH(job->stored), (job->stored_sidecar ? ASSET_PATH(job->stored_sidecar) : ""));
+}
+
+/* Record the copying of an asset in the trace, along with the size of the
+ * stored copy
+ */
+static void
+trace_copy(JOB *job, ASSET *stored, unsigned long long start)
+{
+	struct stat sbuf;
+
+	if(trace_enabled)
+	{
+		trace_span("copy_asset", job->name, 0, start, (stat(ASSET_PATH(stored), &sbuf) ? 0 : (unsigned long long) sbuf.st_size));
+	}
 }
 
 /*
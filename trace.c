@@ -0,0 +1,336 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_spool.h"
+
+#include <time.h>
+
+/* If trace:file is set, spans are recorded for each step a job passes
+ * through (at the same points as the latency histograms in stats.c) and
+ * written there as Chrome trace-event JSON, which can be loaded into
+ * Perfetto or chrome://tracing.
+ *
+ * Each span is recorded on the thread which did the work; steps which
+ * operate on a batch of jobs record a single span with the size of the
+ * batch. In addition, each job has a span of its own, from the start of
+ * its collection until it was completed or aborted, on a track of its
+ * own: gaps between the job's span and the work done on its behalf are
+ * time spent waiting.
+ *
+ * As with log messages, spans are added to a ring buffer belonging to
+ * the recording thread (see ring.c), and a background thread
+ * formats and writes them out periodically. Spans are dropped (and
+ * counted) if a thread's ring is full. The file is a JSON array which is
+ * never closed, so that a trace remains usable if spoold is killed.
+ */
+
+#define TRACE_SLOTS                     4096
+#define TRACE_LABELLEN                  64
+#define TRACE_BUFLEN                    65536
+/* Longest formatted span: the fixed parts of a pair of events, plus
+ * three strings of up to TRACE_LABELLEN characters, each of which may
+ * need escaping
+ */
+#define TRACE_EVENTLEN                  (512 + 3 * (TRACE_LABELLEN * 6 + 2))
+/* Interval between drains, in milliseconds */
+#define TRACE_INTERVAL                  100
+
+#define SPAN_WORK                       0
+#define SPAN_JOB                        1
+
+typedef struct tracespan_struct TRACESPAN;
+
+struct tracespan_struct
+{
+	int kind;
+	/* The step (which must outlive the trace), or for a job span, its
+	 * outcome
+	 */
+	const char *name;
+	/* Job name or asset path, possibly truncated; may be empty */
+	char label[TRACE_LABELLEN];
+	unsigned long count;
+	unsigned long long bytes;
+	/* In nanoseconds, from stats_clock() */
+	unsigned long long start;
+	unsigned long long end;
+};
+
+/* Internal utilities */
+static void *trace_run(void *arg);
+static void trace_drain(void);
+static void trace_record(int kind, const char *name, const char *label, size_t count, unsigned long long start, unsigned long long bytes);
+static size_t trace_format(char *buf, const TRACESPAN *span, unsigned int tid);
+static size_t format_string(char *buf, const char *s, size_t max);
+static size_t format_time(char *buf, unsigned long long ns);
+
+int trace_enabled;
+
+static int fd = -1;
+static pid_t pid;
+static unsigned long njobs;
+static unsigned long dropped;
+static RINGSET rings;
+static char *outbuf;
+
+/* Open the trace file, if one has been configured, and start the thread
+ * which writes spans to it
+ */
+int
+trace_init(void)
+{
+	const char *path;
+	pthread_t thread;
+	int c, r;
+
+	path = config_get("trace:file", NULL);
+	if(!path || !path[0])
+	{
+		return 0;
+	}
+	c = config_get_int("trace:buffer", TRACE_SLOTS);
+	if(c < 16)
+	{
+		c = 16;
+	}
+	outbuf = (char *) malloc(TRACE_BUFLEN);
+	if(!outbuf || ring_init(&rings, sizeof(TRACESPAN), c) < 0)
+	{
+		return -1;
+	}
+	fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+	if(fd == -1)
+	{
+		LOG(LOG_ERR, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	pid = getpid();
+	util_write(fd, "[\n", 2);
+	r = pthread_create(&thread, NULL, trace_run, NULL);
+	if(r)
+	{
+		errno = r;
+		return -1;
+	}
+	pthread_detach(thread);
+	trace_enabled = 1;
+	atexit(trace_flush);
+	LOG(LOG_INFO, "writing trace to %s\n", path);
+	return 0;
+}
+
+/* Record a span of work which began at start (from stats_clock()) and
+ * has just finished; label is the job (or asset) concerned, if any, and
+ * count the number of jobs if the work was done for a batch. Use TRACE()
+ * rather than calling this directly.
+ */
+void
+trace_span(const char *name, const char *label, size_t count, unsigned long long start, unsigned long long bytes)
+{
+	trace_record(SPAN_WORK, name, label, count, start, bytes);
+}
+
+/* Record the span of a job which has just been completed or aborted */
+void
+trace_job(const JOB *job)
+{
+	trace_record(SPAN_JOB, (job->aborted ? "aborted" : "completed"), job->name, 0, job->collected, 0);
+}
+
+/* Write any buffered spans out immediately */
+void
+trace_flush(void)
+{
+	if(trace_enabled)
+	{
+		trace_drain();
+	}
+}
+
+static void
+trace_record(int kind, const char *name, const char *label, size_t count, unsigned long long start, unsigned long long bytes)
+{
+	RING *ring;
+	TRACESPAN *span;
+	size_t l;
+
+	span = (TRACESPAN *) ring_reserve(&rings, &ring);
+	if(!span)
+	{
+		__sync_add_and_fetch(&dropped, 1);
+		return;
+	}
+	span->kind = kind;
+	span->name = name;
+	l = (label ? strlen(label) : 0);
+	if(l >= TRACE_LABELLEN)
+	{
+		/* The end of a path is more telling than its beginning */
+		label += l - (TRACE_LABELLEN - 1);
+		l = TRACE_LABELLEN - 1;
+	}
+	memcpy(span->label, (label ? label : ""), l);
+	span->label[l] = 0;
+	span->count = count;
+	span->bytes = bytes;
+	span->start = start;
+	span->end = stats_clock();
+	ring_commit(ring);
+}
+
+static void *
+trace_run(void *arg)
+{
+	struct timespec ts;
+
+	(void) arg;
+
+	for(;;)
+	{
+		ts.tv_sec = TRACE_INTERVAL / 1000;
+		ts.tv_nsec = (TRACE_INTERVAL % 1000) * 1000000L;
+		nanosleep(&ts, NULL);
+		trace_drain();
+	}
+	return NULL;
+}
+
+/* Write out the spans in all of the rings; unlike log messages, spans
+ * carry their own timestamps, so the order they're written in doesn't
+ * matter
+ */
+static void
+trace_drain(void)
+{
+	RING *ring;
+	TRACESPAN *span;
+	unsigned long n;
+	size_t len;
+
+	len = 0;
+	for(ring = ring_drain_begin(&rings); ring; ring = ring->next)
+	{
+		while((span = (TRACESPAN *) ring_peek(&rings, ring)))
+		{
+			if(len + TRACE_EVENTLEN > TRACE_BUFLEN)
+			{
+				util_write(fd, outbuf, len);
+				len = 0;
+			}
+			len += trace_format(&(outbuf[len]), span, ring->id);
+			ring_consume(ring);
+		}
+	}
+	util_write(fd, outbuf, len);
+	n = dropped;
+	if(n)
+	{
+		__sync_sub_and_fetch(&dropped, n);
+		LOG(LOG_WARNING, "%lu trace span(s) dropped because the buffer was full\n", n);
+	}
+	ring_drain_end(&rings);
+}
+
+/* Format a span as one trace event (or, for a job, a pair of async
+ * events sharing an identifier), each followed by a comma, returning the
+ * length written
+ */
+static size_t
+trace_format(char *buf, const TRACESPAN *span, unsigned int tid)
+{
+	size_t len;
+
+	len = 0;
+	if(span->kind == SPAN_JOB)
+	{
+		njobs++;
+		len += sprintf(&(buf[len]), "{\"ph\":\"b\",\"cat\":\"job\",\"id\":%lu,\"pid\":%d,\"tid\":%u,\"ts\":", njobs, (int) pid, tid);
+		len += format_time(&(buf[len]), span->start);
+		len += sprintf(&(buf[len]), ",\"name\":");
+		len += format_string(&(buf[len]), span->label, TRACE_LABELLEN);
+		len += sprintf(&(buf[len]), ",\"args\":{\"status\":\"%s\"}},\n", span->name);
+		len += sprintf(&(buf[len]), "{\"ph\":\"e\",\"cat\":\"job\",\"id\":%lu,\"pid\":%d,\"tid\":%u,\"ts\":", njobs, (int) pid, tid);
+		len += format_time(&(buf[len]), span->end);
+		len += sprintf(&(buf[len]), ",\"name\":");
+		len += format_string(&(buf[len]), span->label, TRACE_LABELLEN);
+		len += sprintf(&(buf[len]), "},\n");
+		return len;
+	}
+	len += sprintf(&(buf[len]), "{\"ph\":\"X\",\"cat\":\"spool\",\"pid\":%d,\"tid\":%u,\"ts\":", (int) pid, tid);
+	len += format_time(&(buf[len]), span->start);
+	len += sprintf(&(buf[len]), ",\"dur\":");
+	len += format_time(&(buf[len]), span->end - span->start);
+	len += sprintf(&(buf[len]), ",\"name\":");
+	len += format_string(&(buf[len]), span->name, TRACE_LABELLEN);
+	len += sprintf(&(buf[len]), ",\"args\":{");
+	if(span->label[0])
+	{
+		len += sprintf(&(buf[len]), "\"label\":");
+		len += format_string(&(buf[len]), span->label, TRACE_LABELLEN);
+	}
+	if(span->count)
+	{
+		len += sprintf(&(buf[len]), "%s\"jobs\":%lu", (span->label[0] ? "," : ""), span->count);
+	}
+	if(span->bytes)
+	{
+		len += sprintf(&(buf[len]), "%s\"bytes\":%llu", (span->label[0] || span->count ? "," : ""), span->bytes);
+	}
+	len += sprintf(&(buf[len]), "}},\n");
+	return len;
+}
+
+/* Format (up to max characters of) a string as a JSON string literal;
+ * buf must have room for six times that many, plus three
+ */
+static size_t
+format_string(char *buf, const char *s, size_t max)
+{
+	size_t len;
+
+	len = 0;
+	buf[len++] = '"';
+	for(; *s && max; s++, max--)
+	{
+		if(*s == '"' || *s == '\\')
+		{
+			buf[len++] = '\\';
+			buf[len++] = *s;
+		}
+		else if((unsigned char) *s < 0x20)
+		{
+			len += sprintf(&(buf[len]), "\\u%04x", (unsigned int) (unsigned char) *s);
+		}
+		else
+		{
+			buf[len++] = *s;
+		}
+	}
+	buf[len++] = '"';
+	buf[len] = 0;
+	return len;
+}
+
+/* Trace timestamps are in microseconds */
+static size_t
+format_time(char *buf, unsigned long long ns)
+{
+	return sprintf(buf, "%llu.%03llu", ns / 1000ULL, ns % 1000ULL);
+}
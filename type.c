@@ -19,6 +19,37 @@
 #endif
 
 #include "p_spool.h"
+#include "identify/mimedb.h"
+
+/* The MIME type registry: every type an asset can have is interned here,
+ * so that an asset's type is a pointer to a canonical, immutable MIMETYPE
+ * rather than a string of its own.
+ *
+ * The registry is seeded on first use with the static MIMETYPEs generated
+ * from mime.types (see identify/mimedb.h), which carry the flags for the
+ * types treated specially; only types from elsewhere (an ext:types
+ * override file, the magic signatures, or recipes) are allocated when
+ * they're registered. The identification plug-ins register the types
+ * they can return when they're created, so identifying an asset doesn't
+ * touch the registry at all.
+ */
+
+/* Open-addressed table of registered types, always a power of two in size
+ * and kept no more than half full
+ */
+static const MIMETYPE **types;
+static size_t ntypes, nslots;
+static pthread_rwlock_t typelock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_once_t typeonce = PTHREAD_ONCE_INIT;
+/* Set if seeding the registry failed */
+static int seed_errno;
+
+/* Internal utilities */
+static void type_seed(void);
+static void type_insert(const MIMETYPE *type, unsigned long hash);
+static const MIMETYPE *type_find_locked(const char *name, size_t len, unsigned long hash);
+static int type_grow(size_t n);
+static size_t type_canon(char *buf, size_t bufsize, const char *name);
 
 /* Attempt to identify an asset using the identification plug-ins */
 int
@@ -27,25 +58,227 @@ type_identify_asset(ASSET *asset)
 	IDENTIFY **list;
 	size_t c;
 	int r;
+	unsigned long long start;
 
+	start = stats_clock();
 	list = plugin_identify_list();
 	if(!list)
 	{
-		fprintf(stderr, "%s: failed to obtain set of identification mechanisms: %s\n", short_program_name, strerror(errno));
+		LOG(LOG_ERR, "failed to obtain set of identification mechanisms: %s\n", strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 	for(c = 0; list[c]; c++)
 	{
 		r = list[c]->api->identify(list[c], asset);
 		if(r < 0)
-		{			
+		{
+			stats_add(STAT_ERRORS, 1);
 			return -1;
 		}
 	}
+	stats_time(STAT_IDENTIFY, start);
+	TRACE("identify", ASSET_PATH(asset), 0, start, 0);
 	if(!asset->type)
 	{
-		fprintf(stderr, "%s: unable to identify type of '%s'\n", short_program_name, asset->path);
+		LOG(LOG_WARNING, "unable to identify type of '%s'\n", ASSET_PATH(asset));
 		return 0;
 	}
 	return 1;
 }
+
+/* Obtain the canonical MIMETYPE for a type name, registering it if it
+ * hasn't been seen before; returns NULL (with errno set) on failure
+ */
+const MIMETYPE *
+type_intern(const char *name)
+{
+	char buf[256];
+	const MIMETYPE *t;
+	MIMETYPE *p;
+	unsigned long h;
+	size_t len;
+
+	pthread_once(&typeonce, type_seed);
+	if(seed_errno)
+	{
+		errno = seed_errno;
+		return NULL;
+	}
+	len = type_canon(buf, sizeof(buf), name);
+	if(!len)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	h = util_hash(buf, len);
+	pthread_rwlock_rdlock(&typelock);
+	t = type_find_locked(buf, len, h);
+	pthread_rwlock_unlock(&typelock);
+	if(t)
+	{
+		return t;
+	}
+	pthread_rwlock_wrlock(&typelock);
+	/* Another thread may have registered it in the meantime */
+	t = type_find_locked(buf, len, h);
+	if(t)
+	{
+		pthread_rwlock_unlock(&typelock);
+		return t;
+	}
+	if((ntypes + 1) * 2 > nslots && type_grow(nslots * 2) < 0)
+	{
+		pthread_rwlock_unlock(&typelock);
+		return NULL;
+	}
+	p = (MIMETYPE *) malloc(sizeof(MIMETYPE) + len + 1);
+	if(!p)
+	{
+		pthread_rwlock_unlock(&typelock);
+		return NULL;
+	}
+	memcpy((char *) (p + 1), buf, len + 1);
+	p->name = (const char *) (p + 1);
+	p->flags = 0;
+	type_insert(p, h);
+	pthread_rwlock_unlock(&typelock);
+	return p;
+}
+
+/* Obtain the MIMETYPE for a type name, if it has been registered */
+const MIMETYPE *
+type_find(const char *name)
+{
+	char buf[256];
+	const MIMETYPE *t;
+	size_t len;
+
+	pthread_once(&typeonce, type_seed);
+	len = type_canon(buf, sizeof(buf), name);
+	if(!len)
+	{
+		return NULL;
+	}
+	pthread_rwlock_rdlock(&typelock);
+	t = type_find_locked(buf, len, util_hash(buf, len));
+	pthread_rwlock_unlock(&typelock);
+	return t;
+}
+
+/* Register the built-in types */
+static void
+type_seed(void)
+{
+	size_t c, n;
+
+	n = 0;
+	while(mimedb_types[n])
+	{
+		n++;
+	}
+	c = 2048;
+	while(c < n * 2)
+	{
+		c *= 2;
+	}
+	if(type_grow(c) < 0)
+	{
+		seed_errno = errno;
+		return;
+	}
+	for(c = 0; c < n; c++)
+	{
+		type_insert(mimedb_types[c], util_hash(mimedb_types[c]->name, strlen(mimedb_types[c]->name)));
+	}
+}
+
+/* Add a type to the table, which must have room for it; must be called
+ * with typelock held for writing (or before the table is shared)
+ */
+static void
+type_insert(const MIMETYPE *type, unsigned long hash)
+{
+	size_t c;
+
+	c = hash & (nslots - 1);
+	while(types[c])
+	{
+		c = (c + 1) & (nslots - 1);
+	}
+	types[c] = type;
+	ntypes++;
+}
+
+static const MIMETYPE *
+type_find_locked(const char *name, size_t len, unsigned long hash)
+{
+	size_t c;
+
+	if(!ntypes)
+	{
+		return NULL;
+	}
+	for(c = hash & (nslots - 1); types[c]; c = (c + 1) & (nslots - 1))
+	{
+		if(!strncmp(types[c]->name, name, len) && !types[c]->name[len])
+		{
+			return types[c];
+		}
+	}
+	return NULL;
+}
+
+/* Resize the table to n slots, a power of two; must be called with
+ * typelock held for writing (or before the table is shared)
+ */
+static int
+type_grow(size_t n)
+{
+	const MIMETYPE **p;
+	size_t c, d;
+
+	p = (const MIMETYPE **) calloc(n, sizeof(MIMETYPE *));
+	if(!p)
+	{
+		return -1;
+	}
+	for(c = 0; c < nslots; c++)
+	{
+		if(!types[c])
+		{
+			continue;
+		}
+		d = util_hash(types[c]->name, strlen(types[c]->name)) & (n - 1);
+		while(p[d])
+		{
+			d = (d + 1) & (n - 1);
+		}
+		p[d] = types[c];
+	}
+	free(types);
+	types = p;
+	nslots = n;
+	return 0;
+}
+
+/* Copy a type name into buf in lower case (MIME types are
+ * case-insensitive), returning its length, or zero if it's empty or too
+ * long
+ */
+static size_t
+type_canon(char *buf, size_t bufsize, const char *name)
+{
+	size_t len;
+
+	for(len = 0; name[len]; len++)
+	{
+		if(len + 1 == bufsize)
+		{
+			return 0;
+		}
+		buf[len] = tolower((unsigned char) name[len]);
+	}
+	buf[len] = 0;
+	return len;
+}
+
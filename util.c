@@ -0,0 +1,185 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_spool.h"
+
+/* Small helpers shared between modules */
+
+/* Join a directory and a name, returning a new string */
+char *
+util_path_join(const char *dir, const char *name)
+{
+	char *p;
+
+	p = (char *) malloc(strlen(dir) + strlen(name) + 2);
+	if(!p)
+	{
+		return NULL;
+	}
+	sprintf(p, "%s/%s", dir, name);
+	return p;
+}
+
+/* Recursively remove a file or directory; it isn't an error if it doesn't
+ * exist
+ */
+int
+util_remove_tree(const char *path)
+{
+	struct stat sbuf;
+	DIR *d;
+	struct dirent *de;
+	char *p;
+
+	if(lstat(path, &sbuf))
+	{
+		return (errno == ENOENT ? 0 : -1);
+	}
+	if(!S_ISDIR(sbuf.st_mode))
+	{
+		return unlink(path);
+	}
+	d = opendir(path);
+	if(!d)
+	{
+		return -1;
+	}
+	while((de = readdir(d)))
+	{
+		if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+		{
+			continue;
+		}
+		p = util_path_join(path, de->d_name);
+		if(p)
+		{
+			util_remove_tree(p);
+			free(p);
+		}
+	}
+	closedir(d);
+	return rmdir(path);
+}
+
+/* Append a separator (if sep is non-zero) and an escaped field to a
+ * buffer, growing it as needed; '%', tab and newline are escaped as
+ * %25, %09 and %0A, as used by the journal and the index
+ */
+int
+util_escape(char **buf, size_t *len, size_t *alloc, char sep, const char *str)
+{
+	char *p;
+	size_t l;
+
+	l = strlen(str);
+	if(*len + l * 3 + 2 > *alloc)
+	{
+		p = (char *) realloc(*buf, *alloc + l * 3 + 1024);
+		if(!p)
+		{
+			return -1;
+		}
+		*buf = p;
+		*alloc += l * 3 + 1024;
+	}
+	if(sep)
+	{
+		(*buf)[*len] = sep;
+		(*len)++;
+	}
+	for(; *str; str++)
+	{
+		if(*str == '%' || *str == '\t' || *str == '\n')
+		{
+			(*len) += sprintf(&((*buf)[*len]), "%%%02X", (unsigned char) *str);
+			continue;
+		}
+		(*buf)[*len] = *str;
+		(*len)++;
+	}
+	return 0;
+}
+
+/* Decode a field escaped by util_escape() in place */
+void
+util_unescape(char *str)
+{
+	char *p;
+	unsigned int ch;
+
+	for(p = str; *str; str++, p++)
+	{
+		if(*str == '%' && isxdigit((unsigned char) str[1]) && isxdigit((unsigned char) str[2]) && sscanf(&(str[1]), "%2x", &ch) == 1)
+		{
+			*p = (char) ch;
+			str += 2;
+			continue;
+		}
+		*p = *str;
+	}
+	*p = 0;
+}
+
+/* Write the whole of a buffer, retrying if interrupted */
+int
+util_write(int fd, const void *buf, size_t len)
+{
+	size_t w;
+	ssize_t r;
+
+	for(w = 0; w < len; w += r)
+	{
+		r = write(fd, (const char *) buf + w, len - w);
+		if(r == -1 && errno == EINTR)
+		{
+			r = 0;
+			continue;
+		}
+		if(r < 0)
+		{
+			return -1;
+		}
+		if(!r)
+		{
+			/* No progress, but no error either; don't spin */
+			errno = EIO;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Hash a buffer with FNV-1a (32-bit) */
+unsigned long
+util_hash(const void *data, size_t len)
+{
+	const unsigned char *p;
+	unsigned long h;
+	size_t c;
+
+	p = (const unsigned char *) data;
+	h = 2166136261UL;
+	for(c = 0; c < len; c++)
+	{
+		h ^= p[c];
+		h *= 16777619UL;
+	}
+	return h;
+}